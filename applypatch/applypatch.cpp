@@ -27,9 +27,11 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <functional>
 #include <memory>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -43,40 +45,118 @@
 #include "otautil/cache_location.h"
 #include "otautil/print_sha1.h"
 
-static int LoadPartitionContents(const std::string& filename, FileContents* file);
+// The max number of worker threads used to apply the chunks of an imgdiff patch.
+static constexpr size_t kMaxImagePatchThreads = 4;
+
+// The size of the buffer used when streaming to, or reading back from, a partition.
+static constexpr size_t kPartitionBufferSize = 1 << 20;
+
+// The alignment of the buffer, offset and length for O_DIRECT reads.
+static constexpr size_t kDirectIoAlignment = 4096;
+
+static int LoadPartitionContents(const std::string& filename, FileContents* file,
+                                 bool load_data);
 static size_t FileSink(const unsigned char* data, size_t len, int fd);
 static int GenerateTarget(const FileContents& source_file, const std::unique_ptr<Value>& patch,
                           const std::string& target_filename,
                           const uint8_t target_sha1[SHA_DIGEST_LENGTH], const Value* bonus_data);
 
-// Read a file into memory; store the file contents and associated metadata in *file.
-// Return 0 on success.
-int LoadFileContents(const char* filename, FileContents* file) {
+// Read exactly 'len' bytes from 'fd' into 'data'. Return the number of bytes read, which is less
+// than 'len' on EOF or error.
+static size_t ReadFromFd(int fd, unsigned char* data, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t read_count = TEMP_FAILURE_RETRY(ota_read(fd, data + done, len - done));
+    if (read_count <= 0) {
+      break;
+    }
+    done += read_count;
+  }
+  return done;
+}
+
+// Read the next 'len' bytes from 'fd' in chunks of up to kPartitionBufferSize, and feed them to
+// 'ctx'. The data is appended to 'data' if it's non-null, and otherwise discarded after hashing.
+// Return the number of bytes read, which is less than 'len' on EOF or error.
+static size_t HashFromFd(int fd, size_t len, SHA_CTX* ctx, std::vector<unsigned char>* data) {
+  std::vector<unsigned char> buffer;
+  if (data == nullptr) {
+    buffer.resize(std::min(len, kPartitionBufferSize));
+  }
+
+  size_t done = 0;
+  while (done < len) {
+    size_t to_read = std::min(len - done, kPartitionBufferSize);
+    unsigned char* chunk = buffer.data();
+    if (data != nullptr) {
+      data->resize(data->size() + to_read);
+      chunk = data->data() + data->size() - to_read;
+    }
+    size_t read_count = ReadFromFd(fd, chunk, to_read);
+    SHA1_Update(ctx, chunk, read_count);
+    done += read_count;
+    if (read_count != to_read) {
+      if (data != nullptr) {
+        data->resize(data->size() - (to_read - read_count));
+      }
+      break;
+    }
+  }
+  return done;
+}
+
+// Compute the SHA-1 of a file into file->sha1, and also load its contents into file->data if
+// 'load_data' is true. The file is read in large chunks and hashed as it's read, so the contents
+// are only kept when they're actually needed. Return 0 on success.
+static int LoadFileContentsInternal(const char* filename, FileContents* file, bool load_data) {
   // A special 'filename' beginning with "EMMC:" means to load the contents of a partition.
   if (strncmp(filename, "EMMC:", 5) == 0) {
-    return LoadPartitionContents(filename, file);
+    return LoadPartitionContents(filename, file, load_data);
+  }
+
+  unique_fd fd(ota_open(filename, O_RDONLY));
+  if (fd == -1) {
+    printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+    return -1;
   }
 
   struct stat sb;
-  if (stat(filename, &sb) == -1) {
+  if (fstat(fd, &sb) == -1) {
     printf("failed to stat \"%s\": %s\n", filename, strerror(errno));
     return -1;
   }
+  size_t size = sb.st_size;
 
-  std::vector<unsigned char> data(sb.st_size);
-  unique_file f(ota_fopen(filename, "rb"));
-  if (!f) {
-    printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+  SHA_CTX sha_ctx;
+  SHA1_Init(&sha_ctx);
+  std::vector<unsigned char> data;
+  if (load_data) {
+    data.reserve(size);
+  }
+  size_t bytes_read = HashFromFd(fd, size, &sha_ctx, load_data ? &data : nullptr);
+  if (bytes_read != size) {
+    printf("short read of \"%s\" (%zu bytes of %zu)\n", filename, bytes_read, size);
     return -1;
   }
+  SHA1_Final(file->sha1, &sha_ctx);
+  file->data = std::move(data);
+  return 0;
+}
 
-  size_t bytes_read = ota_fread(data.data(), 1, data.size(), f.get());
-  if (bytes_read != data.size()) {
-    printf("short read of \"%s\" (%zu bytes of %zu)\n", filename, bytes_read, data.size());
+// Read a file into memory; store the file contents and associated metadata in *file.
+// Return 0 on success.
+int LoadFileContents(const char* filename, FileContents* file) {
+  return LoadFileContentsInternal(filename, file, true);
+}
+
+// Compute the SHA-1 of a file (or an "EMMC:" partition) without loading its contents into
+// memory. Return 0 on success.
+int LoadFileSha1(const char* filename, uint8_t sha1[SHA_DIGEST_LENGTH]) {
+  FileContents file;
+  if (LoadFileContentsInternal(filename, &file, false) != 0) {
     return -1;
   }
-  file->data = std::move(data);
-  SHA1(file->data.data(), file->data.size(), file->sha1);
+  memcpy(sha1, file.sha1, SHA_DIGEST_LENGTH);
   return 0;
 }
 
@@ -94,7 +174,12 @@ int LoadFileContents(const char* filename, FileContents* file) {
 // "end-of-file" marker), so the caller must specify the possible
 // lengths and the hash of the data, and we'll do the load expecting
 // to find one of those hashes.
-static int LoadPartitionContents(const std::string& filename, FileContents* file) {
+//
+// The partition is read in large chunks and hashed one candidate size
+// at a time; the matching prefix is only kept in file->data if
+// 'load_data' is true.
+static int LoadPartitionContents(const std::string& filename, FileContents* file,
+                                 bool load_data) {
   std::vector<std::string> pieces = android::base::Split(filename, ":");
   if (pieces.size() < 4 || pieces.size() % 2 != 0 || pieces[0] != "EMMC") {
     printf("LoadPartitionContents called with bad filename \"%s\"\n", filename.c_str());
@@ -116,8 +201,8 @@ static int LoadPartitionContents(const std::string& filename, FileContents* file
   std::sort(pairs.begin(), pairs.end());
 
   const char* partition = pieces[1].c_str();
-  unique_file dev(ota_fopen(partition, "rb"));
-  if (!dev) {
+  unique_fd dev(ota_open(partition, O_RDONLY));
+  if (dev == -1) {
     printf("failed to open emmc partition \"%s\": %s\n", partition, strerror(errno));
     return -1;
   }
@@ -125,28 +210,24 @@ static int LoadPartitionContents(const std::string& filename, FileContents* file
   SHA_CTX sha_ctx;
   SHA1_Init(&sha_ctx);
 
-  // Allocate enough memory to hold the largest size.
-  std::vector<unsigned char> buffer(pairs[pair_count - 1].first);
-  unsigned char* buffer_ptr = buffer.data();
-  size_t buffer_size = 0;  // # bytes read so far
+  std::vector<unsigned char> data;
+  size_t hashed_size = 0;  // # bytes hashed so far
   bool found = false;
 
   for (const auto& pair : pairs) {
     size_t current_size = pair.first;
     const std::string& current_sha1 = pair.second;
 
-    // Read enough additional bytes to get us up to the next size. (Again,
+    // Read and hash enough additional bytes to get us up to the next size. (Again,
     // we're trying the possibilities in order of increasing size).
-    size_t next = current_size - buffer_size;
+    size_t next = current_size - hashed_size;
     if (next > 0) {
-      size_t read = ota_fread(buffer_ptr, 1, next, dev.get());
+      size_t read = HashFromFd(dev, next, &sha_ctx, load_data ? &data : nullptr);
       if (next != read) {
         printf("short read (%zu bytes of %zu) for partition \"%s\"\n", read, next, partition);
         return -1;
       }
-      SHA1_Update(&sha_ctx, buffer_ptr, read);
-      buffer_size += read;
-      buffer_ptr += read;
+      hashed_size += read;
     }
 
     // Duplicate the SHA context and finalize the duplicate so we can
@@ -178,8 +259,7 @@ static int LoadPartitionContents(const std::string& filename, FileContents* file
 
   SHA1_Final(file->sha1, &sha_ctx);
 
-  buffer.resize(buffer_size);
-  file->data = std::move(buffer);
+  file->data = std::move(data);
 
   return 0;
 }
@@ -211,10 +291,73 @@ int SaveFileContents(const char* filename, const FileContents* file) {
   return 0;
 }
 
+// Read back the first 'len' bytes of 'partition' and check that they have the SHA-1 hash
+// 'expected_sha1'. The data is read with O_DIRECT into large aligned buffers, so that it comes
+// from the device rather than from the page cache, without dropping the caches globally. Falls
+// back to a buffered read (after dropping the cached pages of this file only) if O_DIRECT isn't
+// supported by the file system. Return 0 on a match.
+static int VerifyPartitionSha1(const char* partition, size_t len,
+                               const uint8_t expected_sha1[SHA_DIGEST_LENGTH]) {
+  bool direct = true;
+  unique_fd fd(ota_open(partition, O_RDONLY | O_DIRECT));
+  if (fd == -1 && errno == EINVAL) {
+    direct = false;
+    fd.reset(ota_open(partition, O_RDONLY));
+    if (fd != -1) {
+      // Best effort only; a failure here means we might verify against the page cache.
+      posix_fadvise(fd, 0, len, POSIX_FADV_DONTNEED);
+    }
+  }
+  if (fd == -1) {
+    printf("failed to reopen %s for verify: %s\n", partition, strerror(errno));
+    return -1;
+  }
+
+  void* aligned;
+  if (posix_memalign(&aligned, kDirectIoAlignment, kPartitionBufferSize) != 0) {
+    printf("failed to allocate verify buffer\n");
+    return -1;
+  }
+  std::unique_ptr<unsigned char, decltype(&free)> buffer(static_cast<unsigned char*>(aligned),
+                                                         free);
+
+  SHA_CTX ctx;
+  SHA1_Init(&ctx);
+  for (size_t p = 0; p < len;) {
+    size_t to_read = std::min(len - p, kPartitionBufferSize);
+    if (direct) {
+      // O_DIRECT reads must be a multiple of the block size. The extra bytes past 'len' (if any)
+      // are not hashed.
+      to_read = (to_read + kDirectIoAlignment - 1) / kDirectIoAlignment * kDirectIoAlignment;
+    }
+    ssize_t read_count = TEMP_FAILURE_RETRY(ota_read(fd, buffer.get(), to_read));
+    if (read_count == -1) {
+      printf("verify read error %s at %zu: %s\n", partition, p, strerror(errno));
+      return -1;
+    } else if (read_count == 0) {
+      printf("verify read reached unexpected EOF, %s at %zu\n", partition, p);
+      return -1;
+    }
+    size_t used = std::min(static_cast<size_t>(read_count), len - p);
+    SHA1_Update(&ctx, buffer.get(), used);
+    p += used;
+  }
+
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1_Final(digest, &ctx);
+  if (memcmp(digest, expected_sha1, SHA_DIGEST_LENGTH) != 0) {
+    printf("verification of %s failed: expected %s, found %s\n", partition,
+           short_sha1(expected_sha1).c_str(), short_sha1(digest).c_str());
+    return -1;
+  }
+  return 0;
+}
+
 // Write a memory buffer to 'target' partition, a string of the form
 // "EMMC:<partition_device>[:...]". The target name
 // might contain multiple colons, but WriteToPartition() only uses the first
-// two and ignores the rest. Return 0 on success.
+// two and ignores the rest. The written data is read back and checked against
+// the hash of 'data'; the write is retried once on a mismatch. Return 0 on success.
 int WriteToPartition(const unsigned char* data, size_t len, const std::string& target) {
   std::vector<std::string> pieces = android::base::Split(target, ":");
   if (pieces.size() < 2 || pieces[0] != "EMMC") {
@@ -223,30 +366,38 @@ int WriteToPartition(const unsigned char* data, size_t len, const std::string& t
   }
 
   const char* partition = pieces[1].c_str();
-  unique_fd fd(ota_open(partition, O_RDWR));
-  if (fd == -1) {
-    printf("failed to open %s: %s\n", partition, strerror(errno));
-    return -1;
-  }
 
-  size_t start = 0;
+  uint8_t expected_sha1[SHA_DIGEST_LENGTH];
+  SHA_CTX ctx;
+  SHA1_Init(&ctx);
+
   bool success = false;
   for (size_t attempt = 0; attempt < 2; ++attempt) {
-    if (TEMP_FAILURE_RETRY(lseek(fd, start, SEEK_SET)) == -1) {
-      printf("failed seek on %s: %s\n", partition, strerror(errno));
+    unique_fd fd(ota_open(partition, O_RDWR));
+    if (fd == -1) {
+      printf("failed to open %s: %s\n", partition, strerror(errno));
       return -1;
     }
+
+    size_t start = 0;
     while (start < len) {
-      size_t to_write = len - start;
-      if (to_write > 1 << 20) to_write = 1 << 20;
+      size_t to_write = std::min(len - start, kPartitionBufferSize);
 
       ssize_t written = TEMP_FAILURE_RETRY(ota_write(fd, data + start, to_write));
       if (written == -1) {
         printf("failed write writing to %s: %s\n", partition, strerror(errno));
         return -1;
       }
+      // Keep a running hash of what has been written, on the first attempt only; the data is the
+      // same on a retry.
+      if (attempt == 0) {
+        SHA1_Update(&ctx, data + start, written);
+      }
       start += written;
     }
+    if (attempt == 0) {
+      SHA1_Final(expected_sha1, &ctx);
+    }
 
     if (ota_fsync(fd) != 0) {
       printf("failed to sync to %s: %s\n", partition, strerror(errno));
@@ -257,76 +408,12 @@ int WriteToPartition(const unsigned char* data, size_t len, const std::string& t
       return -1;
     }
 
-    fd.reset(ota_open(partition, O_RDONLY));
-    if (fd == -1) {
-      printf("failed to reopen %s for verify: %s\n", partition, strerror(errno));
-      return -1;
-    }
-
-    // Drop caches so our subsequent verification read won't just be reading the cache.
-    sync();
-    unique_fd dc(ota_open("/proc/sys/vm/drop_caches", O_WRONLY));
-    if (TEMP_FAILURE_RETRY(ota_write(dc, "3\n", 2)) == -1) {
-      printf("write to /proc/sys/vm/drop_caches failed: %s\n", strerror(errno));
-    } else {
-      printf("  caches dropped\n");
-    }
-    ota_close(dc);
-    sleep(1);
-
     // Verify.
-    if (TEMP_FAILURE_RETRY(lseek(fd, 0, SEEK_SET)) == -1) {
-      printf("failed to seek back to beginning of %s: %s\n", partition, strerror(errno));
-      return -1;
-    }
-
-    unsigned char buffer[4096];
-    start = len;
-    for (size_t p = 0; p < len; p += sizeof(buffer)) {
-      size_t to_read = len - p;
-      if (to_read > sizeof(buffer)) {
-        to_read = sizeof(buffer);
-      }
-
-      size_t so_far = 0;
-      while (so_far < to_read) {
-        ssize_t read_count = TEMP_FAILURE_RETRY(ota_read(fd, buffer + so_far, to_read - so_far));
-        if (read_count == -1) {
-          printf("verify read error %s at %zu: %s\n", partition, p, strerror(errno));
-          return -1;
-        } else if (read_count == 0) {
-          printf("verify read reached unexpected EOF, %s at %zu\n", partition, p);
-          return -1;
-        }
-        if (static_cast<size_t>(read_count) < to_read) {
-          printf("short verify read %s at %zu: %zd %zu\n", partition, p, read_count, to_read);
-        }
-        so_far += read_count;
-      }
-
-      if (memcmp(buffer, data + p, to_read) != 0) {
-        printf("verification failed starting at %zu\n", p);
-        start = p;
-        break;
-      }
-    }
-
-    if (start == len) {
+    if (VerifyPartitionSha1(partition, len, expected_sha1) == 0) {
       printf("verification read succeeded (attempt %zu)\n", attempt + 1);
       success = true;
       break;
     }
-
-    if (ota_close(fd) != 0) {
-      printf("failed to close %s: %s\n", partition, strerror(errno));
-      return -1;
-    }
-
-    fd.reset(ota_open(partition, O_RDWR));
-    if (fd == -1) {
-      printf("failed to reopen %s for retry write && verify: %s\n", partition, strerror(errno));
-      return -1;
-    }
   }
 
   if (!success) {
@@ -334,10 +421,6 @@ int WriteToPartition(const unsigned char* data, size_t len, const std::string& t
     return -1;
   }
 
-  if (ota_close(fd) == -1) {
-    printf("error closing %s: %s\n", partition, strerror(errno));
-    return -1;
-  }
   sync();
 
   return 0;
@@ -390,25 +473,26 @@ static int FindMatchingPatch(uint8_t* sha1, const std::vector<std::string>& patc
 // match any of the sha1's on the command line (argv[3:]).  Returns
 // nonzero otherwise.
 int applypatch_check(const char* filename, const std::vector<std::string>& patch_sha1_str) {
-  FileContents file;
+  // Only the hashes are needed here, so the contents are never loaded into memory.
+  uint8_t sha1[SHA_DIGEST_LENGTH];
 
   // It's okay to specify no sha1s; the check will pass if the
-  // LoadFileContents is successful.  (Useful for reading
+  // LoadFileSha1 is successful.  (Useful for reading
   // partitions, where the filename encodes the sha1s; no need to
   // check them twice.)
-  if (LoadFileContents(filename, &file) != 0 ||
-      (!patch_sha1_str.empty() && FindMatchingPatch(file.sha1, patch_sha1_str) < 0)) {
+  if (LoadFileSha1(filename, sha1) != 0 ||
+      (!patch_sha1_str.empty() && FindMatchingPatch(sha1, patch_sha1_str) < 0)) {
     printf("file \"%s\" doesn't have any of expected sha1 sums; checking cache\n", filename);
 
     // If the source file is missing or corrupted, it might be because we were killed in the middle
     // of patching it.  A copy of it should have been made in cache_temp_source.  If that file
     // exists and matches the sha1 we're looking for, the check still passes.
-    if (LoadFileContents(CacheLocation::location().cache_temp_source().c_str(), &file) != 0) {
+    if (LoadFileSha1(CacheLocation::location().cache_temp_source().c_str(), sha1) != 0) {
       printf("failed to load cache file\n");
       return 1;
     }
 
-    if (FindMatchingPatch(file.sha1, patch_sha1_str) < 0) {
+    if (FindMatchingPatch(sha1, patch_sha1_str) < 0) {
       printf("cache bits don't match any sha1 for \"%s\"\n", filename);
       return 1;
     }
@@ -453,17 +537,17 @@ int CacheSizeCheck(size_t bytes) {
     return 0;
 }
 
-// This function applies binary patches to EMMC target files in a way that is safe (the original
-// file is not touched until we have the desired replacement for it) and idempotent (it's okay to
-// run this program multiple times).
+// This function applies binary patches to EMMC target files in a way that is safe (a copy of the
+// source is saved to /cache before the target is written, so an interrupted or failed write can be
+// redone from it) and idempotent (it's okay to run this program multiple times).
 //
 // - If the SHA-1 hash of <target_filename> is <target_sha1_string>, does nothing and exits
 //   successfully.
 //
 // - Otherwise, if the SHA-1 hash of <source_filename> is one of the entries in <patch_sha1_str>,
 //   the corresponding patch from <patch_data> (which must be a VAL_BLOB) is applied to produce a
-//   new file (the type of patch is automatically detected from the blob data). If that new file
-//   has SHA-1 hash <target_sha1_str>, moves it to replace <target_filename>, and exits
+//   new file (the type of patch is automatically detected from the blob data), which is streamed
+//   to <target_filename>. If the written data has SHA-1 hash <target_sha1_str>, exits
 //   successfully. Note that if <source_filename> and <target_filename> are not the same,
 //   <source_filename> is NOT deleted on success. <target_filename> may be the string "-" to mean
 //   "the same as <source_filename>".
@@ -495,9 +579,14 @@ int applypatch(const char* source_filename, const char* target_filename,
     return 1;
   }
 
-  // We try to load the target file into the source_file object.
+  // We try to load the target file into the source_file object. If the target is a different file
+  // from the source, only its hash is needed.
+  bool same_file =
+      target_filename == source_filename || strcmp(target_filename, source_filename) == 0;
   FileContents source_file;
-  if (LoadFileContents(target_filename, &source_file) == 0) {
+  int target_loaded = same_file ? LoadFileContents(target_filename, &source_file)
+                                : LoadFileSha1(target_filename, source_file.sha1);
+  if (target_loaded == 0) {
     if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_LENGTH) == 0) {
       // The early-exit case: the patch was already applied, this file has the desired hash, nothing
       // for us to do.
@@ -506,8 +595,7 @@ int applypatch(const char* source_filename, const char* target_filename,
     }
   }
 
-  if (source_file.data.empty() ||
-      (target_filename != source_filename && strcmp(target_filename, source_filename) != 0)) {
+  if (source_file.data.empty() || !same_file) {
     // Need to load the source file: either we failed to load the target file, or we did but it's
     // different from the expected.
     source_file.data.clear();
@@ -568,7 +656,7 @@ int applypatch_flash(const char* source_filename, const char* target_filename,
   pieces.push_back(target_sha1_str);
   std::string fullname = android::base::Join(pieces, ':');
   FileContents source_file;
-  if (LoadPartitionContents(fullname, &source_file) == 0 &&
+  if (LoadPartitionContents(fullname, &source_file, false) == 0 &&
       memcmp(source_file.sha1, target_sha1, SHA_DIGEST_LENGTH) == 0) {
     // The early-exit case: the image was already applied, this partition
     // has the desired hash, nothing for us to do.
@@ -606,6 +694,9 @@ static int GenerateTarget(const FileContents& source_file, const std::unique_ptr
   bool use_bsdiff = false;
   if (header_bytes_read >= 8 && memcmp(header, "BSDIFF40", 8) == 0) {
     use_bsdiff = true;
+  } else if (header_bytes_read >= 5 && memcmp(header, "BSDF2", 5) == 0) {
+    // The brotli (or bzip2) compressed variant of the bsdiff format; bspatch handles both.
+    use_bsdiff = true;
   } else if (header_bytes_read >= 8 && memcmp(header, "IMGDIFF2", 8) == 0) {
     use_bsdiff = false;
   } else {
@@ -615,7 +706,8 @@ static int GenerateTarget(const FileContents& source_file, const std::unique_ptr
 
   CHECK(android::base::StartsWith(target_filename, "EMMC:"));
 
-  // We still write the original source to cache, in case the partition write is interrupted.
+  // Write the original source to cache, in case the partition write is interrupted. This is also
+  // the rollback path when the target is the same partition as the source.
   if (MakeFreeSpaceOnCache(source_file.data.size()) < 0) {
     printf("not enough free space on /cache\n");
     return 1;
@@ -625,45 +717,98 @@ static int GenerateTarget(const FileContents& source_file, const std::unique_ptr
     return 1;
   }
 
-  // We store the decoded output in memory.
-  std::string memory_sink_str;  // Don't need to reserve space.
-  SinkFn sink = [&memory_sink_str](const unsigned char* data, size_t len) {
-    memory_sink_str.append(reinterpret_cast<const char*>(data), len);
-    return len;
-  };
+  std::vector<std::string> pieces = android::base::Split(target_filename, ":");
+  if (pieces.size() < 2) {
+    printf("bad target name \"%s\"\n", target_filename.c_str());
+    return 1;
+  }
+  const char* partition = pieces[1].c_str();
 
-  SHA_CTX ctx;
-  SHA1_Init(&ctx);
+  // The patched output is streamed to the partition through a bounded buffer, instead of being
+  // held in memory in full, and its SHA-1 is only known once it has all been written. So a failed
+  // or bad patch (including one that produces the wrong SHA-1) leaves the partition modified. The
+  // source backup on /cache is kept in that case, and the next attempt patches from it.
+  bool success = false;
+  for (size_t attempt = 0; attempt < 2; ++attempt) {
+    unique_fd fd(ota_open(partition, O_WRONLY));
+    if (fd == -1) {
+      printf("failed to open %s: %s\n", partition, strerror(errno));
+      return 1;
+    }
 
-  int result;
-  if (use_bsdiff) {
-    result =
-        ApplyBSDiffPatch(source_file.data.data(), source_file.data.size(), *patch, 0, sink, &ctx);
-  } else {
-    result = ApplyImagePatch(source_file.data.data(), source_file.data.size(), *patch, sink, &ctx,
-                             bonus_data);
-  }
+    std::vector<unsigned char> buffer;
+    buffer.reserve(kPartitionBufferSize);
+    size_t target_size = 0;
+    auto flush = [&buffer, &target_size, &fd]() {
+      if (FileSink(buffer.data(), buffer.size(), fd) != buffer.size()) {
+        return false;
+      }
+      target_size += buffer.size();
+      buffer.clear();
+      return true;
+    };
+    SinkFn sink = [&buffer, &flush](const unsigned char* data, size_t len) -> size_t {
+      size_t done = 0;
+      while (done < len) {
+        size_t to_copy = std::min(len - done, kPartitionBufferSize - buffer.size());
+        buffer.insert(buffer.end(), data + done, data + done + to_copy);
+        done += to_copy;
+        if (buffer.size() == kPartitionBufferSize && !flush()) {
+          return 0;
+        }
+      }
+      return len;
+    };
 
-  if (result != 0) {
-    printf("applying patch failed\n");
-    return 1;
-  }
+    SHA_CTX ctx;
+    SHA1_Init(&ctx);
 
-  uint8_t current_target_sha1[SHA_DIGEST_LENGTH];
-  SHA1_Final(current_target_sha1, &ctx);
-  if (memcmp(current_target_sha1, target_sha1, SHA_DIGEST_LENGTH) != 0) {
-    printf("patch did not produce expected sha1\n");
-    return 1;
-  } else {
-    printf("now %s\n", short_sha1(target_sha1).c_str());
+    int result;
+    if (use_bsdiff) {
+      result =
+          ApplyBSDiffPatch(source_file.data.data(), source_file.data.size(), *patch, 0, sink, &ctx);
+    } else {
+      size_t num_threads =
+          std::min<size_t>(std::thread::hardware_concurrency(), kMaxImagePatchThreads);
+      result = ApplyImagePatch(source_file.data.data(), source_file.data.size(), *patch, sink,
+                               &ctx, bonus_data, num_threads);
+    }
+
+    if (result != 0 || !flush()) {
+      printf("applying patch failed\n");
+      return 1;
+    }
+    if (ota_fsync(fd) != 0) {
+      printf("failed to sync to %s: %s\n", partition, strerror(errno));
+      return 1;
+    }
+    if (ota_close(fd) != 0) {
+      printf("failed to close %s: %s\n", partition, strerror(errno));
+      return 1;
+    }
+
+    uint8_t current_target_sha1[SHA_DIGEST_LENGTH];
+    SHA1_Final(current_target_sha1, &ctx);
+    if (memcmp(current_target_sha1, target_sha1, SHA_DIGEST_LENGTH) != 0) {
+      printf("patch did not produce expected sha1\n");
+      return 1;
+    } else {
+      printf("now %s\n", short_sha1(target_sha1).c_str());
+    }
+
+    // Verify what actually landed on the partition.
+    if (VerifyPartitionSha1(partition, target_size, target_sha1) == 0) {
+      printf("verification read succeeded (attempt %zu)\n", attempt + 1);
+      success = true;
+      break;
+    }
   }
 
-  // Write back the temp file to the partition.
-  if (WriteToPartition(reinterpret_cast<const unsigned char*>(memory_sink_str.c_str()),
-                       memory_sink_str.size(), target_filename) != 0) {
+  if (!success) {
     printf("write of patched data to %s failed\n", target_filename.c_str());
     return 1;
   }
+  sync();
 
   // Delete the backup copy of the source.
   unlink(CacheLocation::location().cache_temp_source().c_str());
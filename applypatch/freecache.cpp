@@ -25,9 +25,12 @@
 #include <dirent.h>
 #include <ctype.h>
 
+#include <algorithm>
+#include <functional>
 #include <memory>
 #include <set>
 #include <string>
+#include <vector>
 
 #include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
@@ -35,7 +38,20 @@
 #include "applypatch/applypatch.h"
 #include "otautil/cache_location.h"
 
-static int EliminateOpenFiles(std::set<std::string>* files) {
+namespace {
+
+// A deletion candidate, with the stat info that the deletion policies need.
+struct CacheFile {
+  std::string path;
+  size_t size;  // Bytes that deleting the file frees up, i.e. the allocated size.
+  time_t mtime;
+};
+
+}  // namespace
+
+// Scans /proc/*/fd for the files held open by any process, and adds the link targets to
+// 'open_files'. Returns 0 on success.
+static int ScanOpenFiles(std::set<std::string>* open_files) {
   std::unique_ptr<DIR, decltype(&closedir)> d(opendir("/proc"), closedir);
   if (!d) {
     printf("error opening /proc: %s\n", strerror(errno));
@@ -60,36 +76,51 @@ static int EliminateOpenFiles(std::set<std::string>* files) {
       char link[FILENAME_MAX];
 
       int count = readlink(fd_path.c_str(), link, sizeof(link)-1);
-      if (count >= 0) {
+      if (count >= 0 && link[0] == '/') {
         link[count] = '\0';
-        if (strncmp(link, "/cache/", 7) == 0) {
-          if (files->erase(link) > 0) {
-            printf("%s is open by %s\n", link, de->d_name);
-          }
-        }
+        open_files->insert(link);
       }
     }
   }
   return 0;
 }
 
-static std::set<std::string> FindExpendableFiles() {
-  std::set<std::string> files;
-  // We're allowed to delete unopened regular files in any of these
-  // directories.
-  const char* dirs[2] = {"/cache", "/cache/recovery/otatest"};
+// Removes the files that are held open by any process from 'files'. The /proc scan is done once
+// per MakeFreeSpace() call, so that files opened since an earlier call are still protected.
+// Returns 0 on success.
+static int EliminateOpenFiles(std::vector<CacheFile>* files) {
+  std::set<std::string> open_files;
+  if (ScanOpenFiles(&open_files) != 0) {
+    return -1;
+  }
+
+  files->erase(std::remove_if(files->begin(), files->end(),
+                              [&open_files](const CacheFile& file) {
+                                if (open_files.find(file.path) == open_files.end()) {
+                                  return false;
+                                }
+                                printf("%s is open\n", file.path.c_str());
+                                return true;
+                              }),
+               files->end());
+  return 0;
+}
 
-  for (size_t i = 0; i < sizeof(dirs)/sizeof(dirs[0]); ++i) {
-    std::unique_ptr<DIR, decltype(&closedir)> d(opendir(dirs[i]), closedir);
+// Returns the unopened regular files directly under any of 'dirs' (not in any subdirectories),
+// along with their sizes and mtimes.
+static std::vector<CacheFile> FindExpendableFiles(const std::vector<std::string>& dirs) {
+  std::vector<CacheFile> files;
+  for (const auto& dir : dirs) {
+    std::unique_ptr<DIR, decltype(&closedir)> d(opendir(dir.c_str()), closedir);
     if (!d) {
-      printf("error opening %s: %s\n", dirs[i], strerror(errno));
+      printf("error opening %s: %s\n", dir.c_str(), strerror(errno));
       continue;
     }
 
     // Look for regular files in the directory (not in any subdirectories).
     struct dirent* de;
     while ((de = readdir(d.get())) != 0) {
-      std::string path = std::string(dirs[i]) + "/" + de->d_name;
+      std::string path = dir + "/" + de->d_name;
 
       // We can't delete cache_temp_source; if it's there we might have restarted during
       // installation and could be depending on it to be there.
@@ -99,51 +130,138 @@ static std::set<std::string> FindExpendableFiles() {
 
       struct stat st;
       if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
-        files.insert(path);
+        files.push_back(CacheFile{ path, static_cast<size_t>(st.st_blocks) * 512, st.st_mtime });
       }
     }
   }
 
   printf("%zu regular files in deletable directories\n", files.size());
   if (EliminateOpenFiles(&files) < 0) {
-    return std::set<std::string>();
+    return std::vector<CacheFile>();
   }
   return files;
 }
 
-int MakeFreeSpaceOnCache(size_t bytes_needed) {
-#ifndef __ANDROID__
-  // TODO (xunchang) implement a heuristic cache size check during host simulation.
-  printf("Skip making (%zu) bytes free space on cache; program is running on host\n", bytes_needed);
-  return 0;
-#endif
+// Reorders 'files' into the order they should be deleted to free up 'bytes_to_free' bytes under
+// the given policy. Returns the number of leading files that are expected to free up enough space
+// based on their sizes, which can be deleted as one batch. The remaining files follow in the
+// fallback order, in case the estimate falls short.
+static size_t OrderFilesForDeletion(std::vector<CacheFile>* files, size_t bytes_to_free,
+                                    CachePolicy policy) {
+  auto largest_first = [](const CacheFile& a, const CacheFile& b) {
+    return a.size > b.size || (a.size == b.size && a.path < b.path);
+  };
+
+  if (policy == CachePolicy::kMinimalSet) {
+    // Repeatedly pick the smallest file that covers the remaining bytes on its own; if there's
+    // none, pick the largest file and continue. This deletes few files, without removing much
+    // more than needed.
+    std::sort(files->begin(), files->end(), largest_first);
+    size_t chosen = 0;
+    size_t remaining = bytes_to_free;
+    while (remaining > 0 && chosen < files->size()) {
+      auto begin = files->begin() + chosen;
+      // Files are sorted by decreasing size, so the last one that's large enough is the smallest.
+      auto it = std::find_if(begin, files->end(),
+                             [remaining](const CacheFile& f) { return f.size < remaining; });
+      if (it != begin) {
+        std::rotate(begin, it - 1, it);
+        remaining = 0;
+      } else {
+        remaining -= begin->size;
+      }
+      ++chosen;
+    }
+    // Keep the unchosen files ordered by size as the fallback.
+    std::sort(files->begin() + chosen, files->end(), largest_first);
+    return chosen;
+  }
 
-  size_t free_now = FreeSpaceForFile("/cache");
-  printf("%zu bytes free on /cache (%zu needed)\n", free_now, bytes_needed);
+  if (policy == CachePolicy::kOldestFirst) {
+    std::sort(files->begin(), files->end(), [](const CacheFile& a, const CacheFile& b) {
+      return a.mtime < b.mtime || (a.mtime == b.mtime && a.path < b.path);
+    });
+  } else {
+    std::sort(files->begin(), files->end(), largest_first);
+  }
+
+  size_t chosen = 0;
+  size_t total = 0;
+  while (total < bytes_to_free && chosen < files->size()) {
+    total += (*files)[chosen++].size;
+  }
+  return chosen;
+}
+
+int MakeFreeSpace(size_t bytes_needed, const std::vector<std::string>& dirs,
+                  const std::function<size_t()>& free_space, CachePolicy policy) {
+  size_t free_now = free_space();
+  printf("%zu bytes free (%zu needed)\n", free_now, bytes_needed);
 
   if (free_now >= bytes_needed) {
     return 0;
   }
-  std::set<std::string> files = FindExpendableFiles();
+  std::vector<CacheFile> files = FindExpendableFiles(dirs);
   if (files.empty()) {
     // nothing we can delete to free up space!
-    printf("no files can be deleted to free space on /cache\n");
+    printf("no files can be deleted to free space\n");
     return -1;
   }
 
-  // We could try to be smarter about which files to delete:  the
-  // biggest ones?  the smallest ones that will free up enough space?
-  // the oldest?  the newest?
-  //
-  // Instead, we'll be dumb.
-
-  for (const auto& file : files) {
-    unlink(file.c_str());
-    free_now = FreeSpaceForFile("/cache");
-    printf("deleted %s; now %zu bytes free\n", file.c_str(), free_now);
-    if (free_now < bytes_needed) {
-        break;
+  size_t batch = OrderFilesForDeletion(&files, bytes_needed - free_now, policy);
+
+  // Delete the selected files together, and check the free space only once afterwards.
+  for (size_t i = 0; i < batch; ++i) {
+    if (unlink(files[i].path.c_str()) == -1) {
+      printf("failed to delete %s: %s\n", files[i].path.c_str(), strerror(errno));
+    } else {
+      printf("deleted %s (%zu bytes)\n", files[i].path.c_str(), files[i].size);
     }
   }
+  free_now = free_space();
+  printf("now %zu bytes free\n", free_now);
+
+  // The sizes are only an estimate; fall back to deleting the rest one at a time if needed.
+  for (size_t i = batch; i < files.size() && free_now < bytes_needed; ++i) {
+    unlink(files[i].path.c_str());
+    free_now = free_space();
+    printf("deleted %s; now %zu bytes free\n", files[i].path.c_str(), free_now);
+  }
   return (free_now >= bytes_needed) ? 0 : -1;
 }
+
+SimulatedFreeSpace::SimulatedFreeSpace(size_t capacity, const std::vector<std::string>& dirs)
+    : capacity_(capacity), dirs_(dirs) {}
+
+size_t SimulatedFreeSpace::operator()() const {
+  size_t used = 0;
+  for (const auto& dir : dirs_) {
+    std::unique_ptr<DIR, decltype(&closedir)> d(opendir(dir.c_str()), closedir);
+    if (!d) {
+      continue;
+    }
+    struct dirent* de;
+    while ((de = readdir(d.get())) != 0) {
+      struct stat st;
+      std::string path = dir + "/" + de->d_name;
+      if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+        used += static_cast<size_t>(st.st_blocks) * 512;
+      }
+    }
+  }
+  return used >= capacity_ ? 0 : capacity_ - used;
+}
+
+int MakeFreeSpaceOnCache(size_t bytes_needed) {
+#ifndef __ANDROID__
+  // There's no /cache to clean up during host simulation. The cleanup logic itself can be
+  // exercised on host through MakeFreeSpace() with a SimulatedFreeSpace.
+  printf("Skip making (%zu) bytes free space on cache; program is running on host\n", bytes_needed);
+  return 0;
+#endif
+
+  // We're allowed to delete unopened regular files in any of these directories.
+  std::vector<std::string> dirs = { "/cache", "/cache/recovery/otatest" };
+  return MakeFreeSpace(bytes_needed, dirs, []() { return FreeSpaceForFile("/cache"); },
+                       CachePolicy::kMinimalSet);
+}
@@ -148,22 +148,33 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/macros.h>
 #include <android-base/memory.h>
 #include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <bsdiff/bsdiff.h>
+#include <bsdiff/constants.h>
+#include <bsdiff/patch_writer_factory.h>
 #include <ziparchive/zip_archive.h>
 #include <zlib.h>
 
@@ -245,34 +256,151 @@ static bool RemoveUsedBlocks(size_t* start, size_t* length, const SortedRangeSet
   return false;
 }
 
+// Call |func| once for each index in [0, count), using up to |jobs| threads (including the calling
+// thread). Indices are handed out in increasing order. Stop handing out new indices and return
+// false as soon as one of the calls fails.
+static bool RunParallel(size_t count, size_t jobs, const std::function<bool(size_t)>& func) {
+  jobs = std::min(jobs, count);
+  if (jobs <= 1) {
+    for (size_t i = 0; i < count; i++) {
+      if (!func(i)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  std::atomic<size_t> next(0);
+  std::atomic<bool> failed(false);
+  auto worker = [&]() {
+    size_t i;
+    while (!failed && (i = next++) < count) {
+      if (!func(i)) {
+        failed = true;
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < jobs; t++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& t : threads) {
+    t.join();
+  }
+  return !failed;
+}
+
 static const struct option OPTIONS[] = {
   { "zip-mode", no_argument, nullptr, 'z' },
   { "bonus-file", required_argument, nullptr, 'b' },
   { "block-limit", required_argument, nullptr, 0 },
   { "debug-dir", required_argument, nullptr, 0 },
   { "split-info", required_argument, nullptr, 0 },
+  { "jobs", required_argument, nullptr, 'j' },
+  { "profile", required_argument, nullptr, 0 },
+  { "bsdiff-format", required_argument, nullptr, 0 },
+  { "split-parallelism", required_argument, nullptr, 0 },
   { "verbose", no_argument, nullptr, 'v' },
   { nullptr, 0, nullptr, 0 },
 };
 
+// The brotli quality of BSDF2 chunk patches. Quality 9 is much faster to encode than 11, and the
+// patches are only slightly larger.
+static constexpr int kBsdf2BrotliQuality = 9;
+
+// A file that receives the patch from one of bsdiff's own patch writers, which only write to a
+// named file. It's an anonymous in-memory file (memfd) opened through /proc/self/fd where the
+// kernel supports it, and otherwise a temporary file that's removed on destruction.
+class BsdiffPatchFile {
+ public:
+  BsdiffPatchFile() = default;
+
+  ~BsdiffPatchFile() {
+    if (!temp_path_.empty()) {
+      unlink(temp_path_.c_str());
+    }
+  }
+
+  bool Create() {
+#if defined(__NR_memfd_create)
+    fd_.reset(static_cast<int>(syscall(__NR_memfd_create, "imgdiff-patch", 0)));
+    if (fd_ != -1) {
+      path_ = android::base::StringPrintf("/proc/self/fd/%d", fd_.get());
+      return true;
+    }
+#endif
+
+#if defined(__ANDROID__)
+    char ptemp[] = "/data/local/tmp/imgdiff-patch-XXXXXX";
+#else
+    char ptemp[] = "/tmp/imgdiff-patch-XXXXXX";
+#endif
+    fd_.reset(mkstemp(ptemp));
+    if (fd_ == -1) {
+      PLOG(ERROR) << "MakePatch failed to create a temporary file";
+      return false;
+    }
+    path_ = temp_path_ = ptemp;
+    return true;
+  }
+
+  const std::string& path() const {
+    return path_;
+  }
+
+  // Reads back the whole patch written by the patch writer.
+  bool Read(std::vector<uint8_t>* patch_data) const {
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+      PLOG(ERROR) << "Failed to stat patch file " << path_;
+      return false;
+    }
+    patch_data->resize(static_cast<size_t>(st.st_size));
+    if (!android::base::ReadFullyAtOffset(fd_, patch_data->data(), patch_data->size(), 0)) {
+      PLOG(ERROR) << "Failed to read " << path_;
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  android::base::unique_fd fd_;
+  std::string path_;
+  std::string temp_path_;
+
+  DISALLOW_COPY_AND_ASSIGN(BsdiffPatchFile);
+};
+
 ImageChunk::ImageChunk(int type, size_t start, const std::vector<uint8_t>* file_content,
                        size_t raw_data_len, std::string entry_name)
+    : ImageChunk(type, start, file_content->data(), file_content->size(), raw_data_len,
+                 std::move(entry_name)) {}
+
+ImageChunk::ImageChunk(int type, size_t start, const uint8_t* file_data, size_t file_size,
+                       size_t raw_data_len, std::string entry_name)
     : type_(type),
       start_(start),
-      input_file_ptr_(file_content),
+      input_file_data_(file_data),
+      input_file_size_(file_size),
       raw_data_len_(raw_data_len),
       compress_level_(6),
-      entry_name_(std::move(entry_name)) {
-  CHECK(file_content != nullptr) << "input file container can't be nullptr";
-}
+      compress_strategy_(STRATEGY),
+      uncompressed_len_(0),
+      crc32_(0),
+      deferred_(false),
+      entry_name_(std::move(entry_name)) {}
 
 const uint8_t* ImageChunk::GetRawData() const {
-  CHECK_LE(start_ + raw_data_len_, input_file_ptr_->size());
-  return input_file_ptr_->data() + start_;
+  CHECK_LE(start_ + raw_data_len_, input_file_size_);
+  return input_file_data_ + start_;
 }
 
 const uint8_t * ImageChunk::DataForPatch() const {
   if (type_ == CHUNK_DEFLATE) {
+    CHECK_EQ(uncompressed_data_.size(), uncompressed_len_)
+        << "uncompressed data of " << entry_name_ << " isn't loaded";
     return uncompressed_data_.data();
   }
   return GetRawData();
@@ -280,7 +408,7 @@ const uint8_t * ImageChunk::DataForPatch() const {
 
 size_t ImageChunk::DataLengthForPatch() const {
   if (type_ == CHUNK_DEFLATE) {
-    return uncompressed_data_.size();
+    return uncompressed_len_;
   }
   return raw_data_len_;
 }
@@ -300,21 +428,78 @@ bool ImageChunk::operator==(const ImageChunk& other) const {
 
 void ImageChunk::SetUncompressedData(std::vector<uint8_t> data) {
   uncompressed_data_ = std::move(data);
+  uncompressed_len_ = uncompressed_data_.size();
+  deferred_ = false;
 }
 
 bool ImageChunk::SetBonusData(const std::vector<uint8_t>& bonus_data) {
-  if (type_ != CHUNK_DEFLATE) {
+  if (type_ != CHUNK_DEFLATE || deferred_) {
     return false;
   }
   uncompressed_data_.insert(uncompressed_data_.end(), bonus_data.begin(), bonus_data.end());
+  uncompressed_len_ = uncompressed_data_.size();
+  return true;
+}
+
+void ImageChunk::DeferUncompressedData(size_t uncompressed_len, uint32_t crc) {
+  CHECK_EQ(type_, CHUNK_DEFLATE);
+  uncompressed_data_.clear();
+  uncompressed_len_ = uncompressed_len;
+  crc32_ = crc;
+  deferred_ = true;
+}
+
+bool ImageChunk::LoadUncompressedData() {
+  if (type_ != CHUNK_DEFLATE || uncompressed_data_.size() == uncompressed_len_) {
+    return true;
+  }
+  CHECK(deferred_);
+
+  z_stream strm = {};
+  int ret = inflateInit2(&strm, WINDOWBITS);
+  if (ret != Z_OK) {
+    LOG(ERROR) << "Failed to initialize inflate: " << ret;
+    return false;
+  }
+
+  std::vector<uint8_t> data(uncompressed_len_);
+  strm.next_in = GetRawData();
+  strm.avail_in = raw_data_len_;
+  strm.next_out = data.data();
+  strm.avail_out = data.size();
+  ret = inflate(&strm, Z_FINISH);
+  size_t inflated = strm.total_out;
+  inflateEnd(&strm);
+
+  if (ret != Z_STREAM_END || inflated != uncompressed_len_) {
+    LOG(ERROR) << "Failed to inflate " << entry_name_ << " at offset " << start_ << " (ret " << ret
+               << ", " << inflated << " of " << uncompressed_len_ << " bytes)";
+    return false;
+  }
+  uint32_t crc = crc32(0, data.data(), data.size());
+  if (crc != crc32_) {
+    LOG(ERROR) << "CRC-32 mismatch of " << entry_name_ << ": expected " << std::hex << crc32_
+               << ", got " << crc << std::dec;
+    return false;
+  }
+  uncompressed_data_ = std::move(data);
   return true;
 }
 
+void ImageChunk::ReleaseUncompressedData() {
+  if (deferred_) {
+    uncompressed_data_.clear();
+    uncompressed_data_.shrink_to_fit();
+  }
+}
+
 void ImageChunk::ChangeDeflateChunkToNormal() {
   if (type_ != CHUNK_DEFLATE) return;
   type_ = CHUNK_NORMAL;
   // No need to clear the entry name.
   uncompressed_data_.clear();
+  uncompressed_len_ = 0;
+  deferred_ = false;
 }
 
 bool ImageChunk::IsAdjacentNormal(const ImageChunk& other) const {
@@ -331,50 +516,74 @@ void ImageChunk::MergeAdjacentNormal(const ImageChunk& other) {
 
 bool ImageChunk::MakePatch(const ImageChunk& tgt, const ImageChunk& src,
                            std::vector<uint8_t>* patch_data,
-                           bsdiff::SuffixArrayIndexInterface** bsdiff_cache) {
-#if defined(__ANDROID__)
-  char ptemp[] = "/data/local/tmp/imgdiff-patch-XXXXXX";
-#else
-  char ptemp[] = "/tmp/imgdiff-patch-XXXXXX";
-#endif
+                           bsdiff::SuffixArrayIndexInterface** bsdiff_cache,
+                           BsdiffFormat format, ImgdiffChunkProfile* profile) {
+  // When profiling, build the suffix array separately so that it can be timed on its own; bsdiff
+  // would otherwise build the same one internally.
+  std::unique_ptr<bsdiff::SuffixArrayIndexInterface> sa_index;
+  bsdiff::SuffixArrayIndexInterface* sa_index_ptr = nullptr;
+  if (profile != nullptr && bsdiff_cache == nullptr) {
+    double start_wall = ImgdiffProfiler::WallTimeMs();
+    double start_cpu = ImgdiffProfiler::ThreadCpuTimeMs();
+    sa_index = bsdiff::CreateSuffixArrayIndex(src.DataForPatch(), src.DataLengthForPatch());
+    if (!sa_index) {
+      LOG(ERROR) << "Failed to create the suffix array";
+      return false;
+    }
+    profile->suffix_array_ms = ImgdiffProfiler::WallTimeMs() - start_wall;
+    profile->suffix_array_cpu_ms = ImgdiffProfiler::ThreadCpuTimeMs() - start_cpu;
+    sa_index_ptr = sa_index.get();
+    bsdiff_cache = &sa_index_ptr;
+  }
 
-  int fd = mkstemp(ptemp);
-  if (fd == -1) {
-    PLOG(ERROR) << "MakePatch failed to create a temporary file";
+  double start_wall = ImgdiffProfiler::WallTimeMs();
+  double start_cpu = ImgdiffProfiler::ThreadCpuTimeMs();
+  BsdiffPatchFile patch_file;
+  if (!patch_file.Create()) {
     return false;
   }
-  close(fd);
-
+  std::unique_ptr<bsdiff::PatchWriterInterface> patch_writer;
+  if (format == BsdiffFormat::kBsdf2) {
+    patch_writer = bsdiff::CreateBSDF2PatchWriter(
+        patch_file.path(), bsdiff::CompressorType::kBrotli, kBsdf2BrotliQuality);
+  } else {
+    patch_writer = bsdiff::CreateBsdiffPatchWriter(patch_file.path());
+  }
   int r = bsdiff::bsdiff(src.DataForPatch(), src.DataLengthForPatch(), tgt.DataForPatch(),
-                         tgt.DataLengthForPatch(), ptemp, bsdiff_cache);
+                         tgt.DataLengthForPatch(), patch_writer.get(), bsdiff_cache);
+  if (profile != nullptr) {
+    profile->bsdiff_ms = ImgdiffProfiler::WallTimeMs() - start_wall;
+    profile->bsdiff_cpu_ms = ImgdiffProfiler::ThreadCpuTimeMs() - start_cpu;
+  }
   if (r != 0) {
     LOG(ERROR) << "bsdiff() failed: " << r;
     return false;
   }
 
-  android::base::unique_fd patch_fd(open(ptemp, O_RDONLY));
-  if (patch_fd == -1) {
-    PLOG(ERROR) << "Failed to open " << ptemp;
-    return false;
-  }
-  struct stat st;
-  if (fstat(patch_fd, &st) != 0) {
-    PLOG(ERROR) << "Failed to stat patch file " << ptemp;
-    return false;
-  }
-
-  size_t sz = static_cast<size_t>(st.st_size);
+  return patch_file.Read(patch_data);
+}
 
-  patch_data->resize(sz);
-  if (!android::base::ReadFully(patch_fd, patch_data->data(), sz)) {
-    PLOG(ERROR) << "Failed to read " << ptemp;
-    unlink(ptemp);
-    return false;
+// Fill in the target side of |profile| and add it to |profiler|, along with its share of the
+// "suffix_array" and "bsdiff" phases.
+static void RecordChunkProfile(ImgdiffProfiler* profiler, int split, size_t index,
+                               const ImageChunk& tgt, bool raw, size_t patch_size,
+                               ImgdiffChunkProfile* profile) {
+  profile->split = split;
+  profile->index = index;
+  profile->name = tgt.GetEntryName();
+  profile->type = tgt.GetType();
+  profile->target_size = tgt.GetRawDataLength();
+  profile->target_data_size = tgt.DataLengthForPatch();
+  profile->patch_size = patch_size;
+  profile->raw = raw;
+  profiler->AddChunk(*profile);
+
+  if (profile->suffix_array_ms > 0) {
+    profiler->AddPhaseTime("suffix_array", profile->suffix_array_ms, profile->suffix_array_cpu_ms);
+  }
+  if (profile->bsdiff_ms > 0) {
+    profiler->AddPhaseTime("bsdiff", profile->bsdiff_ms, profile->bsdiff_cpu_ms);
   }
-
-  unlink(ptemp);
-
-  return true;
 }
 
 bool ImageChunk::ReconstructDeflateChunk() {
@@ -383,16 +592,40 @@ bool ImageChunk::ReconstructDeflateChunk() {
     return false;
   }
 
-  // We only check two combinations of encoder parameters:  level 6 (the default) and level 9
-  // (the maximum).
-  for (int level = 6; level <= 9; level += 3) {
-    if (TryReconstruction(level)) {
-      compress_level_ = level;
-      return true;
+  // Try the default level 6 and the maximum level 9 first, since most encoders use one of them;
+  // then the remaining levels and the other strategies. Z_FILTERED only makes a difference for
+  // the lazy matching at level 4 and above, and Z_HUFFMAN_ONLY / Z_RLE ignore the level.
+  auto search = [this]() {
+    static constexpr int kLevels[] = { 6, 9, 1, 2, 3, 4, 5, 7, 8 };
+    for (int strategy : { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_FIXED }) {
+      for (int level : kLevels) {
+        if (strategy == Z_FILTERED && level < 4) {
+          continue;
+        }
+        if (TryReconstruction(level, strategy)) {
+          compress_level_ = level;
+          compress_strategy_ = strategy;
+          return true;
+        }
+      }
     }
-  }
+    for (int strategy : { Z_HUFFMAN_ONLY, Z_RLE }) {
+      if (TryReconstruction(6, strategy)) {
+        compress_level_ = 6;
+        compress_strategy_ = strategy;
+        return true;
+      }
+    }
+    return false;
+  };
 
-  return false;
+  // A deferred chunk only holds the uncompressed data for the duration of the search.
+  if (!LoadUncompressedData()) {
+    return false;
+  }
+  bool result = search();
+  ReleaseUncompressedData();
+  return result;
 }
 
 /*
@@ -400,14 +633,14 @@ bool ImageChunk::ReconstructDeflateChunk() {
  * in the chunk, and checks that it matches exactly the compressed data we started with (also
  * stored in the chunk).
  */
-bool ImageChunk::TryReconstruction(int level) {
+bool ImageChunk::TryReconstruction(int level, int strategy) {
   z_stream strm;
   strm.zalloc = Z_NULL;
   strm.zfree = Z_NULL;
   strm.opaque = Z_NULL;
   strm.avail_in = uncompressed_data_.size();
   strm.next_in = uncompressed_data_.data();
-  int ret = deflateInit2(&strm, level, METHOD, WINDOWBITS, MEMLEVEL, STRATEGY);
+  int ret = deflateInit2(&strm, level, METHOD, WINDOWBITS, MEMLEVEL, strategy);
   if (ret < 0) {
     LOG(ERROR) << "Failed to initialize deflate: " << ret;
     return false;
@@ -421,11 +654,15 @@ bool ImageChunk::TryReconstruction(int level) {
     ret = deflate(&strm, Z_FINISH);
     if (ret < 0) {
       LOG(ERROR) << "Failed to deflate: " << ret;
+      deflateEnd(&strm);
       return false;
     }
 
+    // Bail out at the first mismatching buffer, which is usually the very first one for the wrong
+    // parameters.
     size_t compressed_size = buffer.size() - strm.avail_out;
-    if (memcmp(buffer.data(), input_file_ptr_->data() + start_ + offset, compressed_size) != 0) {
+    if (compressed_size > raw_data_len_ - offset ||
+        memcmp(buffer.data(), input_file_data_ + start_ + offset, compressed_size) != 0) {
       // mismatch; data isn't the same.
       deflateEnd(&strm);
       return false;
@@ -450,6 +687,7 @@ PatchChunk::PatchChunk(const ImageChunk& tgt, const ImageChunk& src, std::vector
       target_len_(tgt.GetRawDataLength()),
       target_uncompressed_len_(tgt.DataLengthForPatch()),
       target_compress_level_(tgt.GetCompressLevel()),
+      target_compress_strategy_(tgt.GetCompressStrategy()),
       data_(std::move(data)) {}
 
 // Construct a CHUNK_RAW patch from the target data directly.
@@ -462,6 +700,7 @@ PatchChunk::PatchChunk(const ImageChunk& tgt)
       target_len_(tgt.GetRawDataLength()),
       target_uncompressed_len_(tgt.DataLengthForPatch()),
       target_compress_level_(tgt.GetCompressLevel()),
+      target_compress_strategy_(tgt.GetCompressStrategy()),
       data_(tgt.DataForPatch(), tgt.DataForPatch() + tgt.DataLengthForPatch()) {}
 
 // Return true if raw data is smaller than the patch size.
@@ -518,7 +757,7 @@ size_t PatchChunk::WriteHeaderToFd(int fd, size_t offset, size_t index) const {
       Write4(fd, ImageChunk::METHOD);
       Write4(fd, ImageChunk::WINDOWBITS);
       Write4(fd, ImageChunk::MEMLEVEL);
-      Write4(fd, ImageChunk::STRATEGY);
+      Write4(fd, target_compress_strategy_);
       return offset + data_.size();
     case CHUNK_RAW:
       LOG(INFO) << android::base::StringPrintf("chunk %zu: raw      (%10zu, %10zu)", index,
@@ -618,9 +857,7 @@ void Image::DumpChunks() const {
   }
 }
 
-bool Image::ReadFile(const std::string& filename, std::vector<uint8_t>* file_content) {
-  CHECK(file_content != nullptr);
-
+bool Image::MapFile(const std::string& filename) {
   android::base::unique_fd fd(open(filename.c_str(), O_RDONLY));
   if (fd == -1) {
     PLOG(ERROR) << "Failed to open " << filename;
@@ -632,19 +869,28 @@ bool Image::ReadFile(const std::string& filename, std::vector<uint8_t>* file_con
     return false;
   }
 
+  file_content_.clear();
+  file_map_.reset();
+  file_map_size_ = 0;
+
   size_t sz = static_cast<size_t>(st.st_size);
-  file_content->resize(sz);
-  if (!android::base::ReadFully(fd, file_content->data(), sz)) {
-    PLOG(ERROR) << "Failed to read " << filename;
+  if (sz == 0) {
+    return true;
+  }
+  void* addr = mmap(nullptr, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED) {
+    PLOG(ERROR) << "Failed to map " << filename;
     return false;
   }
-  fd.reset();
+  file_map_.reset(static_cast<const uint8_t*>(addr),
+                  [sz](const uint8_t* p) { munmap(const_cast<uint8_t*>(p), sz); });
+  file_map_size_ = sz;
 
   return true;
 }
 
 bool ZipModeImage::Initialize(const std::string& filename) {
-  if (!ReadFile(filename, &file_content_)) {
+  if (!MapFile(filename)) {
     return false;
   }
 
@@ -655,7 +901,7 @@ bool ZipModeImage::Initialize(const std::string& filename) {
     return false;
   }
   ZipArchiveHandle handle;
-  int err = OpenArchiveFromMemory(const_cast<uint8_t*>(file_content_.data()), zipfile_size,
+  int err = OpenArchiveFromMemory(const_cast<uint8_t*>(FileData()), zipfile_size,
                                   filename.c_str(), &handle);
   if (err != 0) {
     LOG(ERROR) << "Failed to open zip file " << filename << ": " << ErrorCodeString(err);
@@ -704,7 +950,7 @@ bool ZipModeImage::InitializeChunks(const std::string& filename, ZipArchiveHandl
   // For source chunks, we don't need to compose chunks for the metadata.
   if (is_source_) {
     for (auto& entry : temp_entries) {
-      if (!AddZipEntryToChunks(handle, entry.first, &entry.second)) {
+      if (!AddZipEntryToChunks(entry.first, &entry.second)) {
         LOG(ERROR) << "Failed to add " << entry.first << " to source chunks";
         return false;
       }
@@ -716,9 +962,9 @@ bool ZipModeImage::InitializeChunks(const std::string& filename, ZipArchiveHandl
       entries_end = static_cast<size_t>(temp_entries.back().second.offset +
                                         temp_entries.back().second.compressed_length);
     }
-    CHECK_LT(entries_end, file_content_.size());
-    chunks_.emplace_back(CHUNK_NORMAL, entries_end, &file_content_,
-                         file_content_.size() - entries_end);
+    CHECK_LT(entries_end, FileSize());
+    chunks_.emplace_back(CHUNK_NORMAL, entries_end, FileData(), FileSize(),
+                         FileSize() - entries_end);
 
     return true;
   }
@@ -727,12 +973,12 @@ bool ZipModeImage::InitializeChunks(const std::string& filename, ZipArchiveHandl
   // deflate entries as CHUNK_NORMAL.
   size_t pos = 0;
   size_t nextentry = 0;
-  while (pos < file_content_.size()) {
+  while (pos < FileSize()) {
     if (nextentry < temp_entries.size() &&
         static_cast<off64_t>(pos) == temp_entries[nextentry].second.offset) {
       // Add the next zip entry.
       std::string entry_name = temp_entries[nextentry].first;
-      if (!AddZipEntryToChunks(handle, entry_name, &temp_entries[nextentry].second)) {
+      if (!AddZipEntryToChunks(entry_name, &temp_entries[nextentry].second)) {
         LOG(ERROR) << "Failed to add " << entry_name << " to target chunks";
         return false;
       }
@@ -747,9 +993,9 @@ bool ZipModeImage::InitializeChunks(const std::string& filename, ZipArchiveHandl
     if (nextentry < temp_entries.size()) {
       raw_data_len = temp_entries[nextentry].second.offset - pos;
     } else {
-      raw_data_len = file_content_.size() - pos;
+      raw_data_len = FileSize() - pos;
     }
-    chunks_.emplace_back(CHUNK_NORMAL, pos, &file_content_, raw_data_len);
+    chunks_.emplace_back(CHUNK_NORMAL, pos, FileData(), FileSize(), raw_data_len);
 
     pos += raw_data_len;
   }
@@ -757,8 +1003,7 @@ bool ZipModeImage::InitializeChunks(const std::string& filename, ZipArchiveHandl
   return true;
 }
 
-bool ZipModeImage::AddZipEntryToChunks(ZipArchiveHandle handle, const std::string& entry_name,
-                                       ZipEntry* entry) {
+bool ZipModeImage::AddZipEntryToChunks(const std::string& entry_name, ZipEntry* entry) {
   size_t compressed_len = entry->compressed_length;
   if (compressed_len == 0) return true;
 
@@ -768,26 +1013,21 @@ bool ZipModeImage::AddZipEntryToChunks(ZipArchiveHandle handle, const std::strin
     while (compressed_len > 0) {
       size_t length = std::min(limit_, compressed_len);
       std::string name = entry_name + "-" + std::to_string(count);
-      chunks_.emplace_back(CHUNK_NORMAL, entry->offset + limit_ * count, &file_content_, length,
-                           name);
+      chunks_.emplace_back(CHUNK_NORMAL, entry->offset + limit_ * count, FileData(), FileSize(),
+                           length, name);
 
       count++;
       compressed_len -= length;
     }
   } else if (entry->method == kCompressDeflated) {
-    size_t uncompressed_len = entry->uncompressed_length;
-    std::vector<uint8_t> uncompressed_data(uncompressed_len);
-    int ret = ExtractToMemory(handle, entry, uncompressed_data.data(), uncompressed_len);
-    if (ret != 0) {
-      LOG(ERROR) << "Failed to extract " << entry_name << " with size " << uncompressed_len << ": "
-                 << ErrorCodeString(ret);
-      return false;
-    }
-    ImageChunk curr(CHUNK_DEFLATE, entry->offset, &file_content_, compressed_len, entry_name);
-    curr.SetUncompressedData(std::move(uncompressed_data));
+    // The entry is only inflated when it's needed, i.e. for the reconstruction and the diff.
+    ImageChunk curr(CHUNK_DEFLATE, entry->offset, FileData(), FileSize(), compressed_len,
+                    entry_name);
+    curr.DeferUncompressedData(entry->uncompressed_length, entry->crc32);
     chunks_.push_back(std::move(curr));
   } else {
-    chunks_.emplace_back(CHUNK_NORMAL, entry->offset, &file_content_, compressed_len, entry_name);
+    chunks_.emplace_back(CHUNK_NORMAL, entry->offset, FileData(), FileSize(), compressed_len,
+                         entry_name);
   }
 
   return true;
@@ -800,22 +1040,22 @@ bool ZipModeImage::AddZipEntryToChunks(ZipArchiveHandle handle, const std::strin
 // offset 20: comment length, 2 bytes
 // offset 22: comment, n bytes
 bool ZipModeImage::GetZipFileSize(size_t* input_file_size) {
-  if (file_content_.size() < 22) {
+  if (FileSize() < 22) {
     LOG(ERROR) << "File is too small to be a zip file";
     return false;
   }
 
   // Look for End of central directory record of the zip file, and calculate the actual
   // zip_file size.
-  for (int i = file_content_.size() - 22; i >= 0; i--) {
-    if (file_content_[i] == 0x50) {
-      if (get_unaligned<uint32_t>(&file_content_[i]) == 0x06054b50) {
+  for (int i = FileSize() - 22; i >= 0; i--) {
+    if (FileData()[i] == 0x50) {
+      if (get_unaligned<uint32_t>(&FileData()[i]) == 0x06054b50) {
         // double-check: this archive consists of a single "disk".
-        CHECK_EQ(get_unaligned<uint16_t>(&file_content_[i + 4]), 0);
+        CHECK_EQ(get_unaligned<uint16_t>(&FileData()[i + 4]), 0);
 
-        uint16_t comment_length = get_unaligned<uint16_t>(&file_content_[i + 20]);
+        uint16_t comment_length = get_unaligned<uint16_t>(&FileData()[i + 20]);
         size_t file_size = i + 22 + comment_length;
-        CHECK_LE(file_size, file_content_.size());
+        CHECK_LE(file_size, FileSize());
         *input_file_size = file_size;
         return true;
       }
@@ -828,7 +1068,7 @@ bool ZipModeImage::GetZipFileSize(size_t* input_file_size) {
 
 ImageChunk ZipModeImage::PseudoSource() const {
   CHECK(is_source_);
-  return ImageChunk(CHUNK_NORMAL, 0, &file_content_, file_content_.size());
+  return ImageChunk(CHUNK_NORMAL, 0, FileData(), FileSize(), FileSize());
 }
 
 const ImageChunk* ZipModeImage::FindChunkByName(const std::string& name, bool find_normal) const {
@@ -861,7 +1101,11 @@ ImageChunk* ZipModeImage::FindChunkByName(const std::string& name, bool find_nor
       static_cast<const ZipModeImage*>(this)->FindChunkByName(name, find_normal));
 }
 
-bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image) {
+bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image,
+                                         const PatchGenerationOptions& options) {
+  // Pair up the target deflate chunks with their sources first; only the pairs that differ need
+  // the (expensive) reconstruction, which is then done in parallel.
+  std::vector<std::pair<ImageChunk*, ImageChunk*>> candidates;
   for (auto& tgt_chunk : *tgt_image) {
     if (tgt_chunk.GetType() != CHUNK_DEFLATE) {
       continue;
@@ -877,13 +1121,39 @@ bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage*
       // trivial patch to the uncompressed data.
       tgt_chunk.ChangeDeflateChunkToNormal();
       src_chunk->ChangeDeflateChunkToNormal();
-    } else if (!tgt_chunk.ReconstructDeflateChunk()) {
+    } else {
+      candidates.emplace_back(&tgt_chunk, src_chunk);
+    }
+  }
+
+  // An entry that fails to inflate, or doesn't match its CRC-32, is an error rather than a chunk
+  // that can't be reconstructed.
+  std::vector<uint8_t> reconstructed(candidates.size(), 0);
+  bool loaded = RunParallel(candidates.size(), options.jobs, [&](size_t i) {
+    ImageChunk* tgt_chunk = candidates[i].first;
+    if (!tgt_chunk->LoadUncompressedData()) {
+      return false;
+    }
+    reconstructed[i] = tgt_chunk->ReconstructDeflateChunk();
+    return true;
+  });
+  if (!loaded) {
+    return false;
+  }
+
+  for (size_t i = 0; i < candidates.size(); i++) {
+    ImageChunk* tgt_chunk = candidates[i].first;
+    ImageChunk* src_chunk = candidates[i].second;
+    if (src_chunk->GetType() != CHUNK_DEFLATE) {
+      // The source has been turned into a normal chunk for an earlier target.
+      tgt_chunk->ChangeDeflateChunkToNormal();
+    } else if (!reconstructed[i]) {
       // We cannot recompress the data and get exactly the same bits as are in the input target
       // image. Treat the chunk as a normal non-deflated chunk.
-      LOG(WARNING) << "Failed to reconstruct target deflate chunk [" << tgt_chunk.GetEntryName()
+      LOG(WARNING) << "Failed to reconstruct target deflate chunk [" << tgt_chunk->GetEntryName()
                    << "]; treating as normal";
 
-      tgt_chunk.ChangeDeflateChunkToNormal();
+      tgt_chunk->ChangeDeflateChunkToNormal();
       src_chunk->ChangeDeflateChunkToNormal();
     }
   }
@@ -898,6 +1168,25 @@ bool ZipModeImage::CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage*
   return true;
 }
 
+// Estimate the work to apply the patch of |tgt| on the device, in units of bytes written by
+// bspatch. A deflate chunk also needs its source inflated and its output deflated again, and
+// deflate is several times slower than bspatch, especially at the higher levels.
+static size_t EstimateChunkApplyCost(const ImageChunk& tgt) {
+  if (tgt.GetType() != CHUNK_DEFLATE) {
+    return tgt.GetRawDataLength();
+  }
+  size_t deflate_factor = tgt.GetCompressLevel() <= 3 ? 3 : 8;
+  return tgt.DataLengthForPatch() * (1 + 1 + deflate_factor);
+}
+
+size_t ZipModeImage::EstimateApplyCost() const {
+  size_t cost = 0;
+  for (const auto& chunk : chunks_) {
+    cost += EstimateChunkApplyCost(chunk);
+  }
+  return cost;
+}
+
 // For each target chunk, look for the corresponding source chunk by the zip_entry name. If
 // found, add the range of this chunk in the original source file to the block aligned source
 // ranges. Construct the split src & tgt image once the size of source range reaches limit.
@@ -905,13 +1194,24 @@ bool ZipModeImage::SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
                                               const ZipModeImage& src_image,
                                               std::vector<ZipModeImage>* split_tgt_images,
                                               std::vector<ZipModeImage>* split_src_images,
-                                              std::vector<SortedRangeSet>* split_src_ranges) {
+                                              std::vector<SortedRangeSet>* split_src_ranges,
+                                              size_t parallelism) {
   CHECK_EQ(tgt_image.limit_, src_image.limit_);
   size_t limit = tgt_image.limit_;
 
   src_image.DumpChunks();
   LOG(INFO) << "Splitting " << tgt_image.NumOfChunks() << " tgt chunks...";
 
+  // To balance the work among |parallelism| concurrent appliers, we also start a new split image
+  // once the current one has its share of the total estimated cost.
+  size_t cost_budget = 0;
+  if (parallelism > 1) {
+    size_t total_cost = tgt_image.EstimateApplyCost();
+    cost_budget = std::max<size_t>(1, (total_cost + parallelism - 1) / parallelism);
+    LOG(INFO) << "Balancing an estimated apply cost of " << total_cost << " across "
+              << parallelism << " pieces";
+  }
+
   SortedRangeSet used_src_ranges;  // ranges used for previous split source images.
 
   // Reserve the central directory in advance for the last split image.
@@ -923,11 +1223,35 @@ bool ZipModeImage::SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
   SortedRangeSet src_ranges;
   std::vector<ImageChunk> split_src_chunks;
   std::vector<ImageChunk> split_tgt_chunks;
+  size_t split_cost = 0;
+  auto add_split_image = [&]() {
+    bool added_image = ZipModeImage::AddSplitImageFromChunkList(
+        tgt_image, src_image, src_ranges, split_tgt_chunks, split_src_chunks, split_tgt_images,
+        split_src_images);
+
+    split_tgt_chunks.clear();
+    split_src_chunks.clear();
+    // No need to update the split_src_ranges if we don't update the split source images.
+    if (added_image) {
+      used_src_ranges.Insert(src_ranges);
+      split_src_ranges->push_back(std::move(src_ranges));
+    }
+    src_ranges.Clear();
+    split_cost = 0;
+  };
+
   for (auto tgt = tgt_image.cbegin(); tgt != tgt_image.cend(); tgt++) {
+    size_t cost = EstimateChunkApplyCost(*tgt);
+    // A split image needs some source data; so only cut on the cost after adding a source range.
+    if (cost_budget > 0 && src_ranges.size() > 0 && split_cost + cost > cost_budget) {
+      add_split_image();
+    }
+    split_cost += cost;
+
     const ImageChunk* src = src_image.FindChunkByName(tgt->GetEntryName(), true);
     if (src == nullptr) {
-      split_tgt_chunks.emplace_back(CHUNK_NORMAL, tgt->GetStartOffset(), &tgt_image.file_content_,
-                                    tgt->GetRawDataLength());
+      split_tgt_chunks.emplace_back(CHUNK_NORMAL, tgt->GetStartOffset(), tgt_image.FileData(),
+                                    tgt_image.FileSize(), tgt->GetRawDataLength());
       continue;
     }
 
@@ -940,8 +1264,8 @@ bool ZipModeImage::SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
     // Make sure this source range hasn't been used before so that the src_range pieces don't
     // overlap with each other.
     if (!RemoveUsedBlocks(&src_offset, &src_length, used_src_ranges)) {
-      split_tgt_chunks.emplace_back(CHUNK_NORMAL, tgt->GetStartOffset(), &tgt_image.file_content_,
-                                    tgt->GetRawDataLength());
+      split_tgt_chunks.emplace_back(CHUNK_NORMAL, tgt->GetStartOffset(), tgt_image.FileData(),
+                                    tgt_image.FileSize(), tgt->GetRawDataLength());
     } else if (src_ranges.blocks() * BLOCK_SIZE + src_length <= limit) {
       src_ranges.Insert(src_offset, src_length);
 
@@ -951,22 +1275,11 @@ bool ZipModeImage::SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
         split_tgt_chunks.push_back(*tgt);
       } else {
         // TODO split smarter to avoid alignment of large deflate chunks
-        split_tgt_chunks.emplace_back(CHUNK_NORMAL, tgt->GetStartOffset(), &tgt_image.file_content_,
-                                      tgt->GetRawDataLength());
+        split_tgt_chunks.emplace_back(CHUNK_NORMAL, tgt->GetStartOffset(), tgt_image.FileData(),
+                                      tgt_image.FileSize(), tgt->GetRawDataLength());
       }
     } else {
-      bool added_image = ZipModeImage::AddSplitImageFromChunkList(
-          tgt_image, src_image, src_ranges, split_tgt_chunks, split_src_chunks, split_tgt_images,
-          split_src_images);
-
-      split_tgt_chunks.clear();
-      split_src_chunks.clear();
-      // No need to update the split_src_ranges if we don't update the split source images.
-      if (added_image) {
-        used_src_ranges.Insert(src_ranges);
-        split_src_ranges->push_back(std::move(src_ranges));
-      }
-      src_ranges.Clear();
+      add_split_image();
 
       // We don't have enough space for the current chunk; start a new split image and handle
       // this chunk there.
@@ -984,7 +1297,7 @@ bool ZipModeImage::SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
   }
 
   ValidateSplitImages(*split_tgt_images, *split_src_images, *split_src_ranges,
-                      tgt_image.file_content_.size());
+                      tgt_image.FileSize());
 
   return true;
 }
@@ -1008,8 +1321,8 @@ bool ZipModeImage::AddSplitImageFromChunkList(const ZipModeImage& tgt_image,
 
     // Current ImageChunk is long enough to align.
     if (AlignHead(&tgt_start, &tgt_length)) {
-      aligned_tgt_chunks.emplace_back(CHUNK_NORMAL, tgt_start, &tgt_image.file_content_,
-                                      tgt_length);
+      aligned_tgt_chunks.emplace_back(CHUNK_NORMAL, tgt_start, tgt_image.FileData(),
+                                      tgt_image.FileSize(), tgt_length);
       break;
     }
 
@@ -1028,11 +1341,11 @@ bool ZipModeImage::AddSplitImageFromChunkList(const ZipModeImage& tgt_image,
   // Add a normal chunk to align the contents in the end.
   size_t end_offset =
       aligned_tgt_chunks.back().GetStartOffset() + aligned_tgt_chunks.back().GetRawDataLength();
-  if (end_offset % BLOCK_SIZE != 0 && end_offset < tgt_image.file_content_.size()) {
-    size_t tail_block_length = std::min<size_t>(tgt_image.file_content_.size() - end_offset,
+  if (end_offset % BLOCK_SIZE != 0 && end_offset < tgt_image.FileSize()) {
+    size_t tail_block_length = std::min<size_t>(tgt_image.FileSize() - end_offset,
                                                 BLOCK_SIZE - (end_offset % BLOCK_SIZE));
-    aligned_tgt_chunks.emplace_back(CHUNK_NORMAL, end_offset, &tgt_image.file_content_,
-                                    tail_block_length);
+    aligned_tgt_chunks.emplace_back(CHUNK_NORMAL, end_offset, tgt_image.FileData(),
+                                    tgt_image.FileSize(), tail_block_length);
   }
 
   ZipModeImage split_tgt_image(false);
@@ -1042,9 +1355,9 @@ bool ZipModeImage::AddSplitImageFromChunkList(const ZipModeImage& tgt_image,
   // Construct the dummy source file based on the src_ranges.
   std::vector<uint8_t> src_content;
   for (const auto& r : split_src_ranges) {
-    size_t end = std::min(src_image.file_content_.size(), r.second * BLOCK_SIZE);
-    src_content.insert(src_content.end(), src_image.file_content_.begin() + r.first * BLOCK_SIZE,
-                       src_image.file_content_.begin() + end);
+    size_t end = std::min(src_image.FileSize(), r.second * BLOCK_SIZE);
+    src_content.insert(src_content.end(), src_image.FileData() + r.first * BLOCK_SIZE,
+                       src_image.FileData() + end);
   }
 
   // We should not have an empty src in our design; otherwise we will encounter an error in
@@ -1097,56 +1410,130 @@ void ZipModeImage::ValidateSplitImages(const std::vector<ZipModeImage>& split_tg
 
 bool ZipModeImage::GeneratePatchesInternal(const ZipModeImage& tgt_image,
                                            const ZipModeImage& src_image,
-                                           std::vector<PatchChunk>* patch_chunks) {
+                                           std::vector<PatchChunk>* patch_chunks,
+                                           const PatchGenerationOptions& options) {
   LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
   patch_chunks->clear();
 
-  bsdiff::SuffixArrayIndexInterface* bsdiff_cache = nullptr;
-  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
+  // Find the source for each target chunk first, so that the chunks can be diffed in any order.
+  // A nullptr source means the chunk is either stored as raw data or diffed against the
+  // PseudoSource.
+  size_t num_chunks = tgt_image.NumOfChunks();
+  std::vector<const ImageChunk*> src_chunks(num_chunks, nullptr);
+  std::vector<size_t> pending;
+  bool use_pseudo_source = false;
+  for (size_t i = 0; i < num_chunks; i++) {
     const auto& tgt_chunk = tgt_image[i];
-
     if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
-      patch_chunks->emplace_back(tgt_chunk);
       continue;
     }
 
-    const ImageChunk* src_chunk = (tgt_chunk.GetType() != CHUNK_DEFLATE)
-                                      ? nullptr
-                                      : src_image.FindChunkByName(tgt_chunk.GetEntryName());
+    if (tgt_chunk.GetType() == CHUNK_DEFLATE) {
+      src_chunks[i] = src_image.FindChunkByName(tgt_chunk.GetEntryName());
+    }
+    use_pseudo_source |= (src_chunks[i] == nullptr);
+    pending.push_back(i);
+  }
+
+  // The suffix array of the PseudoSource is built once up front, and then shared read-only by all
+  // the bsdiff calls against it.
+  ImageChunk pseudo_source = src_image.PseudoSource();
+  std::unique_ptr<bsdiff::SuffixArrayIndexInterface> bsdiff_cache;
+  if (use_pseudo_source) {
+    double start_wall = ImgdiffProfiler::WallTimeMs();
+    double start_cpu = ImgdiffProfiler::ThreadCpuTimeMs();
+    bsdiff_cache = bsdiff::CreateSuffixArrayIndex(pseudo_source.DataForPatch(),
+                                                  pseudo_source.DataLengthForPatch());
+    if (!bsdiff_cache) {
+      LOG(ERROR) << "Failed to create the suffix array for the source image";
+      return false;
+    }
+    if (options.profiler != nullptr) {
+      options.profiler->AddPhaseTime("suffix_array", ImgdiffProfiler::WallTimeMs() - start_wall,
+                                     ImgdiffProfiler::ThreadCpuTimeMs() - start_cpu);
+    }
+  }
+
+  // Start with the largest chunks so that a single big entry doesn't end up last in the queue.
+  if (options.jobs > 1) {
+    std::stable_sort(pending.begin(), pending.end(), [&tgt_image](size_t a, size_t b) {
+      return tgt_image[a].DataLengthForPatch() > tgt_image[b].DataLengthForPatch();
+    });
+  }
 
-    const auto& src_ref = (src_chunk == nullptr) ? src_image.PseudoSource() : *src_chunk;
+  std::vector<std::vector<uint8_t>> patch_data(num_chunks);
+  std::vector<ImgdiffChunkProfile> profiles(num_chunks);
+  bool result = RunParallel(pending.size(), options.jobs, [&](size_t n) {
+    size_t i = pending[n];
+    double start_cpu = ImgdiffProfiler::ThreadCpuTimeMs();
+    // Work on copies, so that the uncompressed data of the deflate chunks is only held in memory
+    // while the chunk is being diffed.
+    ImageChunk tgt_chunk = tgt_image[i];
+    ImageChunk src_ref = (src_chunks[i] == nullptr) ? pseudo_source : *src_chunks[i];
+    if (!tgt_chunk.LoadUncompressedData() || !src_ref.LoadUncompressedData()) {
+      return false;
+    }
+    // bsdiff only reads from a cache that is already populated.
+    bsdiff::SuffixArrayIndexInterface* shared_cache = bsdiff_cache.get();
     bsdiff::SuffixArrayIndexInterface** bsdiff_cache_ptr =
-        (src_chunk == nullptr) ? &bsdiff_cache : nullptr;
+        (src_chunks[i] == nullptr) ? &shared_cache : nullptr;
 
-    std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_ref, &patch_data, bsdiff_cache_ptr)) {
+    ImgdiffChunkProfile* profile = options.profiler ? &profiles[i] : nullptr;
+    if (!ImageChunk::MakePatch(tgt_chunk, src_ref, &patch_data[i], bsdiff_cache_ptr,
+                               options.bsdiff_format, profile)) {
       LOG(ERROR) << "Failed to generate patch, name: " << tgt_chunk.GetEntryName();
       return false;
     }
+    if (profile != nullptr) {
+      profile->source_data_size = src_ref.DataLengthForPatch();
+      profile->cpu_ms = ImgdiffProfiler::ThreadCpuTimeMs() - start_cpu;
+    }
 
-    LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
+    LOG(INFO) << "patch " << i << " is " << patch_data[i].size() << " bytes (of "
               << tgt_chunk.GetRawDataLength() << ")";
+    return true;
+  });
+  if (!result) {
+    return false;
+  }
 
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
+  // Assemble the patch chunks in the target order; the output doesn't depend on the number of
+  // jobs.
+  patch_chunks->reserve(num_chunks);
+  for (size_t i = 0; i < num_chunks; i++) {
+    const auto& tgt_chunk = tgt_image[i];
+    bool raw = PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data[i].size());
+    if (raw) {
       patch_chunks->emplace_back(tgt_chunk);
     } else {
-      patch_chunks->emplace_back(tgt_chunk, src_ref, std::move(patch_data));
+      const auto& src_ref = (src_chunks[i] == nullptr) ? pseudo_source : *src_chunks[i];
+      patch_chunks->emplace_back(tgt_chunk, src_ref, std::move(patch_data[i]));
+    }
+    if (options.profiler != nullptr) {
+      RecordChunkProfile(options.profiler, options.split_index, i, tgt_chunk, raw,
+                         patch_chunks->back().PatchSize(), &profiles[i]);
     }
   }
-  delete bsdiff_cache;
 
   CHECK_EQ(patch_chunks->size(), tgt_image.NumOfChunks());
   return true;
 }
 
 bool ZipModeImage::GeneratePatches(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                                   const std::string& patch_name) {
+                                   const std::string& patch_name,
+                                   const PatchGenerationOptions& options) {
   std::vector<PatchChunk> patch_chunks;
 
-  ZipModeImage::GeneratePatchesInternal(tgt_image, src_image, &patch_chunks);
+  {
+    ImgdiffProfiler::ScopedPhase phase(options.profiler, "generate_patches");
+    if (!ZipModeImage::GeneratePatchesInternal(tgt_image, src_image, &patch_chunks, options)) {
+      return false;
+    }
+  }
 
   CHECK_EQ(tgt_image.NumOfChunks(), patch_chunks.size());
 
+  ImgdiffProfiler::ScopedPhase phase(options.profiler, "write_patch");
   android::base::unique_fd patch_fd(
       open(patch_name.c_str(), O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR));
   if (patch_fd == -1) {
@@ -1162,9 +1549,29 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
                                    const std::vector<SortedRangeSet>& split_src_ranges,
                                    const std::string& patch_name,
                                    const std::string& split_info_file,
-                                   const std::string& debug_dir) {
+                                   const std::string& debug_dir,
+                                   const PatchGenerationOptions& options) {
   LOG(INFO) << "Constructing patches for " << split_tgt_images.size() << " split images...";
 
+  // The split images are independent of each other; diff them concurrently and write the results
+  // out in order afterwards.
+  std::vector<std::vector<PatchChunk>> split_patch_chunks(split_tgt_images.size());
+  {
+    ImgdiffProfiler::ScopedPhase phase(options.profiler, "generate_patches");
+    bool result = RunParallel(split_tgt_images.size(), options.jobs, [&](size_t i) {
+      PatchGenerationOptions split_options = options;
+      split_options.jobs = 1;
+      split_options.split_index = i;
+      return ZipModeImage::GeneratePatchesInternal(split_tgt_images[i], split_src_images[i],
+                                                   &split_patch_chunks[i], split_options);
+    });
+    if (!result) {
+      LOG(ERROR) << "Failed to generate split patch";
+      return false;
+    }
+  }
+
+  ImgdiffProfiler::ScopedPhase phase(options.profiler, "write_patch");
   android::base::unique_fd patch_fd(
       open(patch_name.c_str(), O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR));
   if (patch_fd == -1) {
@@ -1174,13 +1581,7 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
 
   std::vector<std::string> split_info_list;
   for (size_t i = 0; i < split_tgt_images.size(); i++) {
-    std::vector<PatchChunk> patch_chunks;
-    if (!ZipModeImage::GeneratePatchesInternal(split_tgt_images[i], split_src_images[i],
-                                               &patch_chunks)) {
-      LOG(ERROR) << "Failed to generate split patch";
-      return false;
-    }
-
+    auto& patch_chunks = split_patch_chunks[i];
     size_t total_patch_size = 12;
     for (auto& p : patch_chunks) {
       p.UpdateSourceOffset(split_src_ranges[i]);
@@ -1196,6 +1597,9 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
                             split_tgt_images[i].chunks_.front().GetStartOffset();
     std::string split_info = android::base::StringPrintf(
         "%zu %zu %s", total_patch_size, split_tgt_size, split_src_ranges[i].ToString().c_str());
+    if (options.split_parallelism > 0) {
+      split_info += android::base::StringPrintf(" %zu", split_tgt_images[i].EstimateApplyCost());
+    }
     split_info_list.push_back(split_info);
 
     // Write the split source & patch into the debug directory.
@@ -1230,9 +1634,12 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
   // Store the split in the following format:
   // Line 0:   imgdiff version#
   // Line 1:   number of pieces
-  // Line 2:   patch_size_1 tgt_size_1 src_range_1
+  // Line 2:   patch_size_1 tgt_size_1 src_range_1 [cost_1]
   // ...
-  // Line n+1: patch_size_n tgt_size_n src_range_n
+  // Line n+1: patch_size_n tgt_size_n src_range_n [cost_n]
+  // The estimated apply costs are only present with --split-parallelism, so that the file stays
+  // the same for the existing readers otherwise. The pieces read disjoint source ranges and write
+  // disjoint target ranges, so they can be applied concurrently.
   std::string split_info_string = android::base::StringPrintf(
       "%zu\n%zu\n", VERSION, split_info_list.size()) + android::base::Join(split_info_list, '\n');
   if (!android::base::WriteStringToFile(split_info_string, split_info_file)) {
@@ -1243,116 +1650,303 @@ bool ZipModeImage::GeneratePatches(const std::vector<ZipModeImage>& split_tgt_im
   return true;
 }
 
-bool ImageModeImage::Initialize(const std::string& filename) {
-  if (!ReadFile(filename, &file_content_)) {
-    return false;
+// Return the offset of the first gzip member header (0x1f8b0800) in [start, size), or |size| if
+// there is none. memchr() is vectorized in libc, and 0x1f is rare enough in the images we handle
+// that the candidates are few.
+static size_t FindGzipMagic(const uint8_t* data, size_t size, size_t start) {
+  while (size >= 4 && start <= size - 4) {
+    auto p = static_cast<const uint8_t*>(memchr(data + start, 0x1f, size - 3 - start));
+    if (p == nullptr) {
+      break;
+    }
+    // 0x00 no header flags, 0x08 deflate compression, 0x1f8b gzip magic number
+    if (get_unaligned<uint32_t>(p) == 0x00088b1f) {
+      return p - data;
+    }
+    start = p - data + 1;
   }
+  return size;
+}
 
-  size_t sz = file_content_.size();
-  size_t pos = 0;
-  while (pos < sz) {
-    // 0x00 no header flags, 0x08 deflate compression, 0x1f8b gzip magic number
-    if (sz - pos >= 4 && get_unaligned<uint32_t>(file_content_.data() + pos) == 0x00088b1f) {
-      // 'pos' is the offset of the start of a gzip chunk.
-      size_t chunk_offset = pos;
+// The deflate body of a gzip member, or the reason why the member can't be used.
+struct GzipMember {
+  // zlib failed to set up the stream, which is fatal rather than a reason to skip the member.
+  bool init_failed = false;
+  std::string error;
+  size_t raw_data_len = 0;
+  std::vector<uint8_t> uncompressed_data;
+};
 
-      // The remaining data is too small to be a gzip chunk; treat them as a normal chunk.
-      if (sz - pos < GZIP_HEADER_LEN + GZIP_FOOTER_LEN) {
-        chunks_.emplace_back(CHUNK_NORMAL, pos, &file_content_, sz - pos);
-        break;
-      }
+// Inflate the gzip member whose header starts at |offset|, and check its length against the ISIZE
+// in the footer. |size_hint| is the expected uncompressed length (or 0 if unknown), so that we
+// don't need to grow the output buffer repeatedly.
+static void InflateGzipMember(const uint8_t* data, size_t size, size_t offset, size_t size_hint,
+                              GzipMember* member) {
+  size_t pos = offset + GZIP_HEADER_LEN;
 
-      // We need three chunks for the deflated image in total, one normal chunk for the header,
-      // one deflated chunk for the body, and another normal chunk for the footer.
-      chunks_.emplace_back(CHUNK_NORMAL, pos, &file_content_, GZIP_HEADER_LEN);
-      pos += GZIP_HEADER_LEN;
-
-      // We must decompress this chunk in order to discover where it ends, and so we can update
-      // the uncompressed_data of the image body and its length.
-
-      z_stream strm;
-      strm.zalloc = Z_NULL;
-      strm.zfree = Z_NULL;
-      strm.opaque = Z_NULL;
-      strm.avail_in = sz - pos;
-      strm.next_in = file_content_.data() + pos;
-
-      // -15 means we are decoding a 'raw' deflate stream; zlib will
-      // not expect zlib headers.
-      int ret = inflateInit2(&strm, -15);
-      if (ret < 0) {
-        LOG(ERROR) << "Failed to initialize inflate: " << ret;
-        return false;
-      }
+  z_stream strm;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  strm.avail_in = size - pos;
+  strm.next_in = const_cast<uint8_t*>(data + pos);
 
-      size_t allocated = BUFFER_SIZE;
-      std::vector<uint8_t> uncompressed_data(allocated);
-      size_t uncompressed_len = 0, raw_data_len = 0;
-      do {
-        strm.avail_out = allocated - uncompressed_len;
-        strm.next_out = uncompressed_data.data() + uncompressed_len;
-        ret = inflate(&strm, Z_NO_FLUSH);
-        if (ret < 0) {
-          LOG(WARNING) << "Inflate failed [" << strm.msg << "] at offset [" << chunk_offset
-                       << "]; treating as a normal chunk";
-          break;
-        }
-        uncompressed_len = allocated - strm.avail_out;
-        if (strm.avail_out == 0) {
-          allocated *= 2;
-          uncompressed_data.resize(allocated);
-        }
-      } while (ret != Z_STREAM_END);
+  // -15 means we are decoding a 'raw' deflate stream; zlib will
+  // not expect zlib headers.
+  int ret = inflateInit2(&strm, -15);
+  if (ret < 0) {
+    member->init_failed = true;
+    member->error = android::base::StringPrintf("Failed to initialize inflate: %d", ret);
+    return;
+  }
+
+  size_t allocated = std::max(size_hint, BUFFER_SIZE);
+  std::vector<uint8_t>& uncompressed_data = member->uncompressed_data;
+  uncompressed_data.resize(allocated);
+  size_t uncompressed_len = 0;
+  do {
+    strm.avail_out = allocated - uncompressed_len;
+    strm.next_out = uncompressed_data.data() + uncompressed_len;
+    ret = inflate(&strm, Z_NO_FLUSH);
+    if (ret < 0) {
+      member->error = android::base::StringPrintf(
+          "Inflate failed [%s] at offset [%zu]; treating as a normal chunk",
+          strm.msg != nullptr ? strm.msg : "", offset);
+      break;
+    }
+    uncompressed_len = allocated - strm.avail_out;
+    if (ret != Z_STREAM_END && strm.avail_out == 0) {
+      allocated *= 2;
+      uncompressed_data.resize(allocated);
+    }
+  } while (ret != Z_STREAM_END);
 
-      raw_data_len = sz - strm.avail_in - pos;
-      inflateEnd(&strm);
+  member->raw_data_len = size - strm.avail_in - pos;
+  inflateEnd(&strm);
 
-      if (ret < 0) {
-        continue;
-      }
+  if (ret < 0) {
+    uncompressed_data.clear();
+    uncompressed_data.shrink_to_fit();
+    return;
+  }
+  uncompressed_data.resize(uncompressed_len);
 
-      // The footer contains the size of the uncompressed data.  Double-check to make sure that it
-      // matches the size of the data we got when we actually did the decompression.
-      size_t footer_index = pos + raw_data_len + GZIP_FOOTER_LEN - 4;
-      if (sz - footer_index < 4) {
-        LOG(WARNING) << "invalid footer position; treating as a normal chunk";
-        continue;
+  // The footer contains the size of the uncompressed data.  Double-check to make sure that it
+  // matches the size of the data we got when we actually did the decompression.
+  size_t footer_index = pos + member->raw_data_len + GZIP_FOOTER_LEN - 4;
+  if (size - footer_index < 4) {
+    member->error = "invalid footer position; treating as a normal chunk";
+  } else {
+    size_t footer_size = get_unaligned<uint32_t>(data + footer_index);
+    if (footer_size != uncompressed_len) {
+      member->error = android::base::StringPrintf(
+          "footer size %zu != %zu; treating as a normal chunk", footer_size, uncompressed_len);
+    }
+  }
+  if (!member->error.empty()) {
+    uncompressed_data.clear();
+    uncompressed_data.shrink_to_fit();
+  }
+}
+
+// The size hint only sets the initial output buffer, which grows by doubling past it. It's read
+// from untrusted bytes (a spurious magic gets whatever precedes the next candidate), so keep it
+// within a typical compression ratio of the span, and under a fixed ceiling.
+static constexpr size_t GZIP_SIZE_HINT_RATIO = 16;
+static constexpr size_t MAX_GZIP_SIZE_HINT = 64 * 1024 * 1024;
+
+// Guess the uncompressed length of the gzip member at |offset| from the ISIZE field right before
+// |end|, which is where the next member (or the file) starts. Return 0 if the value can't be the
+// length of this member, e.g. when there's padding after the member.
+static size_t GzipSizeHint(const uint8_t* data, size_t offset, size_t end) {
+  if (end - offset < GZIP_HEADER_LEN + GZIP_FOOTER_LEN) {
+    return 0;
+  }
+  size_t isize = get_unaligned<uint32_t>(data + end - 4);
+  // Deflate can't compress better than 1032:1.
+  size_t compressed_len = end - offset - GZIP_HEADER_LEN - GZIP_FOOTER_LEN;
+  if (isize == 0 || isize / 1032 > compressed_len) {
+    return 0;
+  }
+  return std::min({ isize, compressed_len * GZIP_SIZE_HINT_RATIO, MAX_GZIP_SIZE_HINT });
+}
+
+// Inflate the gzip member candidate |magics[i]|, using the next candidate to guess its size.
+static void InflateGzipCandidate(const uint8_t* data, size_t size,
+                                 const std::vector<size_t>& magics, size_t i, GzipMember* member) {
+  size_t offset = magics[i];
+  auto next = std::lower_bound(magics.begin() + i, magics.end(), offset + GZIP_HEADER_LEN);
+  size_t end = (next == magics.end()) ? size : *next;
+  InflateGzipMember(data, size, offset, GzipSizeHint(data, offset, end), member);
+}
+
+// Hands the gzip members to the sequential scan in ImageModeImage::Initialize(), in the order of
+// the candidate headers in |magics|. With more than one job, background threads inflate up to
+// |jobs| candidates from the scan position onwards. A candidate that the scan skips (i.e. one that
+// turned out to be inside an earlier member) is not started once the scan has passed it, and its
+// result is dropped, so the speculative work stays bounded by the number of jobs.
+class GzipMemberPrefetcher {
+ public:
+  GzipMemberPrefetcher(const uint8_t* data, size_t size, const std::vector<size_t>& magics,
+                       size_t jobs)
+      : data_(data),
+        size_(size),
+        magics_(magics),
+        window_(jobs),
+        members_(magics.size()),
+        states_(magics.size(), kPending) {
+    for (size_t t = 1; t < jobs && t < magics.size(); t++) {
+      threads_.emplace_back(&GzipMemberPrefetcher::Worker, this);
+    }
+  }
+
+  ~GzipMemberPrefetcher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : threads_) {
+      t.join();
+    }
+  }
+
+  // Return the inflated member at candidate |i|, and let go of the candidates before it. |i| must
+  // not decrease between calls.
+  GzipMember Take(size_t i) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (size_t k = scan_; k < i; k++) {
+      members_[k] = GzipMember();
+    }
+    scan_ = i;
+    next_ = std::max(next_, i);
+    cv_.notify_all();
+
+    if (states_[i] == kPending) {
+      states_[i] = kInflating;
+      lock.unlock();
+      GzipMember member;
+      InflateGzipCandidate(data_, size_, magics_, i, &member);
+      return member;
+    }
+    cv_.wait(lock, [this, i] { return states_[i] == kDone; });
+    return std::move(members_[i]);
+  }
+
+ private:
+  enum State : uint8_t { kPending, kInflating, kDone };
+
+  void Worker() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [this] {
+        return stop_ || (next_ < magics_.size() && next_ < scan_ + window_);
+      });
+      if (stop_) {
+        return;
       }
-      size_t footer_size = get_unaligned<uint32_t>(file_content_.data() + footer_index);
-      if (footer_size != uncompressed_len) {
-        LOG(WARNING) << "footer size " << footer_size << " != " << uncompressed_len
-                     << "; treating as a normal chunk";
+      size_t i = next_++;
+      if (states_[i] != kPending || size_ - magics_[i] < GZIP_HEADER_LEN + GZIP_FOOTER_LEN) {
         continue;
       }
+      states_[i] = kInflating;
+      lock.unlock();
+      GzipMember member;
+      InflateGzipCandidate(data_, size_, magics_, i, &member);
+      lock.lock();
+      states_[i] = kDone;
+      // The scan may have moved past this candidate in the meantime.
+      if (i >= scan_) {
+        members_[i] = std::move(member);
+      }
+      cv_.notify_all();
+    }
+  }
 
-      ImageChunk body(CHUNK_DEFLATE, pos, &file_content_, raw_data_len);
-      uncompressed_data.resize(uncompressed_len);
-      body.SetUncompressedData(std::move(uncompressed_data));
-      chunks_.push_back(std::move(body));
+  const uint8_t* data_;
+  size_t size_;
+  const std::vector<size_t>& magics_;
+  size_t window_;
 
-      pos += raw_data_len;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<GzipMember> members_;
+  std::vector<State> states_;
+  size_t scan_ = 0;  // The candidate that the scan is at.
+  size_t next_ = 0;  // The next candidate to inflate speculatively.
+  bool stop_ = false;
+  std::vector<std::thread> threads_;
 
-      // create a normal chunk for the footer
-      chunks_.emplace_back(CHUNK_NORMAL, pos, &file_content_, GZIP_FOOTER_LEN);
+  DISALLOW_COPY_AND_ASSIGN(GzipMemberPrefetcher);
+};
 
-      pos += GZIP_FOOTER_LEN;
-    } else {
+bool ImageModeImage::Initialize(const std::string& filename) {
+  if (!MapFile(filename)) {
+    return false;
+  }
+
+  const uint8_t* data = FileData();
+  size_t sz = FileSize();
+
+  // Locate all the gzip headers first. With multiple jobs, the members right after the scan
+  // position are then inflated in parallel.
+  std::vector<size_t> magics;
+  for (size_t pos = FindGzipMagic(data, sz, 0); pos < sz; pos = FindGzipMagic(data, sz, pos + 1)) {
+    magics.push_back(pos);
+  }
+  GzipMemberPrefetcher prefetcher(data, sz, magics, jobs_);
+
+  size_t pos = 0;
+  size_t next_magic = 0;
+  while (pos < sz) {
+    while (next_magic < magics.size() && magics[next_magic] < pos) {
+      next_magic++;
+    }
+
+    if (next_magic == magics.size() || magics[next_magic] != pos) {
       // Use a normal chunk to take all the contents until the next gzip chunk (or EOF); we expect
       // the number of chunks to be small (5 for typical boot and recovery images).
+      size_t data_len = (next_magic == magics.size() ? sz : magics[next_magic]) - pos;
+      chunks_.emplace_back(CHUNK_NORMAL, pos, data, sz, data_len);
+      pos += data_len;
+      continue;
+    }
 
-      // Scan forward until we find a gzip header.
-      size_t data_len = 0;
-      while (data_len + pos < sz) {
-        if (data_len + pos + 4 <= sz &&
-            get_unaligned<uint32_t>(file_content_.data() + pos + data_len) == 0x00088b1f) {
-          break;
-        }
-        data_len++;
-      }
-      chunks_.emplace_back(CHUNK_NORMAL, pos, &file_content_, data_len);
+    // 'pos' is the offset of the start of a gzip chunk.
 
-      pos += data_len;
+    // The remaining data is too small to be a gzip chunk; treat them as a normal chunk.
+    if (sz - pos < GZIP_HEADER_LEN + GZIP_FOOTER_LEN) {
+      chunks_.emplace_back(CHUNK_NORMAL, pos, data, sz, sz - pos);
+      break;
+    }
+
+    // We need three chunks for the deflated image in total, one normal chunk for the header,
+    // one deflated chunk for the body, and another normal chunk for the footer.
+    chunks_.emplace_back(CHUNK_NORMAL, pos, data, sz, GZIP_HEADER_LEN);
+    pos += GZIP_HEADER_LEN;
+
+    // We must decompress this chunk in order to discover where it ends, and so we can update
+    // the uncompressed_data of the image body and its length.
+    GzipMember member = prefetcher.Take(next_magic);
+    if (member.init_failed) {
+      LOG(ERROR) << member.error;
+      return false;
     }
+    if (!member.error.empty()) {
+      LOG(WARNING) << member.error;
+      continue;
+    }
+
+    ImageChunk body(CHUNK_DEFLATE, pos, data, sz, member.raw_data_len);
+    body.SetUncompressedData(std::move(member.uncompressed_data));
+    chunks_.push_back(std::move(body));
+
+    pos += member.raw_data_len;
+
+    // create a normal chunk for the footer
+    chunks_.emplace_back(CHUNK_NORMAL, pos, data, sz, GZIP_FOOTER_LEN);
+
+    pos += GZIP_FOOTER_LEN;
   }
 
   return true;
@@ -1372,7 +1966,8 @@ bool ImageModeImage::SetBonusData(const std::vector<uint8_t>& bonus_data) {
 
 // In Image Mode, verify that the source and target images have the same chunk structure (ie, the
 // same sequence of deflate and normal chunks).
-bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeImage* src_image) {
+bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeImage* src_image,
+                                           const PatchGenerationOptions& options) {
   // In image mode, merge the gzip header and footer in with any adjacent normal chunks.
   tgt_image->MergeAdjacentNormalChunks();
   src_image->MergeAdjacentNormalChunks();
@@ -1392,6 +1987,7 @@ bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeI
     }
   }
 
+  std::vector<size_t> candidates;
   for (size_t i = 0; i < tgt_image->NumOfChunks(); ++i) {
     auto& tgt_chunk = (*tgt_image)[i];
     auto& src_chunk = (*src_image)[i];
@@ -1403,7 +1999,23 @@ bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeI
     if (tgt_chunk == src_chunk) {
       tgt_chunk.ChangeDeflateChunkToNormal();
       src_chunk.ChangeDeflateChunkToNormal();
-    } else if (!tgt_chunk.ReconstructDeflateChunk()) {
+    } else {
+      candidates.push_back(i);
+    }
+  }
+
+  // The deflate chunks (e.g. the kernel and the ramdisk) can be reconstructed independently.
+  std::vector<uint8_t> reconstructed(candidates.size(), 0);
+  RunParallel(candidates.size(), options.jobs, [&](size_t n) {
+    reconstructed[n] = (*tgt_image)[candidates[n]].ReconstructDeflateChunk();
+    return true;
+  });
+
+  for (size_t n = 0; n < candidates.size(); n++) {
+    if (!reconstructed[n]) {
+      size_t i = candidates[n];
+      auto& tgt_chunk = (*tgt_image)[i];
+      auto& src_chunk = (*src_image)[i];
       // We cannot recompress the data and get exactly the same bits as are in the input target
       // image, fall back to normal
       LOG(WARNING) << "Failed to reconstruct target deflate chunk " << i << " ["
@@ -1430,37 +2042,50 @@ bool ImageModeImage::CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeI
 // result to |patch_name|.
 bool ImageModeImage::GeneratePatches(const ImageModeImage& tgt_image,
                                      const ImageModeImage& src_image,
-                                     const std::string& patch_name) {
+                                     const std::string& patch_name,
+                                     const PatchGenerationOptions& options) {
   LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
   std::vector<PatchChunk> patch_chunks;
   patch_chunks.reserve(tgt_image.NumOfChunks());
 
-  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
-    const auto& tgt_chunk = tgt_image[i];
-    const auto& src_chunk = src_image[i];
-
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
-      patch_chunks.emplace_back(tgt_chunk);
-      continue;
-    }
-
-    std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_chunk, &patch_data, nullptr)) {
-      LOG(ERROR) << "Failed to generate patch for target chunk " << i;
-      return false;
-    }
-    LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
-              << tgt_chunk.GetRawDataLength() << ")";
+  {
+    ImgdiffProfiler::ScopedPhase generate_phase(options.profiler, "generate_patches");
+    for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
+      const auto& tgt_chunk = tgt_image[i];
+      const auto& src_chunk = src_image[i];
+      ImgdiffChunkProfile profile;
+      double start_cpu = ImgdiffProfiler::ThreadCpuTimeMs();
+
+      std::vector<uint8_t> patch_data;
+      if (!PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
+        ImgdiffChunkProfile* profile_ptr = options.profiler ? &profile : nullptr;
+        if (!ImageChunk::MakePatch(tgt_chunk, src_chunk, &patch_data, nullptr,
+                                   options.bsdiff_format, profile_ptr)) {
+          LOG(ERROR) << "Failed to generate patch for target chunk " << i;
+          return false;
+        }
+        LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
+                  << tgt_chunk.GetRawDataLength() << ")";
+        profile.source_data_size = src_chunk.DataLengthForPatch();
+        profile.cpu_ms = ImgdiffProfiler::ThreadCpuTimeMs() - start_cpu;
+      }
 
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
-      patch_chunks.emplace_back(tgt_chunk);
-    } else {
-      patch_chunks.emplace_back(tgt_chunk, src_chunk, std::move(patch_data));
+      bool raw = PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size());
+      if (raw) {
+        patch_chunks.emplace_back(tgt_chunk);
+      } else {
+        patch_chunks.emplace_back(tgt_chunk, src_chunk, std::move(patch_data));
+      }
+      if (options.profiler != nullptr) {
+        RecordChunkProfile(options.profiler, -1, i, tgt_chunk, raw,
+                           patch_chunks.back().PatchSize(), &profile);
+      }
     }
   }
 
   CHECK_EQ(tgt_image.NumOfChunks(), patch_chunks.size());
 
+  ImgdiffProfiler::ScopedPhase write_phase(options.profiler, "write_patch");
   android::base::unique_fd patch_fd(
       open(patch_name.c_str(), O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR));
   if (patch_fd == -1) {
@@ -1478,12 +2103,14 @@ int imgdiff(int argc, const char** argv) {
   size_t blocks_limit = 0;
   std::string split_info_file;
   std::string debug_dir;
+  std::string profile_file;
+  PatchGenerationOptions options;
 
   int opt;
   int option_index;
   optind = 0;  // Reset the getopt state so that we can call it multiple times for test.
 
-  while ((opt = getopt_long(argc, const_cast<char**>(argv), "zb:v", OPTIONS, &option_index)) !=
+  while ((opt = getopt_long(argc, const_cast<char**>(argv), "zb:vj:", OPTIONS, &option_index)) !=
          -1) {
     switch (opt) {
       case 'z':
@@ -1512,6 +2139,12 @@ int imgdiff(int argc, const char** argv) {
       case 'v':
         verbose = true;
         break;
+      case 'j':
+        if (!android::base::ParseUint(optarg, &options.jobs) || options.jobs == 0) {
+          LOG(ERROR) << "Failed to parse the number of jobs: " << optarg;
+          return 1;
+        }
+        break;
       case 0: {
         std::string name = OPTIONS[option_index].name;
         if (name == "block-limit" && !android::base::ParseUint(optarg, &blocks_limit)) {
@@ -1521,6 +2154,22 @@ int imgdiff(int argc, const char** argv) {
           split_info_file = optarg;
         } else if (name == "debug-dir") {
           debug_dir = optarg;
+        } else if (name == "profile") {
+          profile_file = optarg;
+        } else if (name == "split-parallelism") {
+          if (!android::base::ParseUint(optarg, &options.split_parallelism)) {
+            LOG(ERROR) << "Failed to parse split-parallelism: " << optarg;
+            return 1;
+          }
+        } else if (name == "bsdiff-format") {
+          if (strcmp(optarg, "bsdiff40") == 0) {
+            options.bsdiff_format = BsdiffFormat::kBsdiff40;
+          } else if (strcmp(optarg, "bsdf2") == 0) {
+            options.bsdiff_format = BsdiffFormat::kBsdf2;
+          } else {
+            LOG(ERROR) << "Unknown bsdiff format: " << optarg;
+            return 1;
+          }
         }
         break;
       }
@@ -1546,23 +2195,48 @@ int imgdiff(int argc, const char** argv) {
            "  --split-info,     Output the split information (patch_size, tgt_size, src_ranges);\n"
            "                    zip mode with block-limit only.\n"
            "  --debug-dir,      Debug directory to put the split srcs and patches, zip mode only.\n"
-           "  -v, --verbose,    Enable verbose logging.";
+           "  --split-parallelism, With block-limit, also split the image so that the estimated\n"
+           "                    cost to apply it is balanced across this many pieces; and\n"
+           "                    append the cost of each piece to the split info.\n"
+           "  -j, --jobs,       Number of threads to inflate the gzip members and to generate the\n"
+           "                    patches with. The output doesn't depend on it. Default is 1.\n"
+           "  --bsdiff-format,  Format of the bsdiff patches of the chunks: bsdiff40 (bzip2, the\n"
+           "                    default) or bsdf2 (brotli, faster to apply).\n"
+           "  --profile,        Write the time and memory spent in each phase, and the statistics\n"
+           "                    of each chunk, to the given file as JSON.\n"
+           "  -v, --verbose,    Enable verbose logging, including the peak memory usage.";
     return 2;
   }
 
+  std::unique_ptr<ImgdiffProfiler> profiler;
+  if (!profile_file.empty()) {
+    profiler = std::make_unique<ImgdiffProfiler>();
+    profiler->SetRunInfo(zip_mode ? "zip" : "image", options.jobs);
+    options.profiler = profiler.get();
+  }
+
   if (zip_mode) {
     ZipModeImage src_image(true, blocks_limit * BLOCK_SIZE);
     ZipModeImage tgt_image(false, blocks_limit * BLOCK_SIZE);
 
-    if (!src_image.Initialize(argv[optind])) {
-      return 1;
+    {
+      ImgdiffProfiler::ScopedPhase phase(options.profiler, "load_source");
+      if (!src_image.Initialize(argv[optind])) {
+        return 1;
+      }
     }
-    if (!tgt_image.Initialize(argv[optind + 1])) {
-      return 1;
+    {
+      ImgdiffProfiler::ScopedPhase phase(options.profiler, "load_target");
+      if (!tgt_image.Initialize(argv[optind + 1])) {
+        return 1;
+      }
     }
 
-    if (!ZipModeImage::CheckAndProcessChunks(&tgt_image, &src_image)) {
-      return 1;
+    {
+      ImgdiffProfiler::ScopedPhase phase(options.profiler, "reconstruct_deflate");
+      if (!ZipModeImage::CheckAndProcessChunks(&tgt_image, &src_image, options)) {
+        return 1;
+      }
     }
 
     // Compute bsdiff patches for each chunk's data (the uncompressed data, in the case of
@@ -1576,40 +2250,59 @@ int imgdiff(int argc, const char** argv) {
       std::vector<ZipModeImage> split_tgt_images;
       std::vector<ZipModeImage> split_src_images;
       std::vector<SortedRangeSet> split_src_ranges;
-      ZipModeImage::SplitZipModeImageWithLimit(tgt_image, src_image, &split_tgt_images,
-                                               &split_src_images, &split_src_ranges);
+      {
+        ImgdiffProfiler::ScopedPhase phase(options.profiler, "split_planning");
+        ZipModeImage::SplitZipModeImageWithLimit(tgt_image, src_image, &split_tgt_images,
+                                                 &split_src_images, &split_src_ranges,
+                                                 options.split_parallelism);
+      }
 
       if (!ZipModeImage::GeneratePatches(split_tgt_images, split_src_images, split_src_ranges,
-                                         argv[optind + 2], split_info_file, debug_dir)) {
+                                         argv[optind + 2], split_info_file, debug_dir, options)) {
         return 1;
       }
 
-    } else if (!ZipModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2])) {
+    } else if (!ZipModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2], options)) {
       return 1;
     }
   } else {
-    ImageModeImage src_image(true);
-    ImageModeImage tgt_image(false);
+    ImageModeImage src_image(true, options.jobs);
+    ImageModeImage tgt_image(false, options.jobs);
 
-    if (!src_image.Initialize(argv[optind])) {
-      return 1;
+    {
+      ImgdiffProfiler::ScopedPhase phase(options.profiler, "load_source");
+      if (!src_image.Initialize(argv[optind])) {
+        return 1;
+      }
     }
-    if (!tgt_image.Initialize(argv[optind + 1])) {
-      return 1;
+    {
+      ImgdiffProfiler::ScopedPhase phase(options.profiler, "load_target");
+      if (!tgt_image.Initialize(argv[optind + 1])) {
+        return 1;
+      }
     }
 
-    if (!ImageModeImage::CheckAndProcessChunks(&tgt_image, &src_image)) {
-      return 1;
+    {
+      ImgdiffProfiler::ScopedPhase phase(options.profiler, "reconstruct_deflate");
+      if (!ImageModeImage::CheckAndProcessChunks(&tgt_image, &src_image, options)) {
+        return 1;
+      }
     }
 
     if (!bonus_data.empty() && !src_image.SetBonusData(bonus_data)) {
       return 1;
     }
 
-    if (!ImageModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2])) {
+    if (!ImageModeImage::GeneratePatches(tgt_image, src_image, argv[optind + 2], options)) {
       return 1;
     }
   }
 
+  LOG(INFO) << "Peak memory usage: " << ImgdiffProfiler::PeakRssKb() << " KiB";
+
+  if (profiler && !profiler->WriteToFile(profile_file)) {
+    return 1;
+  }
+
   return 0;
 }
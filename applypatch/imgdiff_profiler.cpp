@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "applypatch/imgdiff_profiler.h"
+
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+
+#include "applypatch/imgdiff.h"
+#include "otautil/json_string.h"
+
+using android::base::StringPrintf;
+
+static double TimevalToMs(const struct timeval& tv) {
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static const char* ChunkTypeName(int type) {
+  switch (type) {
+    case CHUNK_NORMAL:
+      return "normal";
+    case CHUNK_DEFLATE:
+      return "deflate";
+    case CHUNK_RAW:
+      return "raw";
+    default:
+      return "unknown";
+  }
+}
+
+ImgdiffProfiler::ScopedPhase::ScopedPhase(ImgdiffProfiler* profiler, const std::string& name)
+    : profiler_(profiler), name_(name), start_wall_ms_(0), start_cpu_ms_(0) {
+  if (profiler_ != nullptr) {
+    start_wall_ms_ = WallTimeMs();
+    start_cpu_ms_ = ProcessCpuTimeMs();
+  }
+}
+
+ImgdiffProfiler::ScopedPhase::~ScopedPhase() {
+  if (profiler_ != nullptr) {
+    profiler_->AddPhaseTime(name_, WallTimeMs() - start_wall_ms_,
+                            ProcessCpuTimeMs() - start_cpu_ms_);
+  }
+}
+
+ImgdiffProfiler::ImgdiffProfiler()
+    : start_wall_ms_(WallTimeMs()), start_cpu_ms_(ProcessCpuTimeMs()) {}
+
+double ImgdiffProfiler::WallTimeMs() {
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration<double, std::milli>(now).count();
+}
+
+double ImgdiffProfiler::ProcessCpuTimeMs() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  return TimevalToMs(usage.ru_utime) + TimevalToMs(usage.ru_stime);
+}
+
+double ImgdiffProfiler::ThreadCpuTimeMs() {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+    return 0;
+  }
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+size_t ImgdiffProfiler::PeakRssKb() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+#if defined(__APPLE__)
+  return usage.ru_maxrss / 1024;  // In bytes on macOS.
+#else
+  return usage.ru_maxrss;
+#endif
+}
+
+void ImgdiffProfiler::SetRunInfo(const std::string& mode, size_t jobs) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  mode_ = mode;
+  jobs_ = jobs;
+}
+
+void ImgdiffProfiler::AddPhaseTime(const std::string& name, double wall_ms, double cpu_ms) {
+  size_t peak_rss_kb = PeakRssKb();
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = std::find_if(phases_.begin(), phases_.end(),
+                         [&name](const ImgdiffPhaseProfile& p) { return p.name == name; });
+  if (it == phases_.end()) {
+    phases_.emplace_back();
+    it = phases_.end() - 1;
+    it->name = name;
+  }
+  it->count++;
+  it->wall_ms += wall_ms;
+  it->cpu_ms += cpu_ms;
+  it->peak_rss_kb = std::max(it->peak_rss_kb, peak_rss_kb);
+}
+
+void ImgdiffProfiler::AddChunk(const ImgdiffChunkProfile& chunk) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  chunks_.push_back(chunk);
+}
+
+std::string ImgdiffProfiler::ToJson() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  std::string json = "{\n";
+  json += StringPrintf("  \"mode\": %s,\n  \"jobs\": %zu,\n", JsonString(mode_).c_str(), jobs_);
+  json += StringPrintf(
+      "  \"total\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"peak_rss_kb\": %zu},\n",
+      WallTimeMs() - start_wall_ms_, ProcessCpuTimeMs() - start_cpu_ms_, PeakRssKb());
+
+  json += "  \"phases\": [";
+  for (size_t i = 0; i < phases_.size(); i++) {
+    const auto& p = phases_[i];
+    json += StringPrintf(
+        "%s\n    {\"name\": %s, \"count\": %zu, \"wall_ms\": %.3f, \"cpu_ms\": %.3f, "
+        "\"peak_rss_kb\": %zu}",
+        i == 0 ? "" : ",", JsonString(p.name).c_str(), p.count, p.wall_ms, p.cpu_ms,
+        p.peak_rss_kb);
+  }
+  json += phases_.empty() ? "],\n" : "\n  ],\n";
+
+  std::vector<ImgdiffChunkProfile> chunks = chunks_;
+  std::sort(chunks.begin(), chunks.end(),
+            [](const ImgdiffChunkProfile& a, const ImgdiffChunkProfile& b) {
+              return std::tie(a.split, a.index) < std::tie(b.split, b.index);
+            });
+  json += "  \"chunks\": [";
+  for (size_t i = 0; i < chunks.size(); i++) {
+    const auto& c = chunks[i];
+    json += StringPrintf(
+        "%s\n    {\"split\": %d, \"index\": %zu, \"name\": %s, \"type\": \"%s\", "
+        "\"target_size\": %zu, \"target_data_size\": %zu, \"source_data_size\": %zu, "
+        "\"patch_size\": %zu, \"raw\": %s, \"suffix_array_ms\": %.3f, "
+        "\"suffix_array_cpu_ms\": %.3f, \"bsdiff_ms\": %.3f, \"bsdiff_cpu_ms\": %.3f, "
+        "\"cpu_ms\": %.3f}",
+        i == 0 ? "" : ",", c.split, c.index, JsonString(c.name).c_str(), ChunkTypeName(c.type),
+        c.target_size, c.target_data_size, c.source_data_size, c.patch_size,
+        c.raw ? "true" : "false", c.suffix_array_ms, c.suffix_array_cpu_ms, c.bsdiff_ms,
+        c.bsdiff_cpu_ms, c.cpu_ms);
+  }
+  json += chunks.empty() ? "]\n" : "\n  ]\n";
+  json += "}\n";
+  return json;
+}
+
+bool ImgdiffProfiler::WriteToFile(const std::string& path) const {
+  if (!android::base::WriteStringToFile(ToJson(), path)) {
+    PLOG(ERROR) << "Failed to write the profile to " << path;
+    return false;
+  }
+  return true;
+}
@@ -26,11 +26,18 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <vector>
 
 #include <android-base/logging.h>
+#include <android-base/macros.h>
 #include <android-base/memory.h>
 #include <applypatch/applypatch.h>
 #include <applypatch/imgdiff.h>
@@ -47,11 +54,128 @@ static inline int32_t Read4(const void *address) {
   return android::base::get_unaligned<int32_t>(address);
 }
 
+namespace {
+
+// Scratch state that is reused across the chunks applied by one thread, so that applying a patch
+// doesn't set up a new z_stream and allocate new buffers for every CHUNK_DEFLATE. Deflate streams
+// are keyed by their init parameters and recycled with deflateReset(); the raw inflate stream is
+// recycled with inflateReset().
+class ChunkScratch {
+ public:
+  ChunkScratch() = default;
+  ~ChunkScratch();
+
+  // Returns a deflate stream that's ready to compress with the given parameters, or nullptr if
+  // the stream fails to initialize.
+  z_stream* GetDeflateStream(int level, int method, int window_bits, int mem_level, int strategy);
+
+  // Returns a raw (window_bits = -15) inflate stream that's ready for use, or nullptr on error.
+  z_stream* GetInflateStream();
+
+  // Returns a buffer of at least 'len' bytes, which is only valid until the next call. It grows to
+  // the largest chunk seen and is reused by the chunks that follow; it's freed along with the
+  // scratch, i.e. once the patch (or the worker thread) is done.
+  unsigned char* GetExpandedBuffer(size_t len) {
+    if (expanded_buffer_.size() < len) {
+      expanded_buffer_.resize(len);
+    }
+    return expanded_buffer_.data();
+  }
+
+  // The buffer that holds the recompressed output of a deflate stream.
+  static constexpr size_t kDeflateBufferSize = 32768;
+  unsigned char* deflate_buffer() {
+    return deflate_buffer_.data();
+  }
+
+ private:
+  using DeflateParams = std::tuple<int, int, int, int, int>;
+
+  std::map<DeflateParams, z_stream> deflate_streams_;
+  std::unique_ptr<z_stream> inflate_stream_;
+  std::vector<unsigned char> deflate_buffer_ = std::vector<unsigned char>(kDeflateBufferSize);
+  std::vector<unsigned char> expanded_buffer_;
+
+  DISALLOW_COPY_AND_ASSIGN(ChunkScratch);
+};
+
+ChunkScratch::~ChunkScratch() {
+  for (auto& entry : deflate_streams_) {
+    deflateEnd(&entry.second);
+  }
+  if (inflate_stream_) {
+    inflateEnd(inflate_stream_.get());
+  }
+}
+
+z_stream* ChunkScratch::GetDeflateStream(int level, int method, int window_bits, int mem_level,
+                                         int strategy) {
+  DeflateParams params(level, method, window_bits, mem_level, strategy);
+  auto it = deflate_streams_.find(params);
+  if (it != deflate_streams_.end()) {
+    int ret = deflateReset(&it->second);
+    if (ret != Z_OK) {
+      LOG(ERROR) << "Failed to reset deflate stream: " << ret;
+      deflateEnd(&it->second);
+      deflate_streams_.erase(it);
+      return nullptr;
+    }
+    return &it->second;
+  }
+
+  // zlib keeps a back pointer to the z_stream in its internal state, so the stream is initialized
+  // in place in the map (whose nodes never move) instead of being copied in.
+  z_stream* strm = &deflate_streams_[params];
+  strm->zalloc = Z_NULL;
+  strm->zfree = Z_NULL;
+  strm->opaque = Z_NULL;
+  strm->avail_in = 0;
+  strm->next_in = nullptr;
+  int ret = deflateInit2(strm, level, method, window_bits, mem_level, strategy);
+  if (ret != Z_OK) {
+    LOG(ERROR) << "Failed to init uncompressed data deflation: " << ret;
+    deflate_streams_.erase(params);
+    return nullptr;
+  }
+  return strm;
+}
+
+z_stream* ChunkScratch::GetInflateStream() {
+  if (inflate_stream_) {
+    int ret = inflateReset(inflate_stream_.get());
+    if (ret != Z_OK) {
+      LOG(ERROR) << "Failed to reset inflate stream: " << ret;
+      inflateEnd(inflate_stream_.get());
+      inflate_stream_.reset();
+      return nullptr;
+    }
+    return inflate_stream_.get();
+  }
+
+  std::unique_ptr<z_stream> strm = std::make_unique<z_stream>();
+  strm->zalloc = Z_NULL;
+  strm->zfree = Z_NULL;
+  strm->opaque = Z_NULL;
+  strm->avail_in = 0;
+  strm->next_in = nullptr;
+  int ret = inflateInit2(strm.get(), -15);
+  if (ret != Z_OK) {
+    printf("failed to init source inflation: %d\n", ret);
+    return nullptr;
+  }
+  inflate_stream_ = std::move(strm);
+  return inflate_stream_.get();
+}
+
+}  // namespace
+
 // This function is a wrapper of ApplyBSDiffPatch(). It has a custom sink function to deflate the
-// patched data and stream the deflated data to output.
+// patched data and stream the deflated data to output. The deflate stream and the output buffer
+// come from the given scratch.
 static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_len,
                                             const Value& patch, size_t patch_offset,
-                                            const char* deflate_header, SinkFn sink, SHA_CTX* ctx) {
+                                            const char* deflate_header, SinkFn sink, SHA_CTX* ctx,
+                                            ChunkScratch* scratch) {
   size_t expected_target_length = static_cast<size_t>(Read8(deflate_header + 32));
   int level = Read4(deflate_header + 40);
   int method = Read4(deflate_header + 44);
@@ -59,32 +183,27 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
   int mem_level = Read4(deflate_header + 52);
   int strategy = Read4(deflate_header + 56);
 
-  z_stream strm;
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-  strm.avail_in = 0;
-  strm.next_in = nullptr;
-  int ret = deflateInit2(&strm, level, method, window_bits, mem_level, strategy);
-  if (ret != Z_OK) {
-    LOG(ERROR) << "Failed to init uncompressed data deflation: " << ret;
+  z_stream* strm_ptr = scratch->GetDeflateStream(level, method, window_bits, mem_level, strategy);
+  if (strm_ptr == nullptr) {
     return false;
   }
+  z_stream& strm = *strm_ptr;
+  int ret = Z_OK;
 
   // Define a custom sink wrapper that feeds to bspatch. It deflates the available patch data on
   // the fly and outputs the compressed data to the given sink.
   size_t actual_target_length = 0;
   size_t total_written = 0;
-  static constexpr size_t buffer_size = 32768;
+  static constexpr size_t buffer_size = ChunkScratch::kDeflateBufferSize;
+  uint8_t* buffer = scratch->deflate_buffer();
   auto compression_sink = [&strm, &actual_target_length, &expected_target_length, &total_written,
-                           &ret, &ctx, &sink](const uint8_t* data, size_t len) -> size_t {
+                           &ret, &ctx, &sink, buffer](const uint8_t* data, size_t len) -> size_t {
     // The input patch length for an update never exceeds INT_MAX.
     strm.avail_in = len;
     strm.next_in = data;
     do {
-      std::vector<uint8_t> buffer(buffer_size);
       strm.avail_out = buffer_size;
-      strm.next_out = buffer.data();
+      strm.next_out = buffer;
       if (actual_target_length + len < expected_target_length) {
         ret = deflate(&strm, Z_NO_FLUSH);
       } else {
@@ -98,11 +217,11 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
 
       size_t have = buffer_size - strm.avail_out;
       total_written += have;
-      if (sink(buffer.data(), have) != have) {
+      if (sink(buffer, have) != have) {
         LOG(ERROR) << "Failed to write " << have << " compressed bytes to output.";
         return 0;
       }
-      if (ctx) SHA1_Update(ctx, buffer.data(), have);
+      if (ctx) SHA1_Update(ctx, buffer, have);
     } while ((strm.avail_in != 0 || strm.avail_out == 0) && ret != Z_STREAM_END);
 
     actual_target_length += len;
@@ -111,7 +230,6 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
 
   int bspatch_result =
       ApplyBSDiffPatch(src_data, src_len, patch, patch_offset, compression_sink, nullptr);
-  deflateEnd(&strm);
 
   if (bspatch_result != 0) {
     return false;
@@ -132,160 +250,344 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
   return true;
 }
 
-int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const unsigned char* patch_data,
-                    size_t patch_size, SinkFn sink) {
-  Value patch(VAL_BLOB, std::string(reinterpret_cast<const char*>(patch_data), patch_size));
-  return ApplyImagePatch(old_data, old_size, patch, sink, nullptr, nullptr);
-}
+namespace {
 
-int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
-                    SHA_CTX* ctx, const Value* bonus_data) {
-  if (patch.data.size() < 12) {
-    printf("patch too short to contain header\n");
-    return -1;
-  }
+// A chunk record parsed from the imgdiff patch. 'header' points to the type-specific part of the
+// chunk header in the patch data, i.e. right after the 4-byte chunk type.
+struct PatchChunk {
+  int index;
+  int type;
+  const char* header;
+};
 
-  // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW. (IMGDIFF1, which is no longer
-  // supported, used CHUNK_NORMAL and CHUNK_GZIP.)
+}  // namespace
+
+// Parses the chunk record at '*pos' of the given patch, and advances '*pos' past the record (and
+// the raw data for CHUNK_RAW). Returns false if the record is truncated or has an unknown type.
+static bool ReadPatchChunk(const Value& patch, int index, size_t* pos, PatchChunk* chunk) {
   const char* const patch_header = patch.data.data();
-  if (memcmp(patch_header, "IMGDIFF2", 8) != 0) {
-    printf("corrupt patch file header (magic number)\n");
-    return -1;
+
+  // each chunk's header record starts with 4 bytes.
+  if (*pos + 4 > patch.data.size()) {
+    printf("failed to read chunk %d record\n", index);
+    return false;
   }
+  chunk->index = index;
+  chunk->type = Read4(patch_header + *pos);
+  *pos += 4;
+  chunk->header = patch_header + *pos;
+
+  if (chunk->type == CHUNK_NORMAL) {
+    *pos += 24;
+    if (*pos > patch.data.size()) {
+      printf("failed to read chunk %d normal header data\n", index);
+      return false;
+    }
+  } else if (chunk->type == CHUNK_RAW) {
+    *pos += 4;
+    if (*pos > patch.data.size()) {
+      printf("failed to read chunk %d raw header data\n", index);
+      return false;
+    }
 
-  int num_chunks = Read4(patch_header + 8);
-  size_t pos = 12;
-  for (int i = 0; i < num_chunks; ++i) {
-    // each chunk's header record starts with 4 bytes.
-    if (pos + 4 > patch.data.size()) {
-      printf("failed to read chunk %d record\n", i);
+    size_t data_len = static_cast<size_t>(Read4(chunk->header));
+    if (*pos + data_len > patch.data.size()) {
+      printf("failed to read chunk %d raw data\n", index);
+      return false;
+    }
+    *pos += data_len;
+  } else if (chunk->type == CHUNK_DEFLATE) {
+    // deflate chunks have an additional 60 bytes in their chunk header.
+    *pos += 60;
+    if (*pos > patch.data.size()) {
+      printf("failed to read chunk %d deflate header data\n", index);
+      return false;
+    }
+  } else {
+    printf("patch chunk %d is unknown type %d\n", index, chunk->type);
+    return false;
+  }
+  return true;
+}
+
+// Applies a single chunk that has been parsed by ReadPatchChunk(). Writes the patched output of
+// the chunk through the given 'sink', and updates the SHA-1 context if non-null. The zlib streams
+// and buffers for CHUNK_DEFLATE are taken from 'scratch', which must not be shared between
+// threads; a temporary one is used if 'scratch' is null. Returns 0 on success.
+static int ApplyPatchChunk(const PatchChunk& chunk, const unsigned char* old_data, size_t old_size,
+                           const Value& patch, SinkFn sink, SHA_CTX* ctx, const Value* bonus_data,
+                           ChunkScratch* scratch = nullptr) {
+  int i = chunk.index;
+  if (chunk.type == CHUNK_NORMAL) {
+    const char* normal_header = chunk.header;
+    size_t src_start = static_cast<size_t>(Read8(normal_header));
+    size_t src_len = static_cast<size_t>(Read8(normal_header + 8));
+    size_t patch_offset = static_cast<size_t>(Read8(normal_header + 16));
+
+    if (src_start + src_len > old_size) {
+      printf("source data too short\n");
       return -1;
     }
-    int type = Read4(patch_header + pos);
-    pos += 4;
-
-    if (type == CHUNK_NORMAL) {
-      const char* normal_header = patch_header + pos;
-      pos += 24;
-      if (pos > patch.data.size()) {
-        printf("failed to read chunk %d normal header data\n", i);
-        return -1;
-      }
+    if (ApplyBSDiffPatch(old_data + src_start, src_len, patch, patch_offset, sink, ctx) != 0) {
+      printf("Failed to apply bsdiff patch.\n");
+      return -1;
+    }
+  } else if (chunk.type == CHUNK_RAW) {
+    const char* raw_header = chunk.header;
+    size_t data_len = static_cast<size_t>(Read4(raw_header));
+    const char* raw_data = raw_header + 4;
 
-      size_t src_start = static_cast<size_t>(Read8(normal_header));
-      size_t src_len = static_cast<size_t>(Read8(normal_header + 8));
-      size_t patch_offset = static_cast<size_t>(Read8(normal_header + 16));
+    if (ctx) {
+      SHA1_Update(ctx, raw_data, data_len);
+    }
+    if (sink(reinterpret_cast<const unsigned char*>(raw_data), data_len) != data_len) {
+      printf("failed to write chunk %d raw data\n", i);
+      return -1;
+    }
+  } else if (chunk.type == CHUNK_DEFLATE) {
+    const char* deflate_header = chunk.header;
+    size_t src_start = static_cast<size_t>(Read8(deflate_header));
+    size_t src_len = static_cast<size_t>(Read8(deflate_header + 8));
+    size_t patch_offset = static_cast<size_t>(Read8(deflate_header + 16));
+    size_t expanded_len = static_cast<size_t>(Read8(deflate_header + 24));
+
+    if (src_start + src_len > old_size) {
+      printf("source data too short\n");
+      return -1;
+    }
 
-      if (src_start + src_len > old_size) {
-        printf("source data too short\n");
-        return -1;
-      }
-      if (ApplyBSDiffPatch(old_data + src_start, src_len, patch, patch_offset, sink, ctx) != 0) {
-        printf("Failed to apply bsdiff patch.\n");
-        return -1;
-      }
-    } else if (type == CHUNK_RAW) {
-      const char* raw_header = patch_header + pos;
-      pos += 4;
-      if (pos > patch.data.size()) {
-        printf("failed to read chunk %d raw header data\n", i);
-        return -1;
-      }
+    // Decompress the source data; the chunk header tells us exactly
+    // how big we expect it to be when decompressed.
+
+    // Note: expanded_len will include the bonus data size if
+    // the patch was constructed with bonus data.  The
+    // deflation will come up 'bonus_size' bytes short; these
+    // must be appended from the bonus_data value.
+    size_t bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->data.size() : 0;
 
-      size_t data_len = static_cast<size_t>(Read4(raw_header));
+    std::unique_ptr<ChunkScratch> temp_scratch;
+    if (scratch == nullptr) {
+      temp_scratch = std::make_unique<ChunkScratch>();
+      scratch = temp_scratch.get();
+    }
+    unsigned char* expanded_source = scratch->GetExpandedBuffer(expanded_len);
 
-      if (pos + data_len > patch.data.size()) {
-        printf("failed to read chunk %d raw data\n", i);
+    // inflate() doesn't like strm.next_out being a nullptr even with
+    // avail_out being zero (Z_STREAM_ERROR).
+    if (expanded_len != 0) {
+      z_stream* strm = scratch->GetInflateStream();
+      if (strm == nullptr) {
         return -1;
       }
-      if (ctx) {
-        SHA1_Update(ctx, patch_header + pos, data_len);
-      }
-      if (sink(reinterpret_cast<const unsigned char*>(patch_header + pos), data_len) != data_len) {
-        printf("failed to write chunk %d raw data\n", i);
+      strm->avail_in = src_len;
+      strm->next_in = old_data + src_start;
+      strm->avail_out = expanded_len;
+      strm->next_out = expanded_source;
+
+      // Because we've provided enough room to accommodate the output
+      // data, we expect one call to inflate() to suffice.
+      int ret = inflate(strm, Z_SYNC_FLUSH);
+      if (ret != Z_STREAM_END) {
+        printf("source inflation returned %d\n", ret);
         return -1;
       }
-      pos += data_len;
-    } else if (type == CHUNK_DEFLATE) {
-      // deflate chunks have an additional 60 bytes in their chunk header.
-      const char* deflate_header = patch_header + pos;
-      pos += 60;
-      if (pos > patch.data.size()) {
-        printf("failed to read chunk %d deflate header data\n", i);
+      // We should have filled the output buffer exactly, except
+      // for the bonus_size.
+      if (strm->avail_out != bonus_size) {
+        printf("source inflation short by %zu bytes\n", strm->avail_out - bonus_size);
         return -1;
       }
 
-      size_t src_start = static_cast<size_t>(Read8(deflate_header));
-      size_t src_len = static_cast<size_t>(Read8(deflate_header + 8));
-      size_t patch_offset = static_cast<size_t>(Read8(deflate_header + 16));
-      size_t expanded_len = static_cast<size_t>(Read8(deflate_header + 24));
-
-      if (src_start + src_len > old_size) {
-        printf("source data too short\n");
-        return -1;
+      if (bonus_size) {
+        memcpy(expanded_source + (expanded_len - bonus_size), &bonus_data->data[0], bonus_size);
       }
+    }
 
-      // Decompress the source data; the chunk header tells us exactly
-      // how big we expect it to be when decompressed.
-
-      // Note: expanded_len will include the bonus data size if
-      // the patch was constructed with bonus data.  The
-      // deflation will come up 'bonus_size' bytes short; these
-      // must be appended from the bonus_data value.
-      size_t bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->data.size() : 0;
-
-      std::vector<unsigned char> expanded_source(expanded_len);
-
-      // inflate() doesn't like strm.next_out being a nullptr even with
-      // avail_out being zero (Z_STREAM_ERROR).
-      if (expanded_len != 0) {
-        z_stream strm;
-        strm.zalloc = Z_NULL;
-        strm.zfree = Z_NULL;
-        strm.opaque = Z_NULL;
-        strm.avail_in = src_len;
-        strm.next_in = old_data + src_start;
-        strm.avail_out = expanded_len;
-        strm.next_out = expanded_source.data();
-
-        int ret = inflateInit2(&strm, -15);
-        if (ret != Z_OK) {
-          printf("failed to init source inflation: %d\n", ret);
-          return -1;
-        }
+    if (!ApplyBSDiffPatchAndStreamOutput(expanded_source, expanded_len, patch, patch_offset,
+                                         deflate_header, sink, ctx, scratch)) {
+      LOG(ERROR) << "Fail to apply streaming bspatch.";
+      return -1;
+    }
+  } else {
+    printf("patch chunk %d is unknown type %d\n", i, chunk.type);
+    return -1;
+  }
+
+  return 0;
+}
 
-        // Because we've provided enough room to accommodate the output
-        // data, we expect one call to inflate() to suffice.
-        ret = inflate(&strm, Z_SYNC_FLUSH);
-        if (ret != Z_STREAM_END) {
-          printf("source inflation returned %d\n", ret);
-          return -1;
+// Applies the CHUNK_NORMAL and CHUNK_DEFLATE chunks on 'num_threads' worker threads, while the
+// calling thread writes the chunk outputs to 'sink' in chunk order. Workers claim chunks in
+// order, but never more than 2 * num_threads chunks ahead of the one being written, which bounds
+// the number of chunk outputs buffered in memory. CHUNK_RAW chunks are written directly from the
+// patch data.
+static int ApplyPatchChunksParallel(const std::vector<PatchChunk>& chunks,
+                                    const unsigned char* old_data, size_t old_size,
+                                    const Value& patch, SinkFn sink, SHA_CTX* ctx,
+                                    const Value* bonus_data, size_t num_threads) {
+  std::vector<size_t> jobs;
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    if (chunks[i].type != CHUNK_RAW) {
+      jobs.push_back(i);
+    }
+  }
+  num_threads = std::min(num_threads, jobs.size());
+  const size_t window = num_threads * 2;
+
+  struct ChunkOutput {
+    bool done = false;
+    std::string data;
+  };
+  std::vector<ChunkOutput> outputs(chunks.size());
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  size_t next_job = 0;  // Index into 'jobs' of the next chunk to be claimed by a worker.
+  size_t written = 0;   // Number of chunks that have been written to the sink.
+  bool failed = false;
+
+  auto worker = [&]() {
+    ChunkScratch scratch;
+    while (true) {
+      size_t i;
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&] {
+          return failed || next_job == jobs.size() || jobs[next_job] < written + window;
+        });
+        if (failed || next_job == jobs.size()) {
+          return;
         }
-        // We should have filled the output buffer exactly, except
-        // for the bonus_size.
-        if (strm.avail_out != bonus_size) {
-          printf("source inflation short by %zu bytes\n", strm.avail_out - bonus_size);
-          return -1;
+        i = jobs[next_job++];
+      }
+
+      std::string output;
+      SinkFn buffer_sink = [&output](const unsigned char* data, size_t len) {
+        output.append(reinterpret_cast<const char*>(data), len);
+        return len;
+      };
+      int result =
+          ApplyPatchChunk(chunks[i], old_data, old_size, patch, buffer_sink, nullptr, bonus_data,
+                          &scratch);
+
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (result != 0) {
+          failed = true;
+        } else {
+          outputs[i].data = std::move(output);
+          outputs[i].done = true;
         }
-        inflateEnd(&strm);
+      }
+      cv.notify_all();
+    }
+  };
 
-        if (bonus_size) {
-          memcpy(expanded_source.data() + (expanded_len - bonus_size), &bonus_data->data[0],
-                 bonus_size);
+  std::vector<std::thread> workers;
+  for (size_t n = 0; n < num_threads; ++n) {
+    workers.emplace_back(worker);
+  }
+
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    bool success = true;
+    if (chunks[i].type == CHUNK_RAW) {
+      success = ApplyPatchChunk(chunks[i], old_data, old_size, patch, sink, ctx, bonus_data) == 0;
+    } else {
+      std::string output;
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&] { return failed || outputs[i].done; });
+        if (failed) {
+          break;
         }
+        output = std::move(outputs[i].data);
+      }
+      const unsigned char* data = reinterpret_cast<const unsigned char*>(output.data());
+      if (sink(data, output.size()) != output.size()) {
+        printf("failed to write chunk %zu output\n", i);
+        success = false;
+      } else if (ctx) {
+        SHA1_Update(ctx, data, output.size());
       }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (!success) {
+        failed = true;
+      } else {
+        written = i + 1;
+      }
+    }
+    cv.notify_all();
+    if (!success) {
+      break;
+    }
+  }
+
+  for (auto& t : workers) {
+    t.join();
+  }
 
-      if (!ApplyBSDiffPatchAndStreamOutput(expanded_source.data(), expanded_len, patch,
-                                           patch_offset, deflate_header, sink, ctx)) {
-        LOG(ERROR) << "Fail to apply streaming bspatch.";
+  return failed ? -1 : 0;
+}
+
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const unsigned char* patch_data,
+                    size_t patch_size, SinkFn sink) {
+  return ApplyImagePatch(old_data, old_size, patch_data, patch_size, sink, 1);
+}
+
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const unsigned char* patch_data,
+                    size_t patch_size, SinkFn sink, size_t num_threads) {
+  Value patch(VAL_BLOB, std::string(reinterpret_cast<const char*>(patch_data), patch_size));
+  return ApplyImagePatch(old_data, old_size, patch, sink, nullptr, nullptr, num_threads);
+}
+
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
+                    SHA_CTX* ctx, const Value* bonus_data) {
+  return ApplyImagePatch(old_data, old_size, patch, sink, ctx, bonus_data, 1);
+}
+
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
+                    SHA_CTX* ctx, const Value* bonus_data, size_t num_threads) {
+  if (patch.data.size() < 12) {
+    printf("patch too short to contain header\n");
+    return -1;
+  }
+
+  // IMGDIFF2 uses CHUNK_NORMAL, CHUNK_DEFLATE, and CHUNK_RAW. (IMGDIFF1, which is no longer
+  // supported, used CHUNK_NORMAL and CHUNK_GZIP.)
+  const char* const patch_header = patch.data.data();
+  if (memcmp(patch_header, "IMGDIFF2", 8) != 0) {
+    printf("corrupt patch file header (magic number)\n");
+    return -1;
+  }
+
+  int num_chunks = Read4(patch_header + 8);
+  size_t pos = 12;
+
+  if (num_threads <= 1) {
+    // Apply each chunk as soon as its record is read, streaming the output to the sink.
+    ChunkScratch scratch;
+    for (int i = 0; i < num_chunks; ++i) {
+      PatchChunk chunk;
+      if (!ReadPatchChunk(patch, i, &pos, &chunk) ||
+          ApplyPatchChunk(chunk, old_data, old_size, patch, sink, ctx, bonus_data, &scratch) != 0) {
         return -1;
       }
+    }
+    return 0;
+  }
 
-    } else {
-      printf("patch chunk %d is unknown type %d\n", i, type);
+  std::vector<PatchChunk> chunks;
+  for (int i = 0; i < num_chunks; ++i) {
+    PatchChunk chunk;
+    if (!ReadPatchChunk(patch, i, &pos, &chunk)) {
       return -1;
     }
+    chunks.push_back(chunk);
   }
 
-  return 0;
+  return ApplyPatchChunksParallel(chunks, old_data, old_size, patch, sink, ctx, bonus_data,
+                                  num_threads);
 }
@@ -56,8 +56,13 @@ int applypatch_flash(const char* source_filename, const char* target_filename,
                      const char* target_sha1_str, size_t target_size);
 
 int LoadFileContents(const char* filename, FileContents* file);
+int LoadFileSha1(const char* filename, uint8_t sha1[SHA_DIGEST_LENGTH]);
 int SaveFileContents(const char* filename, const FileContents* file);
 
+// Writes 'len' bytes of 'data' to 'target' ("EMMC:<partition>[:...]"), then reads them back to
+// verify, retrying the write once on a mismatch. Returns 0 on success.
+int WriteToPartition(const unsigned char* data, size_t len, const std::string& target);
+
 // bspatch.cpp
 
 void ShowBSDiffLicense();
@@ -76,8 +81,45 @@ int ApplyBSDiffPatch(const unsigned char* old_data, size_t old_size, const Value
 int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
                     SHA_CTX* ctx, const Value* bonus_data);
 
+// Same as above, but applies the CHUNK_NORMAL and CHUNK_DEFLATE chunks concurrently on up to
+// 'num_threads' worker threads. Each chunk's output is buffered and written to 'sink' (and 'ctx')
+// in chunk order, so the result is byte-identical to the single-threaded version. At most
+// 2 * num_threads chunk outputs are buffered at any time. A 'num_threads' of 0 or 1 applies the
+// chunks serially without buffering.
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const Value& patch, SinkFn sink,
+                    SHA_CTX* ctx, const Value* bonus_data, size_t num_threads);
+
 // freecache.cpp
 
+// The order in which expendable files are deleted to free up space.
+enum class CachePolicy {
+  // Delete a small set of files whose sizes add up to just enough space.
+  kMinimalSet,
+  // Delete the files with the oldest mtime first.
+  kOldestFirst,
+  // Delete the largest files first.
+  kLargestFirst,
+};
+
+// Deletes unopened regular files directly under 'dirs' until 'free_space' reports at least
+// 'bytes_needed' bytes free. The candidate files are collected once, and the files chosen by
+// 'policy' are deleted in one batch. Returns 0 on success.
+int MakeFreeSpace(size_t bytes_needed, const std::vector<std::string>& dirs,
+                  const std::function<size_t()>& free_space, CachePolicy policy);
+
 int MakeFreeSpaceOnCache(size_t bytes_needed);
 
+// A free space backend that doesn't query the file system. It reports 'capacity' minus the
+// allocated size of the regular files directly under 'dirs'. Used to exercise MakeFreeSpace() on
+// host, where there is no /cache partition.
+class SimulatedFreeSpace {
+ public:
+  SimulatedFreeSpace(size_t capacity, const std::vector<std::string>& dirs);
+  size_t operator()() const;
+
+ private:
+  size_t capacity_;
+  std::vector<std::string> dirs_;
+};
+
 #endif
@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <sys/types.h>
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -29,8 +30,18 @@
 #include <zlib.h>
 
 #include "imgdiff.h"
+#include "imgdiff_profiler.h"
 #include "otautil/rangeset.h"
 
+// The format of the bsdiff patches of the chunks. libbspatch detects the format from the header,
+// so imgpatch applies either.
+enum class BsdiffFormat {
+  // "BSDIFF40", with the streams compressed by bzip2.
+  kBsdiff40,
+  // "BSDF2", with the streams compressed by brotli; much faster to decompress.
+  kBsdf2,
+};
+
 class ImageChunk {
  public:
   static constexpr auto WINDOWBITS = -15;  // 32kb window; negative to indicate a raw stream.
@@ -40,6 +51,10 @@ class ImageChunk {
 
   ImageChunk(int type, size_t start, const std::vector<uint8_t>* file_content, size_t raw_data_len,
              std::string entry_name = {});
+  // |file_data| and |file_size| describe the full content of the input file, which must outlive
+  // the chunk.
+  ImageChunk(int type, size_t start, const uint8_t* file_data, size_t file_size,
+             size_t raw_data_len, std::string entry_name = {});
 
   int GetType() const {
     return type_;
@@ -56,9 +71,12 @@ class ImageChunk {
   int GetCompressLevel() const {
     return compress_level_;
   }
+  int GetCompressStrategy() const {
+    return compress_strategy_;
+  }
 
   // CHUNK_DEFLATE will return the uncompressed data for diff, while other types will simply return
-  // the raw data.
+  // the raw data. For a CHUNK_DEFLATE chunk, the uncompressed data must have been loaded.
   const uint8_t* DataForPatch() const;
   size_t DataLengthForPatch() const;
 
@@ -67,6 +85,16 @@ class ImageChunk {
   void SetUncompressedData(std::vector<uint8_t> data);
   bool SetBonusData(const std::vector<uint8_t>& bonus_data);
 
+  // Only record the length and the CRC-32 of the uncompressed data of a CHUNK_DEFLATE chunk, and
+  // inflate it from the raw data when it's needed. This keeps at most a few entries uncompressed
+  // in memory.
+  void DeferUncompressedData(size_t uncompressed_len, uint32_t crc);
+  // Inflate the raw data of a deferred CHUNK_DEFLATE chunk, and check it against the recorded
+  // CRC-32. No-op if the data is present.
+  bool LoadUncompressedData();
+  // Drop the uncompressed data of a deferred chunk; it can be loaded again later.
+  void ReleaseUncompressedData();
+
   bool operator==(const ImageChunk& other) const;
   bool operator!=(const ImageChunk& other) const {
     return !(*this == other);
@@ -82,8 +110,9 @@ class ImageChunk {
 
   /*
    * Verify that we can reproduce exactly the same compressed data that we started with.  Sets the
-   * level, method, windowBits, memLevel, and strategy fields in the chunk to the encoding
-   * parameters needed to produce the right output.
+   * level and strategy fields in the chunk to the encoding parameters needed to produce the right
+   * output. Levels 1-9 are searched with each of the zlib strategies; method, windowBits and
+   * memLevel are always the zlib defaults.
    */
   bool ReconstructDeflateChunk();
   bool IsAdjacentNormal(const ImageChunk& other) const;
@@ -92,26 +121,35 @@ class ImageChunk {
   /*
    * Compute a bsdiff patch between |src| and |tgt|; Store the result in the patch_data.
    * |bsdiff_cache| can be used to cache the suffix array if the same |src| chunk is used
-   * repeatedly, pass nullptr if not needed.
+   * repeatedly, pass nullptr if not needed. |format| selects the patch format. If |profile| is
+   * non-null, the time spent in building the suffix array and in the bsdiff search are recorded
+   * into it.
    */
   static bool MakePatch(const ImageChunk& tgt, const ImageChunk& src,
                         std::vector<uint8_t>* patch_data,
-                        bsdiff::SuffixArrayIndexInterface** bsdiff_cache);
+                        bsdiff::SuffixArrayIndexInterface** bsdiff_cache,
+                        BsdiffFormat format = BsdiffFormat::kBsdiff40,
+                        ImgdiffChunkProfile* profile = nullptr);
 
  private:
   const uint8_t* GetRawData() const;
-  bool TryReconstruction(int level);
+  bool TryReconstruction(int level, int strategy);
 
   int type_;                                    // CHUNK_NORMAL, CHUNK_DEFLATE, CHUNK_RAW
   size_t start_;                                // offset of chunk in the original input file
-  const std::vector<uint8_t>* input_file_ptr_;  // ptr to the full content of original input file
+  const uint8_t* input_file_data_;  // ptr to the full content of original input file
+  size_t input_file_size_;
   size_t raw_data_len_;
 
   // deflate encoder parameters
   int compress_level_;
+  int compress_strategy_;
 
   // --- for CHUNK_DEFLATE chunks only: ---
   std::vector<uint8_t> uncompressed_data_;
+  size_t uncompressed_len_;  // The length of the uncompressed data, even if it's not loaded.
+  uint32_t crc32_;           // The CRC-32 of the uncompressed data, if it's deferred.
+  bool deferred_;            // Whether the uncompressed data can be inflated from the raw data.
   std::string entry_name_;  // used for zip entries
 };
 
@@ -151,10 +189,27 @@ class PatchChunk {
   size_t target_len_;
   size_t target_uncompressed_len_;
   size_t target_compress_level_;  // the deflate compression level of the target chunk.
+  int target_compress_strategy_;  // the deflate strategy of the target chunk.
 
   std::vector<uint8_t> data_;  // storage for the patch data
 };
 
+// Settings for the patch generation.
+struct PatchGenerationOptions {
+  // Number of threads to reconstruct the deflate chunks and to diff the chunks (or the split
+  // images) with. The patch is the same regardless of the number of jobs.
+  size_t jobs = 1;
+  // The format of the chunk patches.
+  BsdiffFormat bsdiff_format = BsdiffFormat::kBsdiff40;
+  // If non-zero, the split images are balanced for this many concurrent appliers, and their
+  // estimated apply costs are added to the split info.
+  size_t split_parallelism = 0;
+  // If non-null, the time spent in each phase and the statistics of each chunk are recorded.
+  ImgdiffProfiler* profiler = nullptr;
+  // The index of the split image being diffed, for the profile; -1 if the image isn't split.
+  int split_index = -1;
+};
+
 // Interface for zip_mode and image_mode images. We initialize the image from an input file and
 // split the file content into a list of image chunks.
 class Image {
@@ -197,11 +252,23 @@ class Image {
   }
 
  protected:
-  bool ReadFile(const std::string& filename, std::vector<uint8_t>* file_content);
+  // Map the input file into memory, read-only.
+  bool MapFile(const std::string& filename);
 
-  bool is_source_;                     // True if it's for source chunks.
-  std::vector<ImageChunk> chunks_;     // Internal storage of ImageChunk.
-  std::vector<uint8_t> file_content_;  // Store the whole input file in memory.
+  // The content of the input file; either mapped from the file, or kept in |file_content_| for the
+  // images that are constructed in memory.
+  const uint8_t* FileData() const {
+    return file_map_ ? file_map_.get() : file_content_.data();
+  }
+  size_t FileSize() const {
+    return file_map_ ? file_map_size_ : file_content_.size();
+  }
+
+  bool is_source_;                            // True if it's for source chunks.
+  std::vector<ImageChunk> chunks_;            // Internal storage of ImageChunk.
+  std::vector<uint8_t> file_content_;         // Content of the images constructed in memory.
+  std::shared_ptr<const uint8_t> file_map_;   // Mapping of the input file.
+  size_t file_map_size_ = 0;
 };
 
 class ZipModeImage : public Image {
@@ -216,6 +283,8 @@ class ZipModeImage : public Image {
   void Initialize(const std::vector<ImageChunk>& chunks, const std::vector<uint8_t>& file_content) {
     chunks_ = chunks;
     file_content_ = file_content;
+    file_map_.reset();
+    file_map_size_ = 0;
   }
 
   // The pesudo source chunk for bsdiff if there's no match for the given target chunk. It's in
@@ -230,33 +299,44 @@ class ZipModeImage : public Image {
 
   // Verify that we can reconstruct the deflate chunks; also change the type to CHUNK_NORMAL if
   // src and tgt are identical.
-  static bool CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image);
+  static bool CheckAndProcessChunks(ZipModeImage* tgt_image, ZipModeImage* src_image,
+                                    const PatchGenerationOptions& options = {});
 
   // Compute the patch between tgt & src images, and write the data into |patch_name|.
   static bool GeneratePatches(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                              const std::string& patch_name);
+                              const std::string& patch_name,
+                              const PatchGenerationOptions& options = {});
 
   // Compute the patch based on the lists of split src and tgt images. Generate patches for each
   // pair of split pieces and write the data to |patch_name|. If |debug_dir| is specified, write
-  // each split src data and patch data into that directory.
+  // each split src data and patch data into that directory. The split pieces are diffed
+  // concurrently if |options| allows more than one job.
   static bool GeneratePatches(const std::vector<ZipModeImage>& split_tgt_images,
                               const std::vector<ZipModeImage>& split_src_images,
                               const std::vector<SortedRangeSet>& split_src_ranges,
                               const std::string& patch_name, const std::string& split_info_file,
-                              const std::string& debug_dir);
+                              const std::string& debug_dir,
+                              const PatchGenerationOptions& options = {});
 
-  // Split the tgt chunks and src chunks based on the size limit.
+  // Split the tgt chunks and src chunks based on the size limit. If |parallelism| is greater than
+  // 1, also split so that no piece exceeds 1/|parallelism| of the estimated apply cost, unless a
+  // single chunk does.
   static bool SplitZipModeImageWithLimit(const ZipModeImage& tgt_image,
                                          const ZipModeImage& src_image,
                                          std::vector<ZipModeImage>* split_tgt_images,
                                          std::vector<ZipModeImage>* split_src_images,
-                                         std::vector<SortedRangeSet>* split_src_ranges);
+                                         std::vector<SortedRangeSet>* split_src_ranges,
+                                         size_t parallelism = 0);
+
+  // Estimate the work of applying the patch of this (target) image on the device, from the chunk
+  // sizes and the deflate work.
+  size_t EstimateApplyCost() const;
 
  private:
   // Initialize image chunks based on the zip entries.
   bool InitializeChunks(const std::string& filename, ZipArchiveHandle handle);
   // Add the a zip entry to the list.
-  bool AddZipEntryToChunks(ZipArchiveHandle handle, const std::string& entry_name, ZipEntry* entry);
+  bool AddZipEntryToChunks(const std::string& entry_name, ZipEntry* entry);
   // Return the real size of the zip file. (omit the trailing zeros that used for alignment)
   bool GetZipFileSize(size_t* input_file_size);
 
@@ -277,7 +357,8 @@ class ZipModeImage : public Image {
 
   // Function that actually iterates the tgt_chunks and makes patches.
   static bool GeneratePatchesInternal(const ZipModeImage& tgt_image, const ZipModeImage& src_image,
-                                      std::vector<PatchChunk>* patch_chunks);
+                                      std::vector<PatchChunk>* patch_chunks,
+                                      const PatchGenerationOptions& options);
 
   // size limit in bytes of each chunk. Also, if the length of one zip_entry exceeds the limit,
   // we'll split that entry into several smaller chunks in advance.
@@ -286,7 +367,8 @@ class ZipModeImage : public Image {
 
 class ImageModeImage : public Image {
  public:
-  explicit ImageModeImage(bool is_source) : Image(is_source) {}
+  // |jobs| is the number of threads to inflate the gzip members with.
+  explicit ImageModeImage(bool is_source, size_t jobs = 1) : Image(is_source), jobs_(jobs) {}
 
   // Initialize the image chunks list by searching the magic numbers in an image file.
   bool Initialize(const std::string& filename) override;
@@ -295,12 +377,17 @@ class ImageModeImage : public Image {
 
   // In Image Mode, verify that the source and target images have the same chunk structure (ie, the
   // same sequence of deflate and normal chunks).
-  static bool CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeImage* src_image);
+  static bool CheckAndProcessChunks(ImageModeImage* tgt_image, ImageModeImage* src_image,
+                                    const PatchGenerationOptions& options = {});
 
   // In image mode, generate patches against the given source chunks and bonus_data; write the
   // result to |patch_name|.
   static bool GeneratePatches(const ImageModeImage& tgt_image, const ImageModeImage& src_image,
-                              const std::string& patch_name);
+                              const std::string& patch_name,
+                              const PatchGenerationOptions& options = {});
+
+ private:
+  size_t jobs_;
 };
 
 #endif  // _APPLYPATCH_IMGDIFF_IMAGE_H
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _APPLYPATCH_IMGDIFF_PROFILER_H
+#define _APPLYPATCH_IMGDIFF_PROFILER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+// The time and memory spent by imgdiff in one phase. A phase that runs on several threads (e.g.
+// "bsdiff") is recorded once per call, so its wall time is the sum over the threads and may be
+// larger than the elapsed time.
+struct ImgdiffPhaseProfile {
+  std::string name;
+  size_t count = 0;
+  double wall_ms = 0;
+  double cpu_ms = 0;
+  // The peak resident set size of the process, as of the end of the phase.
+  size_t peak_rss_kb = 0;
+};
+
+// The statistics of one target chunk.
+struct ImgdiffChunkProfile {
+  int split = -1;  // The index of the split image, or -1 if the image isn't split.
+  size_t index = 0;
+  std::string name;  // The zip entry name; empty in image mode.
+  int type = 0;
+  size_t target_size = 0;       // The raw length of the target chunk.
+  size_t target_data_size = 0;  // The length of the diffed target data (uncompressed if deflate).
+  size_t source_data_size = 0;
+  size_t patch_size = 0;  // The number of bytes the chunk takes in the patch file.
+  bool raw = false;       // Whether the target data is stored as is instead of being diffed.
+  double suffix_array_ms = 0;
+  double suffix_array_cpu_ms = 0;
+  double bsdiff_ms = 0;
+  double bsdiff_cpu_ms = 0;
+  double cpu_ms = 0;  // The total CPU time of the thread that diffed the chunk.
+};
+
+// Collects the phase and chunk statistics of an imgdiff run, and writes them out as JSON. All the
+// methods are thread-safe.
+class ImgdiffProfiler {
+ public:
+  // Attributes the wall and CPU time of the process between its construction and destruction to
+  // |name|. It's meant for the top-level phases that run on the main thread. |profiler| may be
+  // nullptr, in which case nothing is recorded.
+  class ScopedPhase {
+   public:
+    ScopedPhase(ImgdiffProfiler* profiler, const std::string& name);
+    ~ScopedPhase();
+
+   private:
+    ImgdiffProfiler* profiler_;
+    std::string name_;
+    double start_wall_ms_;
+    double start_cpu_ms_;
+  };
+
+  ImgdiffProfiler();
+
+  void SetRunInfo(const std::string& mode, size_t jobs);
+
+  // Add the given times to the totals of phase |name|.
+  void AddPhaseTime(const std::string& name, double wall_ms, double cpu_ms);
+  void AddChunk(const ImgdiffChunkProfile& chunk);
+
+  // Return the profile as a JSON object. The chunks are sorted by split and index.
+  std::string ToJson() const;
+  bool WriteToFile(const std::string& path) const;
+
+  // Clocks in milliseconds. The process CPU time includes all the threads.
+  static double WallTimeMs();
+  static double ProcessCpuTimeMs();
+  static double ThreadCpuTimeMs();
+  static size_t PeakRssKb();
+
+ private:
+  mutable std::mutex mutex_;
+  double start_wall_ms_;
+  double start_cpu_ms_;
+  std::string mode_;
+  size_t jobs_ = 1;
+  std::vector<ImgdiffPhaseProfile> phases_;  // In the order of their first appearance.
+  std::vector<ImgdiffChunkProfile> chunks_;
+};
+
+#endif  // _APPLYPATCH_IMGDIFF_PROFILER_H
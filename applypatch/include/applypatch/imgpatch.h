@@ -26,4 +26,9 @@ using SinkFn = std::function<size_t(const unsigned char*, size_t)>;
 int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const unsigned char* patch_data,
                     size_t patch_size, SinkFn sink);
 
+// Same as above, but applies the chunks on up to 'num_threads' worker threads. The output is
+// written to 'sink' in chunk order, and is identical to the single-threaded version.
+int ApplyImagePatch(const unsigned char* old_data, size_t old_size, const unsigned char* patch_data,
+                    size_t patch_size, SinkFn sink, size_t num_threads);
+
 #endif  // _APPLYPATCH_IMGPATCH_H
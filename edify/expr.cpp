@@ -22,6 +22,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <chrono>
 #include <memory>
 #include <string>
 #include <unordered_map>
@@ -42,12 +43,26 @@ static bool BooleanString(const std::string& s) {
     return !s.empty();
 }
 
+static Value* CallFunction(State* state, const std::unique_ptr<Expr>& expr) {
+    if (!state->profile_functions) {
+        return expr->fn(expr->name.c_str(), state, expr->argv);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    Value* v = expr->fn(expr->name.c_str(), state, expr->argv);
+    std::chrono::duration<double, std::milli> duration = std::chrono::steady_clock::now() - start;
+    State::FunctionProfile& profile = state->function_profile[expr->name];
+    profile.calls++;
+    profile.total_ms += duration.count();
+    return v;
+}
+
 bool Evaluate(State* state, const std::unique_ptr<Expr>& expr, std::string* result) {
     if (result == nullptr) {
         return false;
     }
 
-    std::unique_ptr<Value> v(expr->fn(expr->name.c_str(), state, expr->argv));
+    std::unique_ptr<Value> v(CallFunction(state, expr));
     if (!v) {
         return false;
     }
@@ -61,7 +76,7 @@ bool Evaluate(State* state, const std::unique_ptr<Expr>& expr, std::string* resu
 }
 
 Value* EvaluateValue(State* state, const std::unique_ptr<Expr>& expr) {
-    return expr->fn(expr->name.c_str(), state, expr->argv);
+    return CallFunction(state, expr);
 }
 
 Value* StringValue(const char* str) {
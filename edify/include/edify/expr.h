@@ -19,6 +19,7 @@
 
 #include <unistd.h>
 
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
@@ -51,6 +52,15 @@ struct State {
   CauseCode cause_code;
 
   bool is_retry = false;
+
+  // The number of calls to, and the wall time spent in each function (including the nested calls),
+  // collected only if |profile_functions| is set.
+  struct FunctionProfile {
+    size_t calls = 0;
+    double total_ms = 0;
+  };
+  bool profile_functions = false;
+  std::map<std::string, FunctionProfile> function_profile;
 };
 
 enum ValueType {
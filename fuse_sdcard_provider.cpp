@@ -41,12 +41,7 @@ struct file_data {
 static int read_block_file(const file_data& fd, uint32_t block, uint8_t* buffer,
                            uint32_t fetch_size) {
   off64_t offset = static_cast<off64_t>(block) * fd.block_size;
-  if (TEMP_FAILURE_RETRY(lseek64(fd.fd, offset, SEEK_SET)) == -1) {
-    fprintf(stderr, "seek on sdcard failed: %s\n", strerror(errno));
-    return -EIO;
-  }
-
-  if (!android::base::ReadFully(fd.fd, buffer, fetch_size)) {
+  if (!android::base::ReadFullyAtOffset(fd.fd, buffer, fetch_size, offset)) {
     fprintf(stderr, "read on sdcard failed: %s\n", strerror(errno));
     return -EIO;
   }
@@ -73,6 +68,7 @@ bool start_sdcard_fuse(const char* path) {
   provider_vtab vtab;
   vtab.read_block = std::bind(&read_block_file, fd, std::placeholders::_1, std::placeholders::_2,
                               std::placeholders::_3);
+  vtab.concurrent_reads = true;
   vtab.close = [&fd]() { close(fd.fd); };
 
   // The installation process expects to find the sdcard unmounted. Unmount it with MNT_DETACH so
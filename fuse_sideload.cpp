@@ -47,6 +47,7 @@
 #include <fcntl.h>
 #include <limits.h>  // PATH_MAX
 #include <linux/fuse.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -57,8 +58,15 @@
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/stringprintf.h>
@@ -71,8 +79,26 @@ static constexpr uint64_t EXIT_FLAG_ID = FUSE_ROOT_ID + 2;
 static constexpr int NO_STATUS = 1;
 static constexpr int NO_STATUS_EXIT = 2;
 
+// The upper bound of the memory taken by the block cache.
+static constexpr size_t MAX_CACHE_BYTES = 16 * 1024 * 1024;
+
+// The kernel doesn't issue reads larger than 256 pages anyway (FUSE_MAX_MAX_PAGES).
+static constexpr uint32_t MAX_READ = 1024 * 1024;
+
+// How often the idle workers check whether another worker has seen the exit flag.
+static constexpr int WORKER_POLL_MS = 100;
+
 using SHA256Digest = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
 
+// The content of a block. A block that has been verified is never modified, so the readers keep a
+// reference to it while replying, even if it gets evicted from the cache in the meantime.
+using BlockData = std::shared_ptr<const std::vector<uint8_t>>;
+
+struct cached_block {
+  uint32_t block;
+  BlockData data;  // nullptr while the block is being fetched
+};
+
 struct fuse_data {
   android::base::unique_fd ffd;  // file descriptor for the fuse socket
 
@@ -83,16 +109,40 @@ struct fuse_data {
   uint32_t block_size;   // block size that the adb host is using to send the file to us
   uint32_t file_blocks;  // file size in block_size blocks
 
+  uint32_t max_read;  // the largest read the kernel may ask for, in bytes
+
   uid_t uid;
   gid_t gid;
 
-  uint32_t curr_block;  // cache the block most recently read from the host
-  uint8_t* block_data;
-
-  uint8_t* extra_block;  // another block of storage for reads that span two blocks
+  // The blocks most recently read from the host, most recently used first. The blocks past the end
+  // of the file all share zero_block.
+  std::list<cached_block> cache;
+  uint32_t cache_blocks;
+  BlockData zero_block;
 
   std::vector<SHA256Digest>
       hashes;  // SHA-256 hash of each block (all zeros if block hasn't been read yet)
+
+  // Guards cache, hashes and the read-ahead state below.
+  std::mutex cache_mutex;
+  // Signalled whenever a block has been fetched (or failed to).
+  std::condition_variable cache_cv;
+  // Serializes the calls to vtab.read_block(), unless vtab.concurrent_reads is set.
+  std::mutex provider_mutex;
+
+  // The read-ahead thread fetches [readahead_next, readahead_end) while the blocks are being read
+  // sequentially.
+  uint32_t readahead_blocks;
+  int64_t last_read_block;
+  uint32_t readahead_next;
+  uint32_t readahead_end;
+  bool readahead_exit;
+  std::condition_variable readahead_cv;
+
+  // Set by the first worker to stop, i.e. on the exit flag or once the connection is gone, along
+  // with the result of run_fuse_sideload().
+  std::atomic<bool> exiting;
+  int exit_result;
 };
 
 static void fuse_reply(const fuse_data* fd, uint64_t unique, const void* data, size_t len) {
@@ -125,7 +175,7 @@ static int handle_init(void* data, fuse_data* fd, const fuse_in_header* hdr) {
     return -1;
   }
 
-  fuse_init_out out;
+  fuse_init_out out = {};
   out.minor = MIN(req->minor, FUSE_KERNEL_MINOR_VERSION);
   size_t fuse_struct_size = sizeof(out);
 #if defined(FUSE_COMPAT_22_INIT_OUT_SIZE)
@@ -144,6 +194,17 @@ static int handle_init(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   out.max_background = 32;
   out.congestion_threshold = 32;
   out.max_write = 4096;
+  // Let the kernel have several reads in flight at once, for the workers to serve concurrently.
+  if (req->flags & FUSE_ASYNC_READ) {
+    out.flags |= FUSE_ASYNC_READ;
+  }
+#if defined(FUSE_MAX_PAGES)
+  // Without it, the kernel caps the reads to 32 pages regardless of max_read.
+  if (req->minor >= 28 && (req->flags & FUSE_MAX_PAGES)) {
+    out.flags |= FUSE_MAX_PAGES;
+    out.max_pages = fd->max_read / 4096;
+  }
+#endif
   fuse_reply(fd, hdr->unique, &out, fuse_struct_size);
 
   return NO_STATUS;
@@ -223,56 +284,148 @@ static int handle_release(void* /* data */, fuse_data* /* fd */, const fuse_in_h
   return 0;
 }
 
-// Fetch a block from the host into fd->curr_block and fd->block_data.
-// Returns 0 on successful fetch, negative otherwise.
-static int fetch_block(fuse_data* fd, uint32_t block) {
-  if (block == fd->curr_block) {
+static std::list<cached_block>::iterator find_cached_block(fuse_data* fd, uint32_t block) {
+  return std::find_if(fd->cache.begin(), fd->cache.end(),
+                      [block](const cached_block& b) { return b.block == block; });
+}
+
+// Drops the least recently used blocks until the cache is within its capacity. The blocks being
+// fetched are never dropped. Requires fd->cache_mutex.
+static void evict_blocks(fuse_data* fd) {
+  auto it = fd->cache.end();
+  while (fd->cache.size() > fd->cache_blocks && it != fd->cache.begin()) {
+    --it;
+    if (it->data != nullptr) {
+      it = fd->cache.erase(it);
+    }
+  }
+}
+
+// Verify the hash of a block we just got from the host. Requires fd->cache_mutex.
+//
+// - If the hash of the just-received data matches the stored hash for the block, accept it.
+// - If the stored hash is all zeroes, store the new hash and accept the block (this is the first
+//   time we've read this block).
+// - Otherwise, return -EIO for the read.
+static int verify_block(fuse_data* fd, uint32_t block, const SHA256Digest& hash) {
+  const SHA256Digest& blockhash = fd->hashes[block];
+  if (hash == blockhash) {
     return 0;
   }
 
+  for (uint8_t i : blockhash) {
+    if (i != 0) {
+      return -EIO;
+    }
+  }
+
+  fd->hashes[block] = hash;
+  return 0;
+}
+
+// Get a block, fetching it from the host unless it's in the cache. If another thread is already
+// fetching the block, wait for it instead. With |prefetch| set (i.e. on the read-ahead thread),
+// only bring the block into the cache if it's not there or on its way yet.
+// Returns 0 on successful fetch, negative otherwise.
+static int fetch_block(fuse_data* fd, uint32_t block, BlockData* out, bool prefetch) {
   if (block >= fd->file_blocks) {
-    memset(fd->block_data, 0, fd->block_size);
-    fd->curr_block = block;
+    *out = fd->zero_block;
     return 0;
   }
 
-  size_t fetch_size = fd->block_size;
-  if (block * fd->block_size + fetch_size > fd->file_size) {
-    // If we're reading the last (partial) block of the file, expect a shorter response from the
-    // host, and pad the rest of the block with zeroes.
-    fetch_size = fd->file_size - (block * fd->block_size);
-    memset(fd->block_data + fetch_size, 0, fd->block_size - fetch_size);
+  std::unique_lock<std::mutex> lock(fd->cache_mutex);
+  for (auto it = find_cached_block(fd, block); it != fd->cache.end();
+       it = find_cached_block(fd, block)) {
+    if (prefetch) {
+      return 0;
+    }
+    if (it->data != nullptr) {
+      fd->cache.splice(fd->cache.begin(), fd->cache, it);
+      *out = it->data;
+      return 0;
+    }
+    fd->cache_cv.wait(lock);
   }
 
-  int result = fd->vtab.read_block(block, fd->block_data, fetch_size);
-  if (result < 0) return result;
+  // Claim the block, so that other threads wait for this fetch instead of issuing their own.
+  fd->cache.push_front({ block, nullptr });
+  evict_blocks(fd);
+  lock.unlock();
 
-  fd->curr_block = block;
+  auto data = std::make_shared<std::vector<uint8_t>>(fd->block_size, 0);
+  size_t fetch_size = fd->block_size;
+  if (static_cast<uint64_t>(block) * fd->block_size + fetch_size > fd->file_size) {
+    // If we're reading the last (partial) block of the file, expect a shorter response from the
+    // host, and leave the rest of the block zero-padded.
+    fetch_size = fd->file_size - static_cast<uint64_t>(block) * fd->block_size;
+  }
 
-  // Verify the hash of the block we just got from the host.
-  //
-  // - If the hash of the just-received data matches the stored hash for the block, accept it.
-  // - If the stored hash is all zeroes, store the new hash and accept the block (this is the first
-  //   time we've read this block).
-  // - Otherwise, return -EINVAL for the read.
+  int result;
+  {
+    std::unique_lock<std::mutex> provider_lock(fd->provider_mutex, std::defer_lock);
+    if (!fd->vtab.concurrent_reads) {
+      provider_lock.lock();
+    }
+    result = fd->vtab.read_block(block, data->data(), fetch_size);
+  }
 
   SHA256Digest hash;
-  SHA256(fd->block_data, fd->block_size, hash.data());
+  if (result == 0) {
+    SHA256(data->data(), fd->block_size, hash.data());
+  }
 
-  const SHA256Digest& blockhash = fd->hashes[block];
-  if (hash == blockhash) {
-    return 0;
+  lock.lock();
+  auto it = find_cached_block(fd, block);
+  if (result == 0) {
+    result = verify_block(fd, block, hash);
   }
+  if (result < 0) {
+    fd->cache.erase(it);
+  } else {
+    it->data = data;
+    *out = it->data;
+  }
+  fd->cache_cv.notify_all();
+  return result;
+}
 
-  for (uint8_t i : blockhash) {
-    if (i != 0) {
-      fd->curr_block = -1;
-      return -EIO;
-    }
+// Track the blocks being read, and have the read-ahead thread fetch the next few ones while the
+// reads are sequential.
+static void schedule_readahead(fuse_data* fd, uint32_t block) {
+  if (fd->readahead_blocks == 0) return;
+
+  std::lock_guard<std::mutex> lock(fd->cache_mutex);
+  // Allow for the workers to get the reads of a sequential reader slightly out of order.
+  bool sequential = block + 1 >= fd->last_read_block && block <= fd->last_read_block + 1;
+  if (!sequential) {
+    fd->last_read_block = block;
+    fd->readahead_next = fd->readahead_end = 0;
+    return;
   }
+  fd->last_read_block = std::max<int64_t>(fd->last_read_block, block);
 
-  fd->hashes[block] = hash;
-  return 0;
+  fd->readahead_next = std::max(fd->readahead_next, block + 1);
+  fd->readahead_end = std::min(fd->file_blocks, block + 1 + fd->readahead_blocks);
+  if (fd->readahead_next < fd->readahead_end) {
+    fd->readahead_cv.notify_one();
+  }
+}
+
+static void readahead_loop(fuse_data* fd) {
+  std::unique_lock<std::mutex> lock(fd->cache_mutex);
+  for (;;) {
+    fd->readahead_cv.wait(lock, [fd] {
+      return fd->readahead_exit || fd->readahead_next < fd->readahead_end;
+    });
+    if (fd->readahead_exit) return;
+
+    uint32_t block = fd->readahead_next++;
+    lock.unlock();
+    // A failed fetch isn't cached, and the error will be reported if the block gets read.
+    BlockData data;
+    fetch_block(fd, block, &data, true);
+    lock.lock();
+  }
 }
 
 static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
@@ -290,131 +443,72 @@ static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   // past the end of the file so we're always returning exactly as many bytes as were requested.
   // (Users of the mapped file have to know its real length anyway.)
 
+  // The kernel doesn't send reads larger than the max_read we mounted with.
+  if (size > fd->max_read) return -EINVAL;
+
   fuse_out_header outhdr;
   outhdr.len = sizeof(outhdr) + size;
   outhdr.error = 0;
   outhdr.unique = hdr->unique;
 
-  struct iovec vec[3];
+  // Reply straight from the blocks covering the read, which keeps them alive until the reply has
+  // been written.
+  uint32_t first_block = offset / fd->block_size;
+  uint32_t last_block = (size == 0) ? first_block : (offset + size - 1) / fd->block_size;
+  std::vector<BlockData> blocks(last_block - first_block + 1);
+  std::vector<struct iovec> vec(blocks.size() + 1);
   vec[0].iov_base = &outhdr;
   vec[0].iov_len = sizeof(outhdr);
 
-  uint32_t block = offset / fd->block_size;
-  int result = fetch_block(fd, block);
-  if (result != 0) return result;
-
-  // Two cases:
-  //
-  //   - the read request is entirely within this block. In this case we can reply immediately.
-  //
-  //   - the read request goes over into the next block. Note that since we mount the filesystem
-  //     with max_read=block_size, a read can never span more than two blocks. In this case we copy
-  //     the block to extra_block and issue a fetch for the following block.
-
-  uint32_t block_offset = offset - (block * fd->block_size);
-
-  int vec_used;
-  if (size + block_offset <= fd->block_size) {
-    // First case: the read fits entirely in the first block.
-
-    vec[1].iov_base = fd->block_data + block_offset;
-    vec[1].iov_len = size;
-    vec_used = 2;
-  } else {
-    // Second case: the read spills over into the next block.
-
-    memcpy(fd->extra_block, fd->block_data + block_offset, fd->block_size - block_offset);
-    vec[1].iov_base = fd->extra_block;
-    vec[1].iov_len = fd->block_size - block_offset;
-
-    result = fetch_block(fd, block + 1);
+  uint32_t block_offset = offset - static_cast<uint64_t>(first_block) * fd->block_size;
+  uint32_t remaining = size;
+  for (size_t i = 0; i < blocks.size(); i++) {
+    uint32_t block = first_block + i;
+    int result = fetch_block(fd, block, &blocks[i], false);
     if (result != 0) return result;
-    vec[2].iov_base = fd->block_data;
-    vec[2].iov_len = size - vec[1].iov_len;
-    vec_used = 3;
+    schedule_readahead(fd, block);
+
+    vec[i + 1].iov_base = const_cast<uint8_t*>(blocks[i]->data()) + block_offset;
+    vec[i + 1].iov_len = std::min(remaining, fd->block_size - block_offset);
+    remaining -= vec[i + 1].iov_len;
+    block_offset = 0;
   }
 
-  if (writev(fd->ffd, vec, vec_used) == -1) {
+  if (writev(fd->ffd, vec.data(), vec.size()) == -1) {
     printf("*** READ REPLY FAILED: %s ***\n", strerror(errno));
   }
   return NO_STATUS;
 }
 
-int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t block_size,
-                      const char* mount_point) {
-  // If something's already mounted on our mountpoint, try to remove it. (Mostly in case of a
-  // previous abnormal exit.)
-  umount2(mount_point, MNT_FORCE);
-
-  // fs/fuse/inode.c in kernel code uses the greater of 4096 and the passed-in max_read.
-  if (block_size < 4096) {
-    fprintf(stderr, "block size (%u) is too small\n", block_size);
-    return -1;
-  }
-  if (block_size > (1 << 22)) {  // 4 MiB
-    fprintf(stderr, "block size (%u) is too large\n", block_size);
-    return -1;
-  }
-
-  fuse_data fd = {};
-  fd.vtab = vtab;
-  fd.file_size = file_size;
-  fd.block_size = block_size;
-  fd.file_blocks = (file_size == 0) ? 0 : (((file_size - 1) / block_size) + 1);
-
-  int result;
-  if (fd.file_blocks > (1 << 18)) {
-    fprintf(stderr, "file has too many blocks (%u)\n", fd.file_blocks);
-    result = -1;
-    goto done;
-  }
-
-  // All hashes will be zero-initialized.
-  fd.hashes.resize(fd.file_blocks);
-  fd.uid = getuid();
-  fd.gid = getgid();
-
-  fd.curr_block = -1;
-  fd.block_data = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.block_data == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for block_data\n", block_size);
-    result = -1;
-    goto done;
-  }
-  fd.extra_block = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.extra_block == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for extra_block\n", block_size);
-    result = -1;
-    goto done;
+// Marks the filesystem as exiting with |result|, unless another worker has already done so.
+static void finish_workers(fuse_data* fd, int result) {
+  bool expected = false;
+  if (fd->exiting.compare_exchange_strong(expected, true)) {
+    fd->exit_result = result;
   }
+}
 
-  fd.ffd.reset(open("/dev/fuse", O_RDWR));
-  if (!fd.ffd) {
-    perror("open /dev/fuse");
-    result = -1;
-    goto done;
-  }
-
-  {
-    std::string opts = android::base::StringPrintf(
-        "fd=%d,user_id=%d,group_id=%d,max_read=%u,allow_other,rootmode=040000", fd.ffd.get(),
-        fd.uid, fd.gid, block_size);
-
-    result = mount("/dev/fuse", mount_point, "fuse", MS_NOSUID | MS_NODEV | MS_RDONLY | MS_NOEXEC,
-                   opts.c_str());
-    if (result == -1) {
-      perror("mount");
-      goto done;
+// Serves the FUSE requests until the exit flag is looked up, or the connection goes away. Several
+// workers may run at once, each picking up the next request.
+static void fuse_worker(fuse_data* fd) {
+  uint8_t request_buffer[sizeof(fuse_in_header) + PATH_MAX * 8];
+  while (!fd->exiting) {
+    pollfd pfd = { fd->ffd.get(), POLLIN, 0 };
+    int ready = TEMP_FAILURE_RETRY(poll(&pfd, 1, WORKER_POLL_MS));
+    if (ready == -1) {
+      perror("poll request");
+      finish_workers(fd, -1);
+      break;
     }
-  }
+    if (ready == 0) continue;
 
-  uint8_t request_buffer[sizeof(fuse_in_header) + PATH_MAX * 8];
-  for (;;) {
-    ssize_t len = TEMP_FAILURE_RETRY(read(fd.ffd, request_buffer, sizeof(request_buffer)));
+    ssize_t len = TEMP_FAILURE_RETRY(read(fd->ffd, request_buffer, sizeof(request_buffer)));
     if (len == -1) {
+      // Another worker has picked up the request.
+      if (errno == EAGAIN) continue;
       perror("read request");
       if (errno == ENODEV) {
-        result = -1;
+        finish_workers(fd, -1);
         break;
       }
       continue;
@@ -428,35 +522,35 @@ int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t bl
     fuse_in_header* hdr = reinterpret_cast<fuse_in_header*>(request_buffer);
     void* data = request_buffer + sizeof(fuse_in_header);
 
-    result = -ENOSYS;
+    int result = -ENOSYS;
 
     switch (hdr->opcode) {
       case FUSE_INIT:
-        result = handle_init(data, &fd, hdr);
+        result = handle_init(data, fd, hdr);
         break;
 
       case FUSE_LOOKUP:
-        result = handle_lookup(data, &fd, hdr);
+        result = handle_lookup(data, fd, hdr);
         break;
 
       case FUSE_GETATTR:
-        result = handle_getattr(data, &fd, hdr);
+        result = handle_getattr(data, fd, hdr);
         break;
 
       case FUSE_OPEN:
-        result = handle_open(data, &fd, hdr);
+        result = handle_open(data, fd, hdr);
         break;
 
       case FUSE_READ:
-        result = handle_read(data, &fd, hdr);
+        result = handle_read(data, fd, hdr);
         break;
 
       case FUSE_FLUSH:
-        result = handle_flush(data, &fd, hdr);
+        result = handle_flush(data, fd, hdr);
         break;
 
       case FUSE_RELEASE:
-        result = handle_release(data, &fd, hdr);
+        result = handle_release(data, fd, hdr);
         break;
 
       default:
@@ -465,7 +559,7 @@ int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t bl
     }
 
     if (result == NO_STATUS_EXIT) {
-      result = 0;
+      finish_workers(fd, 0);
       break;
     }
 
@@ -474,19 +568,108 @@ int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t bl
       outhdr.len = sizeof(outhdr);
       outhdr.error = result;
       outhdr.unique = hdr->unique;
-      TEMP_FAILURE_RETRY(write(fd.ffd, &outhdr, sizeof(outhdr)));
+      TEMP_FAILURE_RETRY(write(fd->ffd, &outhdr, sizeof(outhdr)));
     }
   }
+}
+
+int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t block_size,
+                      const char* mount_point, const fuse_sideload_options& options) {
+  // If something's already mounted on our mountpoint, try to remove it. (Mostly in case of a
+  // previous abnormal exit.)
+  umount2(mount_point, MNT_FORCE);
+
+  // fs/fuse/inode.c in kernel code uses the greater of 4096 and the passed-in max_read.
+  if (block_size < 4096) {
+    fprintf(stderr, "block size (%u) is too small\n", block_size);
+    return -1;
+  }
+  if (block_size > (1 << 22)) {  // 4 MiB
+    fprintf(stderr, "block size (%u) is too large\n", block_size);
+    return -1;
+  }
+
+  fuse_data fd = {};
+  std::thread readahead;
+  std::vector<std::thread> workers;
+  fd.vtab = vtab;
+  fd.file_size = file_size;
+  fd.block_size = block_size;
+  fd.file_blocks = (file_size == 0) ? 0 : (((file_size - 1) / block_size) + 1);
+  fd.max_read = std::max(block_size, std::min(options.max_read, MAX_READ));
+
+  int result;
+  if (fd.file_blocks > (1 << 18)) {
+    fprintf(stderr, "file has too many blocks (%u)\n", fd.file_blocks);
+    result = -1;
+    goto done;
+  }
+
+  // All hashes will be zero-initialized.
+  fd.hashes.resize(fd.file_blocks);
+  fd.uid = getuid();
+  fd.gid = getgid();
+
+  fd.cache_blocks = std::max<uint32_t>(
+      2, std::min<uint32_t>(options.cache_blocks, MAX_CACHE_BYTES / block_size));
+  fd.zero_block = std::make_shared<std::vector<uint8_t>>(block_size, 0);
+
+  // Leave room in the cache for the blocks being read, so that the read-ahead doesn't evict them.
+  fd.readahead_blocks = std::min(options.readahead_blocks, fd.cache_blocks - 2);
+  fd.last_read_block = -1;
+  fd.readahead_next = 0;
+  fd.readahead_end = 0;
+  fd.readahead_exit = false;
+
+  // The workers share the connection. It's non-blocking, so that the idle ones keep checking the
+  // exit flag instead of blocking in read() for good.
+  fd.ffd.reset(open("/dev/fuse", O_RDWR | O_NONBLOCK));
+  if (!fd.ffd) {
+    perror("open /dev/fuse");
+    result = -1;
+    goto done;
+  }
+
+  {
+    std::string opts = android::base::StringPrintf(
+        "fd=%d,user_id=%d,group_id=%d,max_read=%u,allow_other,rootmode=040000", fd.ffd.get(),
+        fd.uid, fd.gid, fd.max_read);
+
+    result = mount("/dev/fuse", mount_point, "fuse", MS_NOSUID | MS_NODEV | MS_RDONLY | MS_NOEXEC,
+                   opts.c_str());
+    if (result == -1) {
+      perror("mount");
+      goto done;
+    }
+  }
+
+  if (fd.readahead_blocks > 0) {
+    readahead = std::thread(readahead_loop, &fd);
+  }
+
+  for (uint32_t i = 0; i < std::max<uint32_t>(options.threads, 1); i++) {
+    workers.emplace_back(fuse_worker, &fd);
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  result = fd.exit_result;
 
 done:
+  if (readahead.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(fd.cache_mutex);
+      fd.readahead_exit = true;
+    }
+    fd.readahead_cv.notify_one();
+    readahead.join();
+  }
+
   fd.vtab.close();
 
   if (umount2(mount_point, MNT_DETACH) == -1) {
     fprintf(stderr, "fuse_sideload umount failed: %s\n", strerror(errno));
   }
 
-  free(fd.block_data);
-  free(fd.extra_block);
-
   return result;
 }
@@ -17,6 +17,8 @@
 #ifndef __FUSE_SIDELOAD_H
 #define __FUSE_SIDELOAD_H
 
+#include <stdint.h>
+
 #include <functional>
 
 // Define the filenames created by the sideload FUSE filesystem.
@@ -30,11 +32,33 @@ struct provider_vtab {
   // read a block
   std::function<int(uint32_t block, uint8_t* buffer, uint32_t fetch_size)> read_block;
 
+  // Whether read_block() may be called from several threads at once. Otherwise the calls are
+  // serialized, e.g. for a provider that talks to the host over a single channel.
+  bool concurrent_reads = false;
+
   // close down
   std::function<void(void)> close;
 };
 
+struct fuse_sideload_options {
+  // The number of blocks to keep in memory. It's capped to 16 MiB worth of blocks, and at least two
+  // blocks are always kept for the reads that span two blocks.
+  uint32_t cache_blocks = 16;
+
+  // The number of blocks to fetch ahead of a sequential reader in the background, or 0 to only
+  // fetch the blocks on demand.
+  uint32_t readahead_blocks = 4;
+
+  // The largest read to take from the kernel, in bytes, which may span several blocks. It's at
+  // least one block, and at most 1 MiB. Older kernels cap it to 128 KiB regardless.
+  uint32_t max_read = 256 * 1024;
+
+  // The number of threads serving the requests, e.g. the reads of different parts of the package.
+  uint32_t threads = 4;
+};
+
 int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t block_size,
-                      const char* mount_point = FUSE_SIDELOAD_HOST_MOUNTPOINT);
+                      const char* mount_point = FUSE_SIDELOAD_HOST_MOUNTPOINT,
+                      const fuse_sideload_options& options = fuse_sideload_options());
 
 #endif
@@ -33,9 +33,11 @@
 #include <functional>
 #include <limits>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <tuple>
 #include <vector>
 
 #include <android-base/file.h>
@@ -52,6 +54,8 @@
 #include "otautil/SysUtil.h"
 #include "otautil/ThermalUtil.h"
 #include "otautil/error_code.h"
+#include "otautil/install_timeline.h"
+#include "otautil/readahead.h"
 #include "private/install.h"
 #include "roots.h"
 #include "ui.h"
@@ -314,20 +318,23 @@ static void log_max_temperature(int* max_temperature, const std::atomic<bool>& l
 // If the package contains an update binary, extract it and run it.
 static int try_update_binary(const std::string& package, ZipArchiveHandle zip, bool* wipe_cache,
                              std::vector<std::string>* log_buffer, int retry_count,
-                             int* max_temperature) {
+                             int* max_temperature, InstallTimeline* timeline) {
   read_source_target_build(zip, log_buffer);
 
   int pipefd[2];
   pipe(pipefd);
 
   std::vector<std::string> args;
+  int ret;
+  {
+    InstallTimeline::ScopedPhase phase(timeline, "update_binary_extraction");
 #ifdef AB_OTA_UPDATER
-  int ret = update_binary_command(package, zip, "/sbin/update_engine_sideload", retry_count,
-                                  pipefd[1], &args);
+    ret = update_binary_command(package, zip, "/sbin/update_engine_sideload", retry_count,
+                                pipefd[1], &args);
 #else
-  int ret = update_binary_command(package, zip, "/tmp/update-binary", retry_count, pipefd[1],
-                                  &args);
+    ret = update_binary_command(package, zip, "/tmp/update-binary", retry_count, pipefd[1], &args);
 #endif
+  }
   if (ret) {
     close(pipefd[0]);
     close(pipefd[1]);
@@ -390,6 +397,8 @@ static int try_update_binary(const std::string& package, ZipArchiveHandle zip, b
     chr_args[i] = args[i].c_str();
   }
 
+  // The I/O of the updater shows up in the diskstats counters of this phase.
+  InstallTimeline::ScopedPhase updater_phase(timeline, "updater");
   pid_t pid = fork();
 
   if (pid == -1) {
@@ -464,8 +473,12 @@ static int try_update_binary(const std::string& package, ZipArchiveHandle zip, b
       retry_update = true;
     } else if (command == "log") {
       if (!args.empty()) {
-        // Save the logging request from updater and write to last_install later.
-        log_buffer->push_back(args);
+        // Save the logging request from updater and write to last_install later. The per-function
+        // timings only go to the timeline (last_install.json), as last_install is parsed as
+        // "key: <integer>" lines.
+        if (timeline == nullptr || !timeline->AddUpdaterFunction(args)) {
+          log_buffer->push_back(args);
+        }
       } else {
         LOG(ERROR) << "invalid \"log\" parameters: " << line;
       }
@@ -561,9 +574,60 @@ bool verify_package_compatibility(ZipArchiveHandle package_zip) {
   return false;
 }
 
+// Returns the data ranges of the package entries, in the order the updater is expected to read
+// them: the updater and its script, the transfer lists, the patch data and then the new data. The
+// entries of the same kind (and the rest) are in file order.
+static std::vector<PackageReadahead::Range> updater_read_order(ZipArchiveHandle zip) {
+  void* cookie;
+  int ret = StartIteration(zip, &cookie, nullptr, nullptr);
+  if (ret != 0) {
+    LOG(WARNING) << "Failed to start iterating zip entries: " << ErrorCodeString(ret);
+    return {};
+  }
+  std::unique_ptr<void, decltype(&EndIteration)> guard(cookie, EndIteration);
+
+  auto rank = [](const std::string& name) {
+    if (android::base::StartsWith(name, "META-INF/")) return 0;
+    if (android::base::EndsWith(name, ".transfer.list")) return 1;
+    if (android::base::EndsWith(name, ".patch.dat")) return 2;
+    if (name.find(".new.dat") != std::string::npos) return 3;
+    return 4;
+  };
+
+  std::vector<std::pair<int, PackageReadahead::Range>> entries;
+  ZipEntry entry;
+  ZipString name;
+  while (Next(cookie, &entry, &name) == 0) {
+    std::string entry_name(reinterpret_cast<const char*>(name.name), name.name_length);
+    entries.emplace_back(rank(entry_name),
+                         PackageReadahead::Range{ static_cast<size_t>(entry.offset),
+                                                  static_cast<size_t>(entry.compressed_length) });
+  }
+  std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+    return std::tie(a.first, a.second.offset) < std::tie(b.first, b.second.offset);
+  });
+
+  std::vector<PackageReadahead::Range> ranges;
+  for (const auto& e : entries) {
+    ranges.push_back(e.second);
+  }
+  return ranges;
+}
+
+// Returns the number of bytes to prefetch for the updater: half of the available memory, so that
+// the prefetched pages don't push out each other (or the updater's own memory) before use.
+static size_t readahead_budget() {
+  long pages = sysconf(_SC_AVPHYS_PAGES);
+  long page_size = sysconf(_SC_PAGESIZE);
+  if (pages <= 0 || page_size <= 0) {
+    return 0;
+  }
+  return static_cast<size_t>(pages) * page_size / 2;
+}
+
 static int really_install_package(const std::string& path, bool* wipe_cache, bool needs_mount,
                                   std::vector<std::string>* log_buffer, int retry_count,
-                                  int* max_temperature) {
+                                  int* max_temperature, InstallTimeline* timeline) {
   ui->SetBackground(RecoveryUI::INSTALLING_UPDATE);
   ui->Print("Finding update package...\n");
   // Give verification half the progress bar...
@@ -575,6 +639,7 @@ static int really_install_package(const std::string& path, bool* wipe_cache, boo
   ui->Print("Opening update package...\n");
 
   if (needs_mount) {
+    InstallTimeline::ScopedPhase phase(timeline, "mount_package");
     if (path[0] == '@') {
       ensure_path_mounted(path.substr(1).c_str());
     } else {
@@ -583,21 +648,44 @@ static int really_install_package(const std::string& path, bool* wipe_cache, boo
   }
 
   MemMapping map;
-  if (!map.MapFile(path)) {
-    LOG(ERROR) << "failed to map file";
-    log_buffer->push_back(android::base::StringPrintf("error: %d", kMapFileFailure));
-    return INSTALL_CORRUPT;
+  {
+    InstallTimeline::ScopedPhase phase(timeline, "map_package");
+    if (!map.MapFile(path)) {
+      LOG(ERROR) << "failed to map file";
+      log_buffer->push_back(android::base::StringPrintf("error: %d", kMapFileFailure));
+      return INSTALL_CORRUPT;
+    }
+  }
+
+  // Block-mapped packages (i.e. uncrypt'd ones on /data) are read through the block device one
+  // page fault at a time, so prefetch them in the background.
+  std::unique_ptr<PackageReadahead> readahead;
+  if (path[0] == '@') {
+    readahead = std::make_unique<PackageReadahead>(map.addr, map.length);
+    readahead->Start();
   }
 
   // Verify package.
-  if (!verify_package(map.addr, map.length)) {
+  std::unique_ptr<InstallTimeline::ScopedPhase> verify_phase =
+      std::make_unique<InstallTimeline::ScopedPhase>(timeline, "verify_package");
+  auto on_progress = [&readahead, &map](float fraction) {
+    if (readahead) {
+      readahead->SetCursor(static_cast<size_t>(fraction * map.length));
+    }
+  };
+  if (!verify_package(map.addr, map.length, on_progress)) {
     log_buffer->push_back(android::base::StringPrintf("error: %d", kZipVerificationFailure));
     return INSTALL_CORRUPT;
   }
+  verify_phase.reset();
 
   // Try to open the package.
   ZipArchiveHandle zip;
-  int err = OpenArchiveFromMemory(map.addr, map.length, path.c_str(), &zip);
+  int err;
+  {
+    InstallTimeline::ScopedPhase phase(timeline, "open_archive");
+    err = OpenArchiveFromMemory(map.addr, map.length, path.c_str(), &zip);
+  }
   if (err != 0) {
     LOG(ERROR) << "Can't open " << path << " : " << ErrorCodeString(err);
     log_buffer->push_back(android::base::StringPrintf("error: %d", kZipOpenFailure));
@@ -607,22 +695,42 @@ static int really_install_package(const std::string& path, bool* wipe_cache, boo
   }
 
   // Additionally verify the compatibility of the package.
-  if (!verify_package_compatibility(zip)) {
+  bool compatible;
+  {
+    InstallTimeline::ScopedPhase phase(timeline, "verify_package_compatibility");
+    compatible = verify_package_compatibility(zip);
+  }
+  if (!compatible) {
     log_buffer->push_back(android::base::StringPrintf("error: %d", kPackageCompatibilityFailure));
     CloseArchive(zip);
     return INSTALL_CORRUPT;
   }
 
+  if (readahead) {
+    readahead->FollowRanges(updater_read_order(zip), readahead_budget());
+  }
+
   // Verify and install the contents of the package.
   ui->Print("Installing update...\n");
   if (retry_count > 0) {
     ui->Print("Retry attempt: %d\n", retry_count);
   }
   ui->SetEnableReboot(false);
-  int result = try_update_binary(path, zip, wipe_cache, log_buffer, retry_count, max_temperature);
+  int result = try_update_binary(path, zip, wipe_cache, log_buffer, retry_count, max_temperature,
+                                 timeline);
   ui->SetEnableReboot(true);
   ui->Print("\n");
 
+  if (readahead) {
+    readahead->Stop();
+    PackageReadahead::Stats stats = readahead->GetStats();
+    log_buffer->push_back("readahead_sequential_bytes: " + std::to_string(stats.sequential_bytes));
+    log_buffer->push_back("readahead_ranged_bytes: " + std::to_string(stats.ranged_bytes));
+    log_buffer->push_back("readahead_resident_bytes: " + std::to_string(stats.resident_bytes));
+    log_buffer->push_back("readahead_throttled: " + std::to_string(stats.throttled));
+    log_buffer->push_back("readahead_time_ms: " + std::to_string(stats.read_ms));
+  }
+
   CloseArchive(zip);
   return result;
 }
@@ -641,12 +749,18 @@ int install_package(const std::string& path, bool* wipe_cache, const std::string
 
   int result;
   std::vector<std::string> log_buffer;
-  if (setup_install_mounts() != 0) {
+  InstallTimeline timeline;
+  int mount_result;
+  {
+    InstallTimeline::ScopedPhase phase(&timeline, "setup_mounts");
+    mount_result = setup_install_mounts();
+  }
+  if (mount_result != 0) {
     LOG(ERROR) << "failed to set up expected mounts for install; aborting";
     result = INSTALL_ERROR;
   } else {
     result = really_install_package(path, wipe_cache, needs_mount, &log_buffer, retry_count,
-                                    &max_temperature);
+                                    &max_temperature, &timeline);
   }
 
   // Measure the time spent to apply OTA update in seconds.
@@ -691,6 +805,13 @@ int install_package(const std::string& path, bool* wipe_cache, const std::string
     log_buffer.push_back("temperature_max: " + std::to_string(max_temperature));
   }
 
+  // The per-phase durations and disk I/O go to last_install, while the full timeline (including
+  // the per-process counters and the time spent in each updater function) goes to a JSON file
+  // next to it.
+  std::vector<std::string> timeline_lines = timeline.ToLogLines();
+  log_buffer.insert(log_buffer.end(), timeline_lines.begin(), timeline_lines.end());
+  timeline.WriteToFile(install_file + ".json");
+
   std::string log_content =
       android::base::Join(log_header, "\n") + "\n" + android::base::Join(log_buffer, "\n") + "\n";
   if (!android::base::WriteStringToFile(log_content, install_file)) {
@@ -703,7 +824,8 @@ int install_package(const std::string& path, bool* wipe_cache, const std::string
   return result;
 }
 
-bool verify_package(const unsigned char* package_data, size_t package_size) {
+bool verify_package(const unsigned char* package_data, size_t package_size,
+                    const std::function<void(float)>& on_progress) {
   static constexpr const char* PUBLIC_KEYS_FILE = "/res/keys";
   std::vector<Certificate> loadedKeys;
   if (!load_keys(PUBLIC_KEYS_FILE, loadedKeys)) {
@@ -715,8 +837,12 @@ bool verify_package(const unsigned char* package_data, size_t package_size) {
   // Verify package.
   ui->Print("Verifying update package...\n");
   auto t0 = std::chrono::system_clock::now();
-  int err = verify_file(package_data, package_size, loadedKeys,
-                        std::bind(&RecoveryUI::SetProgress, ui, std::placeholders::_1));
+  int err = verify_file(package_data, package_size, loadedKeys, [&on_progress](float fraction) {
+    ui->SetProgress(fraction);
+    if (on_progress) {
+      on_progress(fraction);
+    }
+  });
   std::chrono::duration<double> duration = std::chrono::system_clock::now() - t0;
   ui->Print("Update package verification took %.1f s (result %d).\n", duration.count(), err);
   if (err != VERIFY_SUCCESS) {
@@ -17,6 +17,7 @@
 #ifndef RECOVERY_INSTALL_H_
 #define RECOVERY_INSTALL_H_
 
+#include <functional>
 #include <string>
 #include <ziparchive/zip_archive.h>
 
@@ -29,8 +30,10 @@ int install_package(const std::string& package, bool* wipe_cache, const std::str
                     bool needs_mount, int retry_count);
 
 // Verify the package by ota keys. Return true if the package is verified successfully,
-// otherwise return false.
-bool verify_package(const unsigned char* package_data, size_t package_size);
+// otherwise return false. The verification progress is posted to the UI, and to |on_progress| if
+// given.
+bool verify_package(const unsigned char* package_data, size_t package_size,
+                    const std::function<void(float)>& on_progress = nullptr);
 
 // Read meta data file of the package, write its content in the string pointed by meta_data.
 // Return true if succeed, otherwise return false.
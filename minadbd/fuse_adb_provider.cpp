@@ -21,7 +21,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
 #include <functional>
+#include <memory>
 
 #include "adb.h"
 #include "adb_io.h"
@@ -41,16 +43,120 @@ int read_block_adb(const adb_data& ad, uint32_t block, uint8_t* buffer, uint32_t
   return 0;
 }
 
+AdbBlockPipeline::AdbBlockPipeline(const adb_data& ad, uint32_t window)
+    : ad_(ad),
+      window_(std::max<uint32_t>(window, 1)),
+      file_blocks_((ad.file_size + ad.block_size - 1) / ad.block_size),
+      failed_(false),
+      last_block_(-1) {}
+
+uint32_t AdbBlockPipeline::FetchSize(uint32_t block) const {
+  uint64_t offset = static_cast<uint64_t>(block) * ad_.block_size;
+  return std::min<uint64_t>(ad_.block_size, ad_.file_size - offset);
+}
+
+bool AdbBlockPipeline::SendRequest(uint32_t block) {
+  if (!WriteFdFmt(ad_.sfd, "%08u", block)) {
+    fprintf(stderr, "failed to write to adb host: %s\n", strerror(errno));
+    return false;
+  }
+  in_flight_.push_back(block);
+  return true;
+}
+
+bool AdbBlockPipeline::ReceiveReply() {
+  uint32_t block = in_flight_.front();
+  std::vector<uint8_t> data(FetchSize(block));
+  if (!ReadFdExactly(ad_.sfd, data.data(), data.size())) {
+    fprintf(stderr, "failed to read from adb host: %s\n", strerror(errno));
+    return false;
+  }
+  in_flight_.pop_front();
+
+  // Don't hold on to more than a window of replies when the reads aren't sequential. The dropped
+  // ones will be requested again if needed.
+  received_[block] = std::move(data);
+  if (received_.size() > window_) {
+    auto oldest = received_.begin();
+    if (oldest->first == block) ++oldest;
+    received_.erase(oldest);
+  }
+  return true;
+}
+
+int AdbBlockPipeline::ReadBlock(uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+  // The replies can't be matched to the requests any more after a failed read or write.
+  if (failed_ || block >= file_blocks_ || fetch_size != FetchSize(block)) {
+    return -EIO;
+  }
+
+  bool sequential = block == last_block_ + 1;
+  last_block_ = block;
+
+  auto it = received_.find(block);
+  if (it == received_.end() &&
+      std::find(in_flight_.begin(), in_flight_.end(), block) == in_flight_.end()) {
+    if (!SendRequest(block)) {
+      failed_ = true;
+      return -EIO;
+    }
+  }
+
+  // Top up the window with the blocks that follow, before waiting for this one.
+  if (sequential) {
+    uint32_t next = block + 1;
+    if (!in_flight_.empty()) {
+      next = std::max(next, *std::max_element(in_flight_.begin(), in_flight_.end()) + 1);
+    }
+    for (; in_flight_.size() < window_ && next < file_blocks_; next++) {
+      if (received_.find(next) != received_.end()) continue;
+      if (!SendRequest(next)) {
+        failed_ = true;
+        return -EIO;
+      }
+    }
+  }
+
+  while ((it = received_.find(block)) == received_.end()) {
+    if (!ReceiveReply()) {
+      failed_ = true;
+      return -EIO;
+    }
+  }
+
+  memcpy(buffer, it->second.data(), fetch_size);
+  received_.erase(it);
+  return 0;
+}
+
+int AdbBlockPipeline::Drain() {
+  while (!failed_ && !in_flight_.empty()) {
+    if (!ReceiveReply()) {
+      failed_ = true;
+    }
+  }
+  received_.clear();
+  return failed_ ? -EIO : 0;
+}
+
 int run_adb_fuse(int sfd, uint64_t file_size, uint32_t block_size) {
   adb_data ad;
   ad.sfd = sfd;
   ad.file_size = file_size;
   ad.block_size = block_size;
 
+  // Keep up to 1 MiB worth of requests in flight.
+  uint32_t window = std::max<uint32_t>(1, (1 << 20) / block_size);
+  auto pipeline = std::make_shared<AdbBlockPipeline>(ad, window);
+
   provider_vtab vtab;
-  vtab.read_block = std::bind(read_block_adb, ad, std::placeholders::_1, std::placeholders::_2,
-                              std::placeholders::_3);
-  vtab.close = [&ad]() { WriteFdExactly(ad.sfd, "DONEDONE"); };
+  vtab.read_block = [pipeline](uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+    return pipeline->ReadBlock(block, buffer, fetch_size);
+  };
+  vtab.close = [&ad, pipeline]() {
+    pipeline->Drain();
+    WriteFdExactly(ad.sfd, "DONEDONE");
+  };
 
   return run_fuse_sideload(vtab, file_size, block_size);
 }
@@ -19,6 +19,10 @@
 
 #include <stdint.h>
 
+#include <deque>
+#include <map>
+#include <vector>
+
 struct adb_data {
   int sfd;  // file descriptor for the adb channel
 
@@ -27,6 +31,39 @@ struct adb_data {
 };
 
 int read_block_adb(const adb_data& ad, uint32_t block, uint8_t* buffer, uint32_t fetch_size);
+
+// Reads blocks from the adb host with up to |window| block requests in flight. The host serves the
+// requests in order, so while the blocks are being read sequentially, the requests for the next
+// blocks are sent ahead of time and their replies stream in without waiting for a round trip each.
+// The replies to the blocks nobody has asked for yet are kept until they are. Not thread-safe.
+class AdbBlockPipeline {
+ public:
+  AdbBlockPipeline(const adb_data& ad, uint32_t window);
+
+  // Same as read_block_adb().
+  int ReadBlock(uint32_t block, uint8_t* buffer, uint32_t fetch_size);
+
+  // Receives the replies to the outstanding requests, so that the host is ready for "DONEDONE".
+  int Drain();
+
+ private:
+  uint32_t FetchSize(uint32_t block) const;
+  bool SendRequest(uint32_t block);
+  // Receives the reply to the oldest outstanding request into received_.
+  bool ReceiveReply();
+
+  adb_data ad_;
+  uint32_t window_;
+  uint32_t file_blocks_;
+  bool failed_;
+
+  // The outstanding requests, oldest first.
+  std::deque<uint32_t> in_flight_;
+  // The replies that have been received ahead of being read, by block.
+  std::map<uint32_t, std::vector<uint8_t>> received_;
+  uint32_t last_block_;
+};
+
 int run_adb_fuse(int sfd, uint64_t file_size, uint32_t block_size);
 
 #endif
@@ -20,6 +20,8 @@
 #include <sys/socket.h>
 
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <gtest/gtest.h>
 
@@ -88,3 +90,61 @@ TEST(fuse_adb_provider, read_block_adb_fail_write) {
 
   close(sockets[0]);
 }
+
+// Serves the sideload-host protocol over |sfd| the way the host does: one block per request, in
+// order, until "DONEDONE". Records the requests.
+static void ServeBlocks(int sfd, const std::string& content, uint32_t block_size,
+                        std::vector<uint32_t>* requests) {
+  char request[9] = {};
+  while (ReadFdExactly(sfd, request, 8)) {
+    if (strcmp(request, "DONEDONE") == 0) return;
+    uint32_t block = strtoul(request, nullptr, 10);
+    requests->push_back(block);
+    size_t offset = static_cast<size_t>(block) * block_size;
+    ASSERT_LT(offset, content.size());
+    size_t size = std::min<size_t>(block_size, content.size() - offset);
+    ASSERT_TRUE(WriteFdExactly(sfd, content.data() + offset, size));
+  }
+}
+
+TEST(fuse_adb_provider, AdbBlockPipeline) {
+  static constexpr uint32_t kBlockSize = 4096;
+  std::string content;
+  for (size_t i = 0; i < 10; i++) {
+    content += std::string(kBlockSize, 'a' + i);
+  }
+  content.resize(content.size() - 100);
+
+  int sockets[2];
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+  std::vector<uint32_t> requests;
+  std::thread host(ServeBlocks, sockets[1], content, kBlockSize, &requests);
+
+  adb_data data = {};
+  data.sfd = sockets[0];
+  data.file_size = content.size();
+  data.block_size = kBlockSize;
+  AdbBlockPipeline pipeline(data, 4);
+
+  // Sequential reads, followed by a jump back, a jump ahead and a re-read.
+  std::vector<uint8_t> buffer(kBlockSize);
+  for (uint32_t block : { 0, 1, 2, 3, 4, 1, 8, 9, 9 }) {
+    uint32_t fetch_size = block == 9 ? kBlockSize - 100 : kBlockSize;
+    ASSERT_EQ(0, pipeline.ReadBlock(block, buffer.data(), fetch_size)) << "block " << block;
+    ASSERT_EQ(content.substr(block * kBlockSize, fetch_size),
+              std::string(buffer.begin(), buffer.begin() + fetch_size));
+  }
+  ASSERT_EQ(-EIO, pipeline.ReadBlock(10, buffer.data(), kBlockSize));
+
+  ASSERT_EQ(0, pipeline.Drain());
+  ASSERT_TRUE(WriteFdExactly(sockets[0], "DONEDONE"));
+  host.join();
+
+  // The sequential reads have a window of requests ahead of them (up to block 7), and each of
+  // them is only requested once.
+  std::vector<uint32_t> expected = { 0, 1, 2, 3, 4, 5, 6, 7, 1, 8, 9, 9 };
+  ASSERT_EQ(expected, requests);
+
+  close(sockets[0]);
+  close(sockets[1]);
+}
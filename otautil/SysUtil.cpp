@@ -63,7 +63,10 @@ bool MemMapping::MapFD(int fd) {
 //
 // Each block range represents a half-open interval; the line "30 33" reprents the blocks
 // [30, 31, 32].
-bool MemMapping::MapBlockFile(const std::string& filename) {
+//
+// Ranges that are physically contiguous with the previous one (i.e. "0 3" followed by "3 5") are
+// merged into one extent, as uncrypt may split a contiguous file into many ranges.
+bool ParseBlockMap(const std::string& filename, BlockMap* block_map) {
   std::string content;
   if (!android::base::ReadFileToString(filename, &content)) {
     PLOG(ERROR) << "Failed to read " << filename;
@@ -100,67 +103,88 @@ bool MemMapping::MapBlockFile(const std::string& filename) {
     return false;
   }
 
-  // Reserve enough contiguous address space for the whole file.
-  void* reserve = mmap(nullptr, blocks * blksize, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
-  if (reserve == MAP_FAILED) {
-    PLOG(ERROR) << "failed to reserve address space";
-    return false;
-  }
-
-  const std::string& block_dev = lines[0];
-  android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(block_dev.c_str(), O_RDONLY)));
-  if (fd == -1) {
-    PLOG(ERROR) << "failed to open block device " << block_dev;
-    munmap(reserve, blocks * blksize);
-    return false;
-  }
-
-  ranges_.clear();
+  block_map->device = lines[0];
+  block_map->size = size;
+  block_map->block_size = blksize;
+  block_map->range_count = range_count;
+  block_map->extents.clear();
 
-  unsigned char* next = static_cast<unsigned char*>(reserve);
   size_t remaining_size = blocks * blksize;
-  bool success = true;
   for (size_t i = 0; i < range_count; ++i) {
     const std::string& line = lines[i + 3];
 
     size_t start, end;
     if (sscanf(line.c_str(), "%zu %zu\n", &start, &end) != 2) {
       LOG(ERROR) << "failed to parse range " << i << ": " << line;
-      success = false;
-      break;
+      return false;
     }
     size_t range_size = (end - start) * blksize;
-    if (end <= start || (end - start) > SIZE_MAX / blksize || range_size > remaining_size) {
+    if (end <= start || (end - start) > SIZE_MAX / blksize || range_size > remaining_size ||
+        start > SIZE_MAX / blksize) {
       LOG(ERROR) << "Invalid range: " << start << " " << end;
-      success = false;
-      break;
+      return false;
     }
 
-    void* range_start = mmap(next, range_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd,
-                             static_cast<off_t>(start) * blksize);
-    if (range_start == MAP_FAILED) {
-      PLOG(ERROR) << "failed to map range " << i << ": " << line;
-      success = false;
-      break;
+    auto& extents = block_map->extents;
+    if (!extents.empty() && extents.back().start + extents.back().length == start * blksize) {
+      extents.back().length += range_size;
+    } else {
+      size_t file_offset =
+          extents.empty() ? 0 : extents.back().file_offset + extents.back().length;
+      extents.push_back(BlockMap::Extent{ file_offset, start * blksize, range_size });
     }
-    ranges_.emplace_back(MappedRange{ range_start, range_size });
-
-    next += range_size;
     remaining_size -= range_size;
   }
-  if (success && remaining_size != 0) {
+  if (remaining_size != 0) {
     LOG(ERROR) << "Invalid ranges: remaining_size " << remaining_size;
-    success = false;
+    return false;
   }
-  if (!success) {
-    munmap(reserve, blocks * blksize);
+  return true;
+}
+
+bool MemMapping::MapBlockFile(const std::string& filename) {
+  BlockMap block_map;
+  if (!ParseBlockMap(filename, &block_map)) {
+    return false;
+  }
+  size_t reserved_size = block_map.mapped_size();
+
+  // Reserve enough contiguous address space for the whole file.
+  void* reserve = mmap(nullptr, reserved_size, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (reserve == MAP_FAILED) {
+    PLOG(ERROR) << "failed to reserve address space";
     return false;
   }
 
-  addr = static_cast<unsigned char*>(reserve);
-  length = size;
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(block_map.device.c_str(), O_RDONLY)));
+  if (fd == -1) {
+    PLOG(ERROR) << "failed to open block device " << block_map.device;
+    munmap(reserve, reserved_size);
+    return false;
+  }
+
+  ranges_.clear();
+
+  // One mapping per extent, i.e. per physically contiguous run of ranges.
+  unsigned char* base = static_cast<unsigned char*>(reserve);
+  for (const auto& extent : block_map.extents) {
+    void* range_start = mmap(base + extent.file_offset, extent.length, PROT_READ,
+                             MAP_PRIVATE | MAP_FIXED, fd, static_cast<off_t>(extent.start));
+    if (range_start == MAP_FAILED) {
+      PLOG(ERROR) << "failed to map extent at " << extent.start << " (" << extent.length
+                  << " bytes)";
+      munmap(reserve, reserved_size);
+      ranges_.clear();
+      return false;
+    }
+    ranges_.emplace_back(MappedRange{ range_start, extent.length });
+  }
+
+  addr = base;
+  length = block_map.size;
 
-  LOG(INFO) << "mmapped " << range_count << " ranges";
+  LOG(INFO) << "mmapped " << block_map.range_count << " ranges as " << ranges_.size()
+            << " extents";
 
   return true;
 }
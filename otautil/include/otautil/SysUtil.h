@@ -22,6 +22,29 @@
 #include <string>
 #include <vector>
 
+// A parsed block map (as written by uncrypt), with its physically contiguous ranges merged into
+// extents.
+struct BlockMap {
+  struct Extent {
+    size_t file_offset;  // The offset in the file.
+    size_t start;        // The offset on the block device.
+    size_t length;
+  };
+
+  // The size of the address space that maps the whole file, i.e. rounded up to whole blocks.
+  size_t mapped_size() const {
+    return extents.empty() ? 0 : extents.back().file_offset + extents.back().length;
+  }
+
+  std::string device;
+  size_t size;
+  size_t block_size;
+  size_t range_count;  // The number of ranges in the block map, before merging.
+  std::vector<Extent> extents;
+};
+
+bool ParseBlockMap(const std::string& filename, BlockMap* block_map);
+
 /*
  * Use this to keep track of mapped segments.
  */
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OTAUTIL_INSTALL_TIMELINE_H
+#define _OTAUTIL_INSTALL_TIMELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+struct IoCounters {
+  // Of this process, from /proc/self/io. rchar and wchar include the reads and writes served by the
+  // page cache, while read_bytes and write_bytes only count the ones that reach the storage.
+  uint64_t rchar = 0;
+  uint64_t wchar = 0;
+  uint64_t read_bytes = 0;
+  uint64_t write_bytes = 0;
+  // Of all the disks, from /proc/diskstats. These include the I/O of the child processes (e.g. the
+  // updater).
+  uint64_t disk_read_bytes = 0;
+  uint64_t disk_write_bytes = 0;
+
+  IoCounters operator-(const IoCounters& other) const;
+};
+
+// Parse the content of /proc/self/io and /proc/diskstats respectively into |counters|.
+bool ParseProcIo(const std::string& content, IoCounters* counters);
+// Only the whole disks are counted, i.e. not the partitions, nor the loop, ram, zram and
+// device-mapper devices that are backed by other devices.
+bool ParseDiskstats(const std::string& content, IoCounters* counters);
+
+// Returns the current counters. The missing ones (e.g. when /proc/self/io isn't available) are 0.
+IoCounters ReadIoCounters();
+
+// Records the duration and the I/O of the phases of an install, and the time spent in each updater
+// function, for last_install and a JSON file.
+class InstallTimeline {
+ public:
+  struct Phase {
+    std::string name;
+    double start_ms;  // Since the start of the install.
+    double duration_ms;
+    IoCounters io;
+  };
+
+  struct UpdaterFunction {
+    std::string name;
+    size_t calls;
+    double total_ms;
+  };
+
+  // Records the time and the I/O between its construction and destruction as phase |name|.
+  // |timeline| may be nullptr, in which case nothing is recorded.
+  class ScopedPhase {
+   public:
+    ScopedPhase(InstallTimeline* timeline, const std::string& name);
+    ~ScopedPhase();
+
+   private:
+    InstallTimeline* timeline_;
+    std::string name_;
+    double start_ms_;
+    IoCounters start_io_;
+  };
+
+  InstallTimeline();
+
+  double ElapsedMs() const;
+
+  void AddPhase(const Phase& phase);
+
+  // Parses the arguments of an "updater_function: <name> <calls> <total_ms>" log line from the
+  // updater. Returns false if |line| isn't one.
+  bool AddUpdaterFunction(const std::string& line);
+
+  const std::vector<Phase>& phases() const {
+    return phases_;
+  }
+  const std::vector<UpdaterFunction>& updater_functions() const {
+    return updater_functions_;
+  }
+
+  // Returns the "key: value" lines for last_install: the duration of each phase in milliseconds,
+  // and the bytes it read from and wrote to the disks.
+  std::vector<std::string> ToLogLines() const;
+  std::string ToJson() const;
+  bool WriteToFile(const std::string& path) const;
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+  std::vector<Phase> phases_;
+  std::vector<UpdaterFunction> updater_functions_;
+};
+
+#endif  // _OTAUTIL_INSTALL_TIMELINE_H
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RECOVERY_JSON_STRING_H
+#define RECOVERY_JSON_STRING_H
+
+#include <string>
+
+#include <android-base/stringprintf.h>
+
+// Returns |str| as a quoted JSON string literal, escaping quotes, backslashes and control
+// characters.
+[[maybe_unused]] static std::string JsonString(const std::string& str) {
+  std::string result = "\"";
+  for (unsigned char c : str) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+      result += c;
+    } else if (c < 0x20) {
+      result += android::base::StringPrintf("\\u%04x", c);
+    } else {
+      result += c;
+    }
+  }
+  return result + "\"";
+}
+
+#endif  // RECOVERY_JSON_STRING_H
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _OTAUTIL_READAHEAD_H
+#define _OTAUTIL_READAHEAD_H
+
+#include <stddef.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Prefetches a mapped package into the page cache on a background thread, at idle I/O priority.
+// It first reads the package sequentially, staying within a window ahead of the foreground
+// reader (i.e. the signature verification) as reported with SetCursor(). After FollowRanges(), it
+// reads the given ranges in order instead (e.g. the zip entries the updater is going to read).
+//
+// Since the page cache is shared, this also speeds up other processes that map the same file or
+// block device, such as the updater.
+class PackageReadahead {
+ public:
+  struct Range {
+    size_t offset;
+    size_t length;
+  };
+
+  struct Stats {
+    // The bytes read in the sequential and the ranged phases.
+    size_t sequential_bytes = 0;
+    size_t ranged_bytes = 0;
+    // The bytes that were already resident when the thread got to them.
+    size_t resident_bytes = 0;
+    // The number of times the thread had to wait for the foreground reader to catch up.
+    size_t throttled = 0;
+    // The time the thread spent reading, in milliseconds.
+    size_t read_ms = 0;
+  };
+
+  // |addr| and |length| must stay mapped until Stop() returns (or the object is destroyed).
+  PackageReadahead(const unsigned char* addr, size_t length, size_t window = 64 * 1024 * 1024);
+  ~PackageReadahead();
+
+  void Start();
+
+  // Reports that the foreground reader has got to |offset| in the sequential phase.
+  void SetCursor(size_t offset);
+
+  // Stops the sequential phase, and reads the given ranges in order until |budget| bytes have been
+  // read.
+  void FollowRanges(const std::vector<Range>& ranges, size_t budget);
+
+  void Stop();
+
+  Stats GetStats() const;
+
+ private:
+  void ThreadLoop();
+  // Faults in the pages in [offset, offset + len), and returns the number of bytes read (i.e. not
+  // already resident).
+  size_t Prefetch(size_t offset, size_t len);
+
+  const unsigned char* addr_;
+  size_t length_;
+  size_t window_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::thread thread_;
+  bool stopped_ = false;
+  size_t cursor_ = 0;
+  bool following_ranges_ = false;
+  std::vector<Range> ranges_;
+  size_t budget_ = 0;
+  Stats stats_;
+};
+
+#endif  // _OTAUTIL_READAHEAD_H
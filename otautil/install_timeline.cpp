@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/install_timeline.h"
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parsedouble.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+#include "otautil/json_string.h"
+
+using android::base::StringPrintf;
+
+// Splits |line| on |delimiters|, dropping the empty pieces that repeated delimiters yield.
+static std::vector<std::string> SplitFields(const std::string& line, const std::string& delimiters) {
+  std::vector<std::string> fields = android::base::Split(line, delimiters);
+  fields.erase(std::remove(fields.begin(), fields.end(), ""), fields.end());
+  return fields;
+}
+
+// The sectors in /proc/diskstats are always 512 bytes, regardless of the device.
+static constexpr uint64_t kDiskstatsSectorSize = 512;
+
+IoCounters IoCounters::operator-(const IoCounters& other) const {
+  IoCounters result;
+  result.rchar = rchar - other.rchar;
+  result.wchar = wchar - other.wchar;
+  result.read_bytes = read_bytes - other.read_bytes;
+  result.write_bytes = write_bytes - other.write_bytes;
+  result.disk_read_bytes = disk_read_bytes - other.disk_read_bytes;
+  result.disk_write_bytes = disk_write_bytes - other.disk_write_bytes;
+  return result;
+}
+
+bool ParseProcIo(const std::string& content, IoCounters* counters) {
+  size_t found = 0;
+  for (const auto& line : android::base::Split(content, "\n")) {
+    std::vector<std::string> pieces = android::base::Split(line, ":");
+    if (pieces.size() != 2) continue;
+    uint64_t* field = nullptr;
+    if (pieces[0] == "rchar") {
+      field = &counters->rchar;
+    } else if (pieces[0] == "wchar") {
+      field = &counters->wchar;
+    } else if (pieces[0] == "read_bytes") {
+      field = &counters->read_bytes;
+    } else if (pieces[0] == "write_bytes") {
+      field = &counters->write_bytes;
+    }
+    if (field != nullptr && android::base::ParseUint(android::base::Trim(pieces[1]), field)) {
+      found++;
+    }
+  }
+  return found == 4;
+}
+
+// Returns whether |name| is a partition of |disk|, e.g. "sda1" of "sda" or "mmcblk0p1" of
+// "mmcblk0".
+static bool IsPartitionOf(const std::string& name, const std::string& disk) {
+  if (name.size() <= disk.size() || !android::base::StartsWith(name, disk)) {
+    return false;
+  }
+  size_t pos = disk.size();
+  if (isdigit(disk.back()) && name[pos] == 'p') {
+    pos++;
+  }
+  return pos < name.size() &&
+         std::all_of(name.begin() + pos, name.end(), [](char c) { return isdigit(c); });
+}
+
+bool ParseDiskstats(const std::string& content, IoCounters* counters) {
+  struct Disk {
+    std::string name;
+    uint64_t sectors_read;
+    uint64_t sectors_written;
+  };
+  std::vector<Disk> disks;
+  for (const auto& line : android::base::Split(content, "\n")) {
+    // major minor name reads reads_merged sectors_read ms_reading writes writes_merged
+    // sectors_written ...
+    std::vector<std::string> fields = SplitFields(line, " \t");
+    if (fields.size() < 10) continue;
+    Disk disk{ fields[2], 0, 0 };
+    if (!android::base::ParseUint(fields[5], &disk.sectors_read) ||
+        !android::base::ParseUint(fields[9], &disk.sectors_written)) {
+      LOG(WARNING) << "Failed to parse diskstats line: " << line;
+      continue;
+    }
+    disks.push_back(disk);
+  }
+  if (disks.empty()) {
+    return false;
+  }
+
+  counters->disk_read_bytes = 0;
+  counters->disk_write_bytes = 0;
+  for (const auto& disk : disks) {
+    if (android::base::StartsWith(disk.name, "loop") ||
+        android::base::StartsWith(disk.name, "ram") ||
+        android::base::StartsWith(disk.name, "zram") ||
+        android::base::StartsWith(disk.name, "dm-")) {
+      continue;
+    }
+    if (std::any_of(disks.begin(), disks.end(),
+                    [&disk](const Disk& d) { return IsPartitionOf(disk.name, d.name); })) {
+      continue;
+    }
+    counters->disk_read_bytes += disk.sectors_read * kDiskstatsSectorSize;
+    counters->disk_write_bytes += disk.sectors_written * kDiskstatsSectorSize;
+  }
+  return true;
+}
+
+IoCounters ReadIoCounters() {
+  IoCounters counters;
+  std::string content;
+  if (android::base::ReadFileToString("/proc/self/io", &content)) {
+    ParseProcIo(content, &counters);
+  }
+  if (android::base::ReadFileToString("/proc/diskstats", &content)) {
+    ParseDiskstats(content, &counters);
+  }
+  return counters;
+}
+
+InstallTimeline::ScopedPhase::ScopedPhase(InstallTimeline* timeline, const std::string& name)
+    : timeline_(timeline), name_(name), start_ms_(0) {
+  if (timeline_ != nullptr) {
+    start_ms_ = timeline_->ElapsedMs();
+    start_io_ = ReadIoCounters();
+  }
+}
+
+InstallTimeline::ScopedPhase::~ScopedPhase() {
+  if (timeline_ != nullptr) {
+    timeline_->AddPhase(
+        Phase{ name_, start_ms_, timeline_->ElapsedMs() - start_ms_, ReadIoCounters() - start_io_ });
+  }
+}
+
+InstallTimeline::InstallTimeline() : start_(std::chrono::steady_clock::now()) {}
+
+double InstallTimeline::ElapsedMs() const {
+  std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_;
+  return elapsed.count();
+}
+
+void InstallTimeline::AddPhase(const Phase& phase) {
+  phases_.push_back(phase);
+}
+
+bool InstallTimeline::AddUpdaterFunction(const std::string& line) {
+  static constexpr const char* kPrefix = "updater_function:";
+  if (!android::base::StartsWith(line, kPrefix)) {
+    return false;
+  }
+  std::vector<std::string> fields = SplitFields(line.substr(strlen(kPrefix)), " ");
+  UpdaterFunction function;
+  if (fields.size() != 3 || !android::base::ParseUint(fields[1], &function.calls) ||
+      !android::base::ParseDouble(fields[2].c_str(), &function.total_ms)) {
+    LOG(WARNING) << "Invalid updater function timing: " << line;
+    return false;
+  }
+  function.name = fields[0];
+  updater_functions_.push_back(function);
+  return true;
+}
+
+std::vector<std::string> InstallTimeline::ToLogLines() const {
+  std::vector<std::string> lines;
+  for (const auto& phase : phases_) {
+    lines.push_back(StringPrintf("timeline_%s_ms: %.0f", phase.name.c_str(), phase.duration_ms));
+    lines.push_back(StringPrintf("timeline_%s_disk_read_bytes: %" PRIu64, phase.name.c_str(),
+                                 phase.io.disk_read_bytes));
+    lines.push_back(StringPrintf("timeline_%s_disk_write_bytes: %" PRIu64, phase.name.c_str(),
+                                 phase.io.disk_write_bytes));
+  }
+  return lines;
+}
+
+std::string InstallTimeline::ToJson() const {
+  std::string json = StringPrintf("{\n  \"total_ms\": %.3f,\n  \"phases\": [", ElapsedMs());
+  for (size_t i = 0; i < phases_.size(); i++) {
+    const auto& p = phases_[i];
+    json += StringPrintf(
+        "%s\n    {\"name\": %s, \"start_ms\": %.3f, \"duration_ms\": %.3f, \"rchar\": %" PRIu64
+        ", \"wchar\": %" PRIu64 ", \"read_bytes\": %" PRIu64 ", \"write_bytes\": %" PRIu64
+        ", \"disk_read_bytes\": %" PRIu64 ", \"disk_write_bytes\": %" PRIu64 "}",
+        i == 0 ? "" : ",", JsonString(p.name).c_str(), p.start_ms, p.duration_ms, p.io.rchar,
+        p.io.wchar, p.io.read_bytes, p.io.write_bytes, p.io.disk_read_bytes,
+        p.io.disk_write_bytes);
+  }
+  json += phases_.empty() ? "],\n" : "\n  ],\n";
+
+  json += "  \"updater_functions\": [";
+  for (size_t i = 0; i < updater_functions_.size(); i++) {
+    const auto& f = updater_functions_[i];
+    json += StringPrintf("%s\n    {\"name\": %s, \"calls\": %zu, \"total_ms\": %.3f}",
+                         i == 0 ? "" : ",", JsonString(f.name).c_str(), f.calls, f.total_ms);
+  }
+  json += updater_functions_.empty() ? "]\n" : "\n  ]\n";
+  json += "}\n";
+  return json;
+}
+
+bool InstallTimeline::WriteToFile(const std::string& path) const {
+  if (!android::base::WriteStringToFile(ToJson(), path)) {
+    PLOG(ERROR) << "Failed to write the install timeline to " << path;
+    return false;
+  }
+  return true;
+}
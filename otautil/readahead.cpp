@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "otautil/readahead.h"
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include <android-base/logging.h>
+
+// The amount to read in one go. The lock isn't held while reading, so this only bounds how late
+// the thread notices a state change.
+static constexpr size_t kReadaheadChunk = 1024 * 1024;
+
+// From linux/ioprio.h, which isn't exported to userspace on all the platforms.
+static constexpr int kIoprioWhoProcess = 1;
+static constexpr int kIoprioClassIdle = 3;
+static constexpr int kIoprioClassShift = 13;
+
+PackageReadahead::PackageReadahead(const unsigned char* addr, size_t length, size_t window)
+    : addr_(addr), length_(length), window_(window) {}
+
+PackageReadahead::~PackageReadahead() {
+  Stop();
+}
+
+void PackageReadahead::Start() {
+  CHECK(!thread_.joinable());
+  thread_ = std::thread(&PackageReadahead::ThreadLoop, this);
+}
+
+void PackageReadahead::SetCursor(size_t offset) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (offset > cursor_) {
+    cursor_ = offset;
+    cv_.notify_all();
+  }
+}
+
+void PackageReadahead::FollowRanges(const std::vector<Range>& ranges, size_t budget) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  following_ranges_ = true;
+  ranges_ = ranges;
+  budget_ = budget;
+  cv_.notify_all();
+}
+
+void PackageReadahead::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopped_ = true;
+    cv_.notify_all();
+  }
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+PackageReadahead::Stats PackageReadahead::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+size_t PackageReadahead::Prefetch(size_t offset, size_t len) {
+  static const size_t page_size = sysconf(_SC_PAGESIZE);
+  uintptr_t start = reinterpret_cast<uintptr_t>(addr_ + offset) & ~(page_size - 1);
+  uintptr_t end = reinterpret_cast<uintptr_t>(addr_ + offset + len);
+  size_t pages = (end - start + page_size - 1) / page_size;
+
+  // Skip the pages that are already in memory. mincore(2) may fail on some mappings, in which case
+  // we read everything.
+  std::vector<unsigned char> resident(pages, 0);
+  mincore(reinterpret_cast<void*>(start), end - start, resident.data());
+  if (madvise(reinterpret_cast<void*>(start), end - start, MADV_WILLNEED) == -1) {
+    PLOG(DEBUG) << "madvise(MADV_WILLNEED) failed";
+  }
+
+  size_t read = 0;
+  for (size_t i = 0; i < pages; i++) {
+    if (resident[i] & 1) continue;
+    // Touching the page waits for the read that MADV_WILLNEED has started.
+    volatile unsigned char c = *reinterpret_cast<const unsigned char*>(start + i * page_size);
+    (void)c;
+    read += page_size;
+  }
+  return std::min(read, len);
+}
+
+void PackageReadahead::ThreadLoop() {
+  // Give way to the foreground I/O (i.e. the page faults of the verifier and the updater).
+  if (syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, kIoprioClassIdle << kIoprioClassShift) == -1) {
+    PLOG(WARNING) << "Failed to set the I/O priority of the readahead thread";
+  }
+
+  size_t next = 0;       // The next offset in the sequential phase.
+  size_t range_index = 0;
+  size_t range_offset = 0;
+  size_t ranged_bytes = 0;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopped_) {
+    size_t offset;
+    size_t len;
+    bool sequential = !following_ranges_;
+    if (sequential) {
+      if (next >= length_) {
+        // Wait for the ranges (or Stop()).
+        cv_.wait(lock, [this] { return stopped_ || following_ranges_; });
+        continue;
+      }
+      if (next >= cursor_ + window_) {
+        stats_.throttled++;
+        cv_.wait(lock, [this, next] {
+          return stopped_ || following_ranges_ || next < cursor_ + window_;
+        });
+        continue;
+      }
+      offset = next;
+      len = std::min(kReadaheadChunk, length_ - next);
+      next += len;
+    } else {
+      while (range_index < ranges_.size() && range_offset >= ranges_[range_index].length) {
+        range_index++;
+        range_offset = 0;
+      }
+      if (range_index >= ranges_.size() || ranged_bytes >= budget_) {
+        break;
+      }
+      const Range& range = ranges_[range_index];
+      if (range.offset >= length_) {
+        range_index++;
+        range_offset = 0;
+        continue;
+      }
+      offset = range.offset + range_offset;
+      len = std::min({ kReadaheadChunk, range.length - range_offset, length_ - offset });
+      range_offset += len;
+      ranged_bytes += len;
+    }
+
+    lock.unlock();
+    auto start = std::chrono::steady_clock::now();
+    size_t read = Prefetch(offset, len);
+    auto duration = std::chrono::steady_clock::now() - start;
+    lock.lock();
+
+    (sequential ? stats_.sequential_bytes : stats_.ranged_bytes) += read;
+    stats_.resident_bytes += len - read;
+    stats_.read_ms += std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
+  }
+}
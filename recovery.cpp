@@ -103,6 +103,7 @@ static const char *CACHE_LOG_DIR = "/cache/recovery";
 static const char *COMMAND_FILE = "/cache/recovery/command";
 static const char *LOG_FILE = "/cache/recovery/log";
 static const char *LAST_INSTALL_FILE = "/cache/recovery/last_install";
+static const char *LAST_INSTALL_TIMELINE_FILE = "/cache/recovery/last_install.json";
 static const char *LOCALE_FILE = "/cache/recovery/last_locale";
 static const char *CONVERT_FBE_DIR = "/tmp/convert_fbe";
 static const char *CONVERT_FBE_FILE = "/tmp/convert_fbe/convert_fbe";
@@ -112,6 +113,8 @@ static const char* METADATA_ROOT = "/metadata";
 static const char *SDCARD_ROOT = "/sdcard";
 static const char *TEMPORARY_LOG_FILE = "/tmp/recovery.log";
 static const char *TEMPORARY_INSTALL_FILE = "/tmp/last_install";
+// Written by install_package() next to the install file it's given.
+static const char *TEMPORARY_INSTALL_TIMELINE_FILE = "/tmp/last_install.json";
 static const char *LAST_KMSG_FILE = "/cache/recovery/last_kmsg";
 static const char *LAST_LOG_FILE = "/cache/recovery/last_log";
 // We will try to apply the update package 5 times at most in case of an I/O error or
@@ -473,6 +476,7 @@ static void copy_logs() {
     copy_log_file(TEMPORARY_LOG_FILE, LOG_FILE, true);
     copy_log_file(TEMPORARY_LOG_FILE, LAST_LOG_FILE, false);
     copy_log_file(TEMPORARY_INSTALL_FILE, LAST_INSTALL_FILE, false);
+    copy_log_file(TEMPORARY_INSTALL_TIMELINE_FILE, LAST_INSTALL_TIMELINE_FILE, false);
     save_kernel_log(LAST_KMSG_FILE);
     chmod(LOG_FILE, 0600);
     chown(LOG_FILE, AID_SYSTEM, AID_SYSTEM);
@@ -480,6 +484,7 @@ static void copy_logs() {
     chown(LAST_KMSG_FILE, AID_SYSTEM, AID_SYSTEM);
     chmod(LAST_LOG_FILE, 0640);
     chmod(LAST_INSTALL_FILE, 0644);
+    chmod(LAST_INSTALL_TIMELINE_FILE, 0644);
     sync();
 }
 
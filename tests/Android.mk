@@ -36,8 +36,10 @@ LOCAL_STATIC_LIBRARIES := \
 LOCAL_SRC_FILES := \
     unit/asn1_decoder_test.cpp \
     unit/dirutil_test.cpp \
+    unit/install_timeline_test.cpp \
     unit/locale_test.cpp \
     unit/rangeset_test.cpp \
+    unit/readahead_test.cpp \
     unit/sysutil_test.cpp \
     unit/zip_test.cpp \
 
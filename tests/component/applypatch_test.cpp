@@ -16,12 +16,16 @@
 
 #include <fcntl.h>
 #include <gtest/gtest.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <memory>
 #include <string>
@@ -32,10 +36,13 @@
 #include <android-base/test_utils.h>
 #include <bsdiff/bsdiff.h>
 #include <openssl/sha.h>
+#include <ziparchive/zip_archive.h>
+#include <ziparchive/zip_writer.h>
 
 #include "applypatch/applypatch.h"
 #include "applypatch/applypatch_modes.h"
 #include "common/test_constants.h"
+#include "otafault/config.h"
 #include "otautil/cache_location.h"
 #include "otautil/print_sha1.h"
 
@@ -166,6 +173,101 @@ TEST_F(ApplyPatchTest, CheckModeEmmcTarget) {
   ASSERT_EQ(0, applypatch_check(src_file.c_str(), sha1s));
 }
 
+TEST_F(ApplyPatchTest, LoadFileSha1) {
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  ASSERT_EQ(0, LoadFileSha1(old_file.c_str(), digest));
+  ASSERT_EQ(old_sha1, print_sha1(digest));
+
+  std::string src_file = "EMMC:" + new_file + ":" + std::to_string(old_size) + ":" + old_sha1 +
+                         ":" + std::to_string(new_size) + ":" + new_sha1;
+  ASSERT_EQ(0, LoadFileSha1(src_file.c_str(), digest));
+  ASSERT_EQ(new_sha1, print_sha1(digest));
+
+  // LoadFileContents() loads the matching prefix of the partition only.
+  FileContents fc;
+  ASSERT_EQ(0, LoadFileContents(src_file.c_str(), &fc));
+  ASSERT_EQ(new_sha1, print_sha1(fc.sha1));
+  ASSERT_EQ(new_size, fc.data.size());
+
+  ASSERT_NE(0, LoadFileSha1(nonexistent_file.c_str(), digest));
+
+  // An empty file.
+  TemporaryFile temp_file;
+  ASSERT_EQ(0, LoadFileSha1(temp_file.path, digest));
+  ASSERT_EQ("da39a3ee5e6b4b0d3255bfef95601890afd80709", print_sha1(digest));
+}
+
+TEST_F(ApplyPatchTest, WriteToPartitionUnalignedLength) {
+  // The read-back uses O_DIRECT (where supported), which rounds the reads up to the block size.
+  // The bytes past the end of the data must not be taken into the hash.
+  std::string content(3 * 4096 + 123, '\0');
+  for (size_t i = 0; i < content.size(); i++) {
+    content[i] = 'a' + i % 26;
+  }
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(std::string(5 * 4096, 'x'), temp_file.path));
+
+  std::string target = "EMMC:"s + temp_file.path;
+  ASSERT_EQ(0, WriteToPartition(reinterpret_cast<const unsigned char*>(content.data()),
+                                content.size(), target));
+
+  std::string written;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &written));
+  ASSERT_EQ(content, written.substr(0, content.size()));
+  ASSERT_EQ(std::string(5 * 4096 - content.size(), 'x'), written.substr(content.size()));
+}
+
+TEST_F(ApplyPatchTest, WriteToPartitionRetriesFailedVerify) {
+  std::string content(2 * 4096 + 10, 'a');
+  TemporaryFile temp_file;
+
+  // Have libotafault fail the first read of the target, i.e. the first read-back.
+  TemporaryFile zip_file;
+  FILE* zip_file_ptr = fdopen(zip_file.release(), "wb");
+  ZipWriter zip_writer(zip_file_ptr);
+  ASSERT_EQ(0, zip_writer.StartEntry(OTAIO_BASE_DIR "/" OTAIO_READ, 0));
+  ASSERT_EQ(0, zip_writer.WriteBytes(temp_file.path, strlen(temp_file.path)));
+  ASSERT_EQ(0, zip_writer.FinishEntry());
+  ASSERT_EQ(0, zip_writer.Finish());
+  ASSERT_EQ(0, fclose(zip_file_ptr));
+
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchive(zip_file.path, &handle));
+  ota_io_init(handle, false);
+
+  // The second attempt writes the same data again, and verifies it against the hash of the first.
+  std::string target = "EMMC:"s + temp_file.path;
+  int result = WriteToPartition(reinterpret_cast<const unsigned char*>(content.data()),
+                                content.size(), target);
+  ota_io_init(nullptr, false);
+  CloseArchive(handle);
+  ASSERT_EQ(0, result);
+
+  std::string written;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &written));
+  ASSERT_EQ(content, written);
+}
+
+TEST_F(ApplyPatchTest, WriteToPartitionShortTarget) {
+  // A target that can't hold all the data.
+  std::string content(4 * 4096, 'a');
+  TemporaryFile temp_file;
+  std::string target = "EMMC:"s + temp_file.path;
+
+  struct rlimit old_limit;
+  ASSERT_EQ(0, getrlimit(RLIMIT_FSIZE, &old_limit));
+  struct rlimit limit = old_limit;
+  limit.rlim_cur = 4096;
+  ASSERT_EQ(0, setrlimit(RLIMIT_FSIZE, &limit));
+  sighandler_t old_handler = signal(SIGXFSZ, SIG_IGN);
+
+  int result = WriteToPartition(reinterpret_cast<const unsigned char*>(content.data()),
+                                content.size(), target);
+  signal(SIGXFSZ, old_handler);
+  ASSERT_EQ(0, setrlimit(RLIMIT_FSIZE, &old_limit));
+  ASSERT_EQ(-1, result);
+}
+
 TEST_F(ApplyPatchCacheTest, CheckCacheCorruptedSourceSingle) {
   TemporaryFile temp_file;
   mangle_file(temp_file.path);
@@ -268,6 +370,68 @@ TEST_F(ApplyPatchModesTest, PatchModeEmmcTarget) {
   ASSERT_EQ(0, applypatch_modes(args3.size(), args3.data()));
 }
 
+// A patch that doesn't produce the expected SHA-1 has already overwritten the (in-place) target by
+// the time that is known. The backup of the source on /cache must survive, for the next attempt to
+// patch from.
+TEST_F(ApplyPatchModesTest, PatchModeEmmcTargetRollbackFromCache) {
+  std::string boot_img = from_testdata_base("boot.img");
+  size_t boot_img_size;
+  std::string boot_img_sha1;
+  sha1sum(boot_img, &boot_img_sha1, &boot_img_size);
+  std::string boot_img_content;
+  ASSERT_TRUE(android::base::ReadFileToString(boot_img, &boot_img_content));
+
+  std::string recovery_img = from_testdata_base("recovery.img");
+  size_t size;
+  std::string recovery_img_sha1;
+  sha1sum(recovery_img, &recovery_img_sha1, &size);
+  std::string recovery_img_size = std::to_string(size);
+
+  // The partition to patch in place, which holds boot.img to begin with.
+  TemporaryFile partition;
+  ASSERT_TRUE(android::base::WriteStringToFile(boot_img_content, partition.path));
+
+  // applypatch <src-file> - <bad-tgt-sha1> <tgt-size> <src-sha1>:<patch>
+  std::string src_file =
+      "EMMC:"s + partition.path + ":" + std::to_string(boot_img_size) + ":" + boot_img_sha1;
+  std::string patch = boot_img_sha1 + ":" + from_testdata_base("recovery-from-boot-with-bonus.p");
+  std::string bad_sha1 = android::base::StringPrintf("%040x", rand());
+  std::vector<const char*> args = {
+    "applypatch",
+    src_file.c_str(),
+    "-",
+    bad_sha1.c_str(),
+    recovery_img_size.c_str(),
+    patch.c_str()
+  };
+  ASSERT_NE(0, applypatch_modes(args.size(), args.data()));
+
+  // The partition no longer holds boot.img, but the backup does.
+  std::string sha1;
+  sha1sum(partition.path, &sha1);
+  ASSERT_NE(boot_img_sha1, sha1);
+  std::string backup;
+  ASSERT_TRUE(android::base::ReadFileToString(cache_source.path, &backup));
+  ASSERT_EQ(boot_img_content, backup);
+
+  // applypatch <src-file> - <tgt-sha1> <tgt-size> <src-sha1>:<patch>
+  std::vector<const char*> args2 = {
+    "applypatch",
+    src_file.c_str(),
+    "-",
+    recovery_img_sha1.c_str(),
+    recovery_img_size.c_str(),
+    patch.c_str()
+  };
+  ASSERT_EQ(0, applypatch_modes(args2.size(), args2.data()));
+
+  std::string recovery_img_content;
+  ASSERT_TRUE(android::base::ReadFileToString(recovery_img, &recovery_img_content));
+  std::string patched;
+  ASSERT_TRUE(android::base::ReadFileToString(partition.path, &patched));
+  ASSERT_EQ(recovery_img_content, patched.substr(0, recovery_img_content.size()));
+}
+
 // Ensures that applypatch works with a bsdiff based recovery-from-boot.p.
 TEST_F(ApplyPatchModesTest, PatchModeEmmcTargetWithBsdiffPatch) {
   std::string boot_img_file = from_testdata_base("boot.img");
@@ -385,3 +549,78 @@ TEST_F(ApplyPatchModesTest, CheckModeInvalidArgs) {
 TEST_F(ApplyPatchModesTest, ShowLicenses) {
   ASSERT_EQ(0, applypatch_modes(2, (const char* []){ "applypatch", "-l" }));
 }
+
+class FreeCacheTest : public ::testing::Test {
+ protected:
+  static constexpr size_t PARTITION_SIZE = 4096 * 20;
+
+  // Creates a file of 'blocks' blocks under the test directory, with the given mtime.
+  void AddFile(const std::string& name, size_t blocks, time_t mtime) {
+    std::string path = std::string(dir_.path) + "/" + name;
+    ASSERT_TRUE(android::base::WriteStringToFile(std::string(blocks * 4096, 'x'), path));
+    struct timespec times[2] = { { mtime, 0 }, { mtime, 0 } };
+    ASSERT_EQ(0, utimensat(AT_FDCWD, path.c_str(), times, 0));
+  }
+
+  std::vector<std::string> ListFiles() {
+    std::vector<std::string> names;
+    for (const auto& name : { "a", "b", "c", "d" }) {
+      if (access((std::string(dir_.path) + "/" + name).c_str(), F_OK) == 0) {
+        names.push_back(name);
+      }
+    }
+    return names;
+  }
+
+  void SetUp() override {
+    // 19 blocks in use, 1 block free.
+    AddFile("a", 10, 300);
+    AddFile("b", 3, 100);
+    AddFile("c", 5, 200);
+    AddFile("d", 1, 50);
+  }
+
+  void TearDown() override {
+    for (const auto& name : ListFiles()) {
+      unlink((std::string(dir_.path) + "/" + name).c_str());
+    }
+  }
+
+  TemporaryDir dir_;
+};
+
+TEST_F(FreeCacheTest, MakeFreeSpaceEnoughAlready) {
+  SimulatedFreeSpace free_space(PARTITION_SIZE, { dir_.path });
+  ASSERT_EQ(0, MakeFreeSpace(4096, { dir_.path }, free_space, CachePolicy::kMinimalSet));
+  ASSERT_EQ(std::vector<std::string>({ "a", "b", "c", "d" }), ListFiles());
+}
+
+TEST_F(FreeCacheTest, MakeFreeSpaceMinimalSet) {
+  SimulatedFreeSpace free_space(PARTITION_SIZE, { dir_.path });
+  // 5 more blocks needed: deleting "c" alone is enough.
+  ASSERT_EQ(0, MakeFreeSpace(4096 * 6, { dir_.path }, free_space, CachePolicy::kMinimalSet));
+  ASSERT_EQ(std::vector<std::string>({ "a", "b", "d" }), ListFiles());
+
+  // 13 more blocks needed: "a" (10 blocks), then "b" (3 blocks) covers the rest.
+  ASSERT_EQ(0, MakeFreeSpace(4096 * 19, { dir_.path }, free_space, CachePolicy::kMinimalSet));
+  ASSERT_EQ(std::vector<std::string>({ "d" }), ListFiles());
+}
+
+TEST_F(FreeCacheTest, MakeFreeSpaceOldestFirst) {
+  SimulatedFreeSpace free_space(PARTITION_SIZE, { dir_.path });
+  ASSERT_EQ(0, MakeFreeSpace(4096 * 6, { dir_.path }, free_space, CachePolicy::kOldestFirst));
+  // "d", "b" and "c" are the oldest, in that order.
+  ASSERT_EQ(std::vector<std::string>({ "a" }), ListFiles());
+}
+
+TEST_F(FreeCacheTest, MakeFreeSpaceLargestFirst) {
+  SimulatedFreeSpace free_space(PARTITION_SIZE, { dir_.path });
+  ASSERT_EQ(0, MakeFreeSpace(4096 * 6, { dir_.path }, free_space, CachePolicy::kLargestFirst));
+  ASSERT_EQ(std::vector<std::string>({ "b", "c", "d" }), ListFiles());
+}
+
+TEST_F(FreeCacheTest, MakeFreeSpaceNotEnough) {
+  SimulatedFreeSpace free_space(PARTITION_SIZE, { dir_.path });
+  ASSERT_EQ(-1, MakeFreeSpace(PARTITION_SIZE + 1, { dir_.path }, free_space,
+                              CachePolicy::kMinimalSet));
+}
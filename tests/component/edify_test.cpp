@@ -168,3 +168,21 @@ TEST_F(EdifyTest, unknown_function) {
     EXPECT_EQ(1, parse_string(script3, &expr, &error_count));
     EXPECT_EQ(1, error_count);
 }
+
+TEST_F(EdifyTest, profile_functions) {
+    const char* script = "concat(a, b); concat(c, d); is_substring(a, abc)";
+    std::unique_ptr<Expr> e;
+    int error_count = 0;
+    ASSERT_EQ(0, parse_string(script, &e, &error_count));
+
+    State state(script, nullptr);
+    std::string result;
+    ASSERT_TRUE(Evaluate(&state, e, &result));
+    ASSERT_TRUE(state.function_profile.empty());
+
+    state.profile_functions = true;
+    ASSERT_TRUE(Evaluate(&state, e, &result));
+    ASSERT_EQ(2U, state.function_profile["concat"].calls);
+    ASSERT_EQ(1U, state.function_profile["is_substring"].calls);
+    ASSERT_GE(state.function_profile["concat"].total_ms, 0);
+}
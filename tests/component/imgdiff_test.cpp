@@ -15,6 +15,7 @@
  */
 
 #include <stdio.h>
+#include <sys/stat.h>
 
 #include <algorithm>
 #include <string>
@@ -31,6 +32,7 @@
 #include <applypatch/imgpatch.h>
 #include <gtest/gtest.h>
 #include <ziparchive/zip_writer.h>
+#include <zlib.h>
 
 #include "common/test_constants.h"
 
@@ -245,6 +247,52 @@ TEST(ImgdiffTest, zip_mode_smoke_compressed) {
   verify_patched_image(src, patch, tgt);
 }
 
+TEST(ImgdiffTest, zip_mode_crc_mismatch) {
+  // Construct src and tgt zip files.
+  TemporaryFile src_file;
+  FILE* src_file_ptr = fdopen(src_file.release(), "wb");
+  ZipWriter src_writer(src_file_ptr);
+  ASSERT_EQ(0, src_writer.StartEntry("file1.txt", ZipWriter::kCompress));
+  const std::string src_content("abcdefg");
+  ASSERT_EQ(0, src_writer.WriteBytes(src_content.data(), src_content.size()));
+  ASSERT_EQ(0, src_writer.FinishEntry());
+  ASSERT_EQ(0, src_writer.Finish());
+  ASSERT_EQ(0, fclose(src_file_ptr));
+
+  TemporaryFile tgt_file;
+  FILE* tgt_file_ptr = fdopen(tgt_file.release(), "wb");
+  ZipWriter tgt_writer(tgt_file_ptr);
+  ASSERT_EQ(0, tgt_writer.StartEntry("file1.txt", ZipWriter::kCompress));
+  const std::string tgt_content("abcdefgxyz");
+  ASSERT_EQ(0, tgt_writer.WriteBytes(tgt_content.data(), tgt_content.size()));
+  ASSERT_EQ(0, tgt_writer.FinishEntry());
+  ASSERT_EQ(0, tgt_writer.Finish());
+  ASSERT_EQ(0, fclose(tgt_file_ptr));
+
+  // Change every copy of the entry's CRC-32 in the tgt zip, so that the headers agree with each
+  // other but not with the data.
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_file.path, &tgt));
+  uint32_t crc = crc32(0, reinterpret_cast<const uint8_t*>(tgt_content.data()), tgt_content.size());
+  std::string crc_bytes(reinterpret_cast<const char*>(&crc), sizeof(crc));
+  std::string bad_crc_bytes = crc_bytes;
+  bad_crc_bytes[0] ^= 0xff;
+  size_t replaced = 0;
+  for (size_t pos = tgt.find(crc_bytes); pos != std::string::npos; pos = tgt.find(crc_bytes, pos)) {
+    tgt.replace(pos, crc_bytes.size(), bad_crc_bytes);
+    replaced++;
+  }
+  ASSERT_LT(0U, replaced);
+  ASSERT_TRUE(android::base::WriteStringToFile(tgt, tgt_file.path));
+
+  // imgdiff should refuse to diff the corrupted entry.
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "-z", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(1, imgdiff(args.size(), args.data()));
+}
+
 TEST(ImgdiffTest, zip_mode_smoke_trailer_zeros) {
   // Construct src and tgt zip files.
   TemporaryFile src_file;
@@ -340,6 +388,181 @@ TEST(ImgdiffTest, image_mode_simple) {
   verify_patched_image(src, patch, tgt);
 }
 
+// Return a gzip member of |data| compressed with the given deflate level and strategy.
+static std::string GzipWithParams(const std::string& data, int level, int strategy) {
+  std::string gzip = { '\x1f', '\x8b', '\x08', '\x00', '\x00', '\x00',
+                       '\x00', '\x00', '\x00', '\x03' };
+
+  z_stream strm = {};
+  EXPECT_EQ(Z_OK, deflateInit2(&strm, level, Z_DEFLATED, -15, 8, strategy));
+  std::string compressed(deflateBound(&strm, data.size()), '\0');
+  strm.next_in = const_cast<Bytef*>(reinterpret_cast<const Bytef*>(data.data()));
+  strm.avail_in = data.size();
+  strm.next_out = reinterpret_cast<Bytef*>(&compressed[0]);
+  strm.avail_out = compressed.size();
+  EXPECT_EQ(Z_STREAM_END, deflate(&strm, Z_FINISH));
+  compressed.resize(strm.total_out);
+  deflateEnd(&strm);
+  gzip += compressed;
+
+  uint32_t footer[2] = {
+    static_cast<uint32_t>(
+        crc32(0, reinterpret_cast<const uint8_t*>(data.data()), data.size())),
+    static_cast<uint32_t>(data.size()),
+  };
+  gzip.append(reinterpret_cast<const char*>(footer), sizeof(footer));
+  return gzip;
+}
+
+// Return some compressible text that is generated from |seed|.
+static std::string GenerateText(uint32_t seed, size_t words) {
+  static const char* kWords[] = { "alpha ", "beta ", "gamma ", "delta ", "epsilon ", "zeta " };
+  std::string text;
+  for (size_t i = 0; i < words; i++) {
+    seed = seed * 1103515245 + 12345;
+    text += kWords[(seed >> 16) % 6];
+  }
+  return text;
+}
+
+TEST(ImgdiffTest, image_mode_deflate_params) {
+  // Each image has two gzip members, compressed with non-default deflate parameters.
+  const std::string src = "header" + GzipWithParams(GenerateText(1, 10000), 1, Z_DEFAULT_STRATEGY) +
+                          "middle" + GzipWithParams(GenerateText(2, 10000), 4, Z_FILTERED) +
+                          "footer";
+  const std::string tgt = "header" + GzipWithParams(GenerateText(3, 10000), 1, Z_DEFAULT_STRATEGY) +
+                          "middle" + GzipWithParams(GenerateText(4, 10000), 4, Z_FILTERED) +
+                          "footer";
+  TemporaryFile src_file;
+  TemporaryFile tgt_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src, src_file.path));
+  ASSERT_TRUE(android::base::WriteStringToFile(tgt, tgt_file.path));
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "--jobs=2", src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+  size_t num_deflate;
+  verify_patch_header(patch, nullptr, nullptr, &num_deflate);
+  ASSERT_EQ(2U, num_deflate);
+
+  // Both members are reconstructed, with the parameters stored in the chunk headers.
+  std::vector<std::pair<int, int>> params;
+  size_t pos = 12;
+  for (int i = 0; i < get_unaligned<int32_t>(patch.data() + 8); i++) {
+    int type = get_unaligned<int32_t>(patch.data() + pos);
+    pos += 4;
+    if (type == CHUNK_NORMAL) {
+      pos += 24;
+    } else if (type == CHUNK_RAW) {
+      pos += 4 + get_unaligned<int32_t>(patch.data() + pos);
+    } else if (type == CHUNK_DEFLATE) {
+      params.emplace_back(get_unaligned<int32_t>(patch.data() + pos + 40),
+                          get_unaligned<int32_t>(patch.data() + pos + 56));
+      pos += 60;
+    }
+  }
+  std::vector<std::pair<int, int>> expected = { { 1, Z_DEFAULT_STRATEGY }, { 4, Z_FILTERED } };
+  ASSERT_EQ(expected, params);
+
+  verify_patched_image(src, patch, tgt);
+}
+
+TEST(ImgdiffTest, image_mode_parallel_inflate) {
+  // Back-to-back gzip members, a spurious gzip magic and a member after some padding.
+  auto make_image = [](uint32_t seed) {
+    return "header" + GzipWithParams(GenerateText(seed, 10000), 6, Z_DEFAULT_STRATEGY) +
+           GzipWithParams(GenerateText(seed + 1, 5000), 9, Z_DEFAULT_STRATEGY) +
+           std::string("\x1f\x8b\x08\x00padding") + std::string(4096, '\0') +
+           GzipWithParams(GenerateText(seed + 2, 20000), 6, Z_DEFAULT_STRATEGY);
+  };
+  const std::string src = make_image(1);
+  const std::string tgt = make_image(10);
+  TemporaryFile src_file;
+  TemporaryFile tgt_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src, src_file.path));
+  ASSERT_TRUE(android::base::WriteStringToFile(tgt, tgt_file.path));
+
+  // The members are found and inflated the same way regardless of the number of jobs.
+  std::string patches[2];
+  const char* jobs_args[] = { "--jobs=1", "--jobs=4" };
+  for (size_t i = 0; i < 2; i++) {
+    TemporaryFile patch_file;
+    std::vector<const char*> args = {
+      "imgdiff", jobs_args[i], src_file.path, tgt_file.path, patch_file.path,
+    };
+    ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+    ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patches[i]));
+  }
+  ASSERT_EQ(patches[0], patches[1]);
+
+  size_t num_deflate;
+  verify_patch_header(patches[1], nullptr, nullptr, &num_deflate);
+  ASSERT_EQ(3U, num_deflate);
+
+  verify_patched_image(src, patches[1], tgt);
+}
+
+TEST(ImgdiffTest, bsdiff_format_bsdf2) {
+  // Both bsdiff formats, on a zip and on a gzip image.
+  TemporaryFile image_src_file;
+  TemporaryFile image_tgt_file;
+  const std::string text1 = GenerateText(1, 25000);
+  const std::string text2 = GenerateText(2, 25000);
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      GzipWithParams(text1 + text2, 6, Z_DEFAULT_STRATEGY), image_src_file.path));
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      GzipWithParams(text1 + GenerateText(3, 1000) + text2, 6, Z_DEFAULT_STRATEGY),
+      image_tgt_file.path));
+
+  std::string zip_src_path = from_testdata_base("deflate_src.zip");
+  std::string zip_tgt_path = from_testdata_base("deflate_tgt.zip");
+  const std::vector<std::tuple<std::string, std::string, std::string>> inputs = {
+    { "zip", zip_src_path, zip_tgt_path },
+    { "image", image_src_file.path, image_tgt_file.path },
+  };
+
+  for (const auto& input : inputs) {
+    const std::string& mode = std::get<0>(input);
+    const std::string& src_path = std::get<1>(input);
+    const std::string& tgt_path = std::get<2>(input);
+    std::string src;
+    std::string tgt;
+    ASSERT_TRUE(android::base::ReadFileToString(src_path, &src));
+    ASSERT_TRUE(android::base::ReadFileToString(tgt_path, &tgt));
+
+    for (const char* format : { "bsdiff40", "bsdf2" }) {
+      TemporaryFile patch_file;
+      std::string format_arg = android::base::StringPrintf("--bsdiff-format=%s", format);
+      std::vector<const char*> args = { "imgdiff", format_arg.c_str() };
+      if (mode == "zip") {
+        args.push_back("-z");
+      }
+      args.insert(args.end(), { src_path.c_str(), tgt_path.c_str(), patch_file.path });
+      ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+      std::string patch;
+      ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+      bool bsdf2 = strcmp(format, "bsdf2") == 0;
+      ASSERT_EQ(bsdf2, patch.find("BSDF2") != std::string::npos) << mode;
+      ASSERT_EQ(!bsdf2, patch.find("BSDIFF40") != std::string::npos) << mode;
+
+      verify_patched_image(src, patch, tgt);
+    }
+  }
+
+  // Unknown formats are rejected.
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "--bsdiff-format=xz", image_src_file.path, image_tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(1, imgdiff(args.size(), args.data()));
+}
+
 TEST(ImgdiffTest, image_mode_bad_gzip) {
   // Modify the uncompressed length in the gzip footer.
   const std::vector<char> src_data = { 'a',    'b',    'c',    'd',    'e',    'f',    'g',
@@ -486,6 +709,38 @@ TEST(ImgdiffTest, image_mode_spurious_magic) {
   verify_patched_image(src, patch, tgt);
 }
 
+TEST(ImgdiffTest, image_mode_spurious_magic_huge_isize) {
+  // src: "abcdefgh" + a spurious gzip header, followed by 4 MiB of non-deflate bytes that end with
+  // what would be an ISIZE of 4 GiB.
+  const std::string src = "abcdefgh" + std::string("\x1f\x8b\x08\x00\xc4\x1e\x53\x58\x00\x03", 10) +
+                          std::string(4 * 1024 * 1024, 'x') + "\xff\xff\xff\xff";
+  TemporaryFile src_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(src, src_file.path));
+
+  const std::string tgt = "abcdefgxyz" + std::string(4 * 1024 * 1024, 'x');
+  TemporaryFile tgt_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(tgt, tgt_file.path));
+
+  // The bogus size hint must not be taken at face value, on the sequential scan or by the
+  // background inflation.
+  for (const char* jobs_arg : { "--jobs=1", "--jobs=4" }) {
+    TemporaryFile patch_file;
+    std::vector<const char*> args = {
+      "imgdiff", jobs_arg, src_file.path, tgt_file.path, patch_file.path,
+    };
+    ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+    std::string patch;
+    ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+
+    size_t num_deflate;
+    verify_patch_header(patch, nullptr, nullptr, &num_deflate);
+    ASSERT_EQ(0U, num_deflate);
+
+    verify_patched_image(src, patch, tgt);
+  }
+}
+
 TEST(ImgdiffTest, image_mode_short_input1) {
   // src: "abcdefgh" + '0x1f8b0b'.
   const std::vector<char> src_data = { 'a', 'b', 'c',    'd',    'e',   'f',
@@ -636,6 +891,48 @@ TEST(ImgpatchTest, image_mode_patch_corruption) {
                                 [](const unsigned char* /*data*/, size_t len) { return len; }));
 }
 
+TEST(ImgpatchTest, zip_mode_apply_parallel) {
+  std::string src_path = from_testdata_base("deflate_src.zip");
+  std::string tgt_path = from_testdata_base("deflate_tgt.zip");
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "-z", src_path.c_str(), tgt_path.c_str(), patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_path, &src));
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_path, &tgt));
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+
+  size_t num_deflate;
+  verify_patch_header(patch, nullptr, nullptr, &num_deflate);
+  ASSERT_LT(1U, num_deflate);
+
+  // The output must be identical regardless of the number of worker threads.
+  for (size_t num_threads : { 1, 2, 4, 16 }) {
+    std::string patched;
+    ASSERT_EQ(0, ApplyImagePatch(reinterpret_cast<const unsigned char*>(src.data()), src.size(),
+                                 reinterpret_cast<const unsigned char*>(patch.data()),
+                                 patch.size(),
+                                 [&](const unsigned char* data, size_t len) {
+                                   patched.append(reinterpret_cast<const char*>(data), len);
+                                   return len;
+                                 },
+                                 num_threads));
+    ASSERT_EQ(tgt, patched) << "num_threads: " << num_threads;
+  }
+
+  // Corrupt the end of the patch and expect the parallel ApplyImagePatch to fail.
+  patch.insert(patch.end() - 10, 10, '0');
+  ASSERT_EQ(-1, ApplyImagePatch(reinterpret_cast<const unsigned char*>(src.data()), src.size(),
+                                reinterpret_cast<const unsigned char*>(patch.data()), patch.size(),
+                                [](const unsigned char* /*data*/, size_t len) { return len; }, 4));
+}
+
 static void construct_store_entry(const std::vector<std::tuple<std::string, size_t, char>>& info,
                                   ZipWriter* writer) {
   for (auto& t : info) {
@@ -885,6 +1182,98 @@ TEST(ImgdiffTest, zip_mode_deflate_large_apk) {
   GenerateAndCheckSplitTarget(debug_dir.path, 5, tgt);
 }
 
+TEST(ImgdiffTest, zip_mode_parallel_jobs) {
+  std::string tgt_path = from_testdata_base("deflate_tgt.zip");
+  std::string src_path = from_testdata_base("deflate_src.zip");
+
+  // Generate the patches with one job and with four jobs, both with and without a block limit.
+  // The patch and split info must be byte-identical.
+  for (const char* limit_arg : { "--block-limit=0", "--block-limit=10" }) {
+    std::string patches[2];
+    std::string split_infos[2];
+    const char* jobs_args[] = { "--jobs=1", "--jobs=4" };
+    for (size_t i = 0; i < 2; i++) {
+      TemporaryFile patch_file;
+      TemporaryFile split_info_file;
+      std::string split_info_arg =
+          android::base::StringPrintf("--split-info=%s", split_info_file.path);
+      std::vector<const char*> args = {
+        "imgdiff",        limit_arg,        split_info_arg.c_str(), jobs_args[i], "-z",
+        src_path.c_str(), tgt_path.c_str(), patch_file.path,
+      };
+      ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+      ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patches[i]));
+      ASSERT_TRUE(android::base::ReadFileToString(split_info_file.path, &split_infos[i]));
+    }
+    ASSERT_EQ(patches[0], patches[1]);
+    ASSERT_EQ(split_infos[0], split_infos[1]);
+  }
+
+  std::string src;
+  std::string tgt;
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(src_path, &src));
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_path, &tgt));
+
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "-z", "-j", "4", src_path.c_str(), tgt_path.c_str(), patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+  verify_patched_image(src, patch, tgt);
+
+  // Zero jobs is rejected.
+  args = { "imgdiff", "-z", "--jobs=0", src_path.c_str(), tgt_path.c_str(), patch_file.path };
+  ASSERT_EQ(1, imgdiff(args.size(), args.data()));
+}
+
+TEST(ImgdiffTest, zip_mode_profile) {
+  std::string tgt_path = from_testdata_base("deflate_tgt.zip");
+  std::string src_path = from_testdata_base("deflate_src.zip");
+
+  // Profiling doesn't change the patch.
+  TemporaryFile profile_file;
+  std::string profile_arg = android::base::StringPrintf("--profile=%s", profile_file.path);
+  std::string patches[2];
+  for (size_t i = 0; i < 2; i++) {
+    TemporaryFile patch_file;
+    TemporaryFile split_info_file;
+    std::string split_info_arg =
+        android::base::StringPrintf("--split-info=%s", split_info_file.path);
+    std::vector<const char*> args = {
+      "imgdiff", "-z", "--block-limit=10", split_info_arg.c_str(),
+    };
+    if (i == 1) {
+      args.push_back(profile_arg.c_str());
+    }
+    args.insert(args.end(), { src_path.c_str(), tgt_path.c_str(), patch_file.path });
+    ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+    ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patches[i]));
+  }
+  ASSERT_EQ(patches[0], patches[1]);
+
+  std::string profile;
+  ASSERT_TRUE(android::base::ReadFileToString(profile_file.path, &profile));
+  ASSERT_NE(std::string::npos, profile.find("\"mode\": \"zip\""));
+  for (const char* phase : { "load_source", "load_target", "reconstruct_deflate", "split_planning",
+                             "generate_patches", "bsdiff", "write_patch" }) {
+    ASSERT_NE(std::string::npos, profile.find(android::base::StringPrintf("\"%s\"", phase)))
+        << phase;
+  }
+
+  // There is one chunk entry per chunk in the patch pieces.
+  size_t num_chunks = 0;
+  for (size_t pos = 0; (pos = patches[1].find("IMGDIFF2", pos)) != std::string::npos; pos += 8) {
+    num_chunks += get_unaligned<int32_t>(patches[1].data() + pos + 8);
+  }
+  size_t num_entries = 0;
+  for (size_t pos = 0; (pos = profile.find("\"split\": ", pos)) != std::string::npos; pos++) {
+    num_entries++;
+  }
+  ASSERT_EQ(num_chunks, num_entries);
+}
+
 TEST(ImgdiffTest, zip_mode_no_match_source) {
   // Generate 20 blocks of random data.
   std::string random_data;
@@ -970,6 +1359,72 @@ TEST(ImgdiffTest, zip_mode_large_enough_limit) {
   GenerateAndCheckSplitTarget(debug_dir.path, 1, tgt);
 }
 
+TEST(ImgdiffTest, zip_mode_split_parallelism) {
+  // Generate 30 blocks of random data.
+  std::string random_data;
+  random_data.reserve(4096 * 30);
+  generate_n(back_inserter(random_data), 4096 * 30, []() { return rand() % 256; });
+
+  TemporaryFile tgt_file;
+  FILE* tgt_file_ptr = fdopen(tgt_file.release(), "wb");
+  ZipWriter tgt_writer(tgt_file_ptr);
+  construct_deflate_entry({ { "a", 0, 10 }, { "b", 10, 5 }, { "c", 15, 5 } }, &tgt_writer,
+                          random_data);
+  ASSERT_EQ(0, tgt_writer.Finish());
+  ASSERT_EQ(0, fclose(tgt_file_ptr));
+
+  TemporaryFile src_file;
+  FILE* src_file_ptr = fdopen(src_file.release(), "wb");
+  ZipWriter src_writer(src_file_ptr);
+  construct_deflate_entry({ { "a", 1, 10 }, { "b", 11, 5 }, { "c", 16, 5 } }, &src_writer,
+                          random_data);
+  ASSERT_EQ(0, src_writer.Finish());
+  ASSERT_EQ(0, fclose(src_file_ptr));
+
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_file.path, &tgt));
+
+  // The block limit alone fits everything into one piece, without the cost field.
+  TemporaryFile patch_file;
+  TemporaryFile split_info_file;
+  TemporaryDir debug_dir;
+  std::string split_info_arg = android::base::StringPrintf("--split-info=%s", split_info_file.path);
+  std::string debug_dir_arg = android::base::StringPrintf("--debug-dir=%s", debug_dir.path);
+  std::vector<const char*> args = {
+    "imgdiff", "-z", "--block-limit=40", split_info_arg.c_str(), debug_dir_arg.c_str(),
+    src_file.path, tgt_file.path, patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  std::string split_info;
+  ASSERT_TRUE(android::base::ReadFileToString(split_info_file.path, &split_info));
+  std::vector<std::string> lines = android::base::Split(split_info, "\n");
+  ASSERT_EQ(3U, lines.size());
+  ASSERT_EQ(3U, android::base::Split(lines[2], " ").size());
+  GenerateAndCheckSplitTarget(debug_dir.path, 1, tgt);
+
+  // Balancing for three appliers puts "a" alone, and "b" and "c" each into their own piece.
+  args.insert(args.begin() + 1, "--split-parallelism=3");
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  ASSERT_TRUE(android::base::ReadFileToString(split_info_file.path, &split_info));
+  lines = android::base::Split(split_info, "\n");
+  ASSERT_EQ("3", lines[1]);
+  ASSERT_EQ(5U, lines.size());
+  std::vector<size_t> costs;
+  for (size_t i = 2; i < lines.size(); i++) {
+    std::vector<std::string> fields = android::base::Split(lines[i], " ");
+    ASSERT_EQ(4U, fields.size());
+    costs.push_back(std::stoul(fields[3]));
+  }
+  // Each piece holds about a third of the total, except the first one with the larger entry.
+  ASSERT_GT(costs[0], costs[1]);
+  ASSERT_GT(costs[1], 0U);
+  ASSERT_GT(costs[2], 0U);
+
+  GenerateAndCheckSplitTarget(debug_dir.path, 3, tgt);
+}
+
 TEST(ImgdiffTest, zip_mode_large_apk_small_target_chunk) {
   TemporaryFile tgt_file;
   FILE* tgt_file_ptr = fdopen(tgt_file.release(), "wb");
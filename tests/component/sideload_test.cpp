@@ -14,14 +14,18 @@
  * limitations under the License.
  */
 
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include <functional>
 #include <string>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/strings.h>
 #include <android-base/test_utils.h>
+#include <android-base/unique_fd.h>
 #include <gtest/gtest.h>
 
 #include "fuse_sideload.h"
@@ -41,28 +45,15 @@ TEST(SideloadTest, run_fuse_sideload_wrong_parameters) {
   ASSERT_EQ(-1, run_fuse_sideload(vtab, ((1 << 18) + 1) * 4096, 4096));
 }
 
-TEST(SideloadTest, run_fuse_sideload) {
-  const std::vector<std::string> blocks = {
-    std::string(2048, 'a') + std::string(2048, 'b'),
-    std::string(2048, 'c') + std::string(2048, 'd'),
-    std::string(2048, 'e') + std::string(2048, 'f'),
-    std::string(2048, 'g') + std::string(2048, 'h'),
-  };
-  const std::string content = android::base::Join(blocks, "");
-  ASSERT_EQ(16384U, content.size());
-
-  provider_vtab vtab;
-  vtab.close = [](void) {};
-  vtab.read_block = [&blocks](uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
-    if (block >= 4) return -1;
-    blocks[block].copy(reinterpret_cast<char*>(buffer), fetch_size);
-    return 0;
-  };
-
+// Mounts the sideload filesystem in a child process, runs |test| against the package path and
+// then unmounts it through the exit flag.
+static void RunWithFuseSideload(const provider_vtab& vtab, uint64_t file_size, uint32_t block_size,
+                                const fuse_sideload_options& options,
+                                const std::function<void(const std::string&)>& test) {
   TemporaryDir mount_point;
   pid_t pid = fork();
   if (pid == 0) {
-    ASSERT_EQ(0, run_fuse_sideload(vtab, 16384, 4096, mount_point.path));
+    ASSERT_EQ(0, run_fuse_sideload(vtab, file_size, block_size, mount_point.path, options));
     _exit(EXIT_SUCCESS);
   }
 
@@ -84,9 +75,7 @@ TEST(SideloadTest, run_fuse_sideload) {
     FAIL() << "Timed out waiting for the fuse-provided package.";
   }
 
-  std::string content_via_fuse;
-  ASSERT_TRUE(android::base::ReadFileToString(package, &content_via_fuse));
-  ASSERT_EQ(content, content_via_fuse);
+  test(package);
 
   std::string exit_flag = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_EXIT_FLAG;
   struct stat sb;
@@ -96,3 +85,140 @@ TEST(SideloadTest, run_fuse_sideload) {
   ASSERT_EQ(0, WEXITSTATUS(status));
   ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
 }
+
+TEST(SideloadTest, run_fuse_sideload) {
+  const std::vector<std::string> blocks = {
+    std::string(2048, 'a') + std::string(2048, 'b'),
+    std::string(2048, 'c') + std::string(2048, 'd'),
+    std::string(2048, 'e') + std::string(2048, 'f'),
+    std::string(2048, 'g') + std::string(2048, 'h'),
+  };
+  const std::string content = android::base::Join(blocks, "");
+  ASSERT_EQ(16384U, content.size());
+
+  provider_vtab vtab;
+  vtab.close = [](void) {};
+  vtab.read_block = [&blocks](uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+    if (block >= 4) return -1;
+    blocks[block].copy(reinterpret_cast<char*>(buffer), fetch_size);
+    return 0;
+  };
+
+  RunWithFuseSideload(vtab, 16384, 4096, fuse_sideload_options(),
+                      [&content](const std::string& package) {
+                        std::string content_via_fuse;
+                        ASSERT_TRUE(android::base::ReadFileToString(package, &content_via_fuse));
+                        ASSERT_EQ(content, content_via_fuse);
+                      });
+}
+
+TEST(SideloadTest, run_fuse_sideload_block_cache) {
+  static constexpr uint32_t kBlocks = 16;
+  std::string content;
+  for (uint32_t i = 0; i < kBlocks; i++) {
+    content += std::string(4096, 'a' + i);
+  }
+  // The last block is a partial one.
+  content.resize(content.size() - 1000);
+
+  // The provider runs in the child, so count the fetches in memory shared with the parent.
+  void* shared = mmap(nullptr, kBlocks * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  ASSERT_NE(MAP_FAILED, shared);
+  uint32_t* fetches = static_cast<uint32_t*>(shared);
+
+  provider_vtab vtab;
+  vtab.close = [](void) {};
+  vtab.read_block = [&content, fetches](uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+    if (block >= kBlocks) return -1;
+    __atomic_add_fetch(&fetches[block], 1, __ATOMIC_SEQ_CST);
+    content.copy(reinterpret_cast<char*>(buffer), fetch_size, block * 4096);
+    return 0;
+  };
+
+  fuse_sideload_options options;
+  options.cache_blocks = kBlocks;
+  options.readahead_blocks = 4;
+  RunWithFuseSideload(vtab, content.size(), 4096, options, [&content](const std::string& package) {
+    // The second read is served from the cache.
+    for (size_t i = 0; i < 2; i++) {
+      std::string content_via_fuse;
+      ASSERT_TRUE(android::base::ReadFileToString(package, &content_via_fuse));
+      ASSERT_EQ(content, content_via_fuse);
+    }
+  });
+
+  // Each block is fetched once, whether on demand or by the read-ahead.
+  for (uint32_t i = 0; i < kBlocks; i++) {
+    ASSERT_EQ(1U, fetches[i]) << "block " << i;
+  }
+  munmap(shared, kBlocks * sizeof(uint32_t));
+}
+
+TEST(SideloadTest, run_fuse_sideload_altered_block) {
+  static constexpr uint32_t kBlocks = 8;
+  std::string content;
+  for (uint32_t i = 0; i < kBlocks; i++) {
+    content += std::string(4096, 'a' + i);
+  }
+
+  // Block 0 comes back different on the second fetch, which only happens after it has been evicted
+  // from the cache.
+  uint32_t block0_fetches = 0;
+  provider_vtab vtab;
+  vtab.close = [](void) {};
+  vtab.read_block = [&content, &block0_fetches](uint32_t block, uint8_t* buffer,
+                                                uint32_t fetch_size) {
+    if (block >= kBlocks) return -1;
+    content.copy(reinterpret_cast<char*>(buffer), fetch_size, block * 4096);
+    if (block == 0 && block0_fetches++ > 0) {
+      buffer[0] = 'z';
+    }
+    return 0;
+  };
+
+  fuse_sideload_options options;
+  options.cache_blocks = 2;
+  options.readahead_blocks = 0;
+  RunWithFuseSideload(vtab, content.size(), 4096, options, [&content](const std::string& package) {
+    std::string content_via_fuse;
+    ASSERT_TRUE(android::base::ReadFileToString(package, &content_via_fuse));
+    ASSERT_EQ(content, content_via_fuse);
+
+    // Reopening the file drops the kernel's page cache, so block 0 gets fetched again.
+    ASSERT_FALSE(android::base::ReadFileToString(package, &content_via_fuse));
+    ASSERT_EQ(EIO, errno);
+  });
+}
+
+TEST(SideloadTest, run_fuse_sideload_multi_block_reads) {
+  static constexpr uint32_t kBlocks = 64;
+  std::string content;
+  for (uint32_t i = 0; i < kBlocks; i++) {
+    content += std::string(4096, 'a' + i % 26);
+  }
+  content.resize(content.size() - 10);
+
+  provider_vtab vtab;
+  vtab.close = [](void) {};
+  vtab.read_block = [&content](uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+    if (block >= kBlocks) return -1;
+    content.copy(reinterpret_cast<char*>(buffer), fetch_size, block * 4096);
+    return 0;
+  };
+
+  // Reads of up to 16 blocks each, from several threads.
+  fuse_sideload_options options;
+  options.max_read = 16 * 4096;
+  options.threads = 3;
+  RunWithFuseSideload(vtab, content.size(), 4096, options, [&content](const std::string& package) {
+    android::base::unique_fd package_fd(open(package.c_str(), O_RDONLY));
+    ASSERT_NE(-1, package_fd.get());
+    std::string buffer(16 * 4096, '\0');
+    for (size_t offset : { 0, 100, 4096 * 10 + 7, 4096 * 63 }) {
+      size_t len = std::min(buffer.size(), content.size() - offset);
+      ASSERT_TRUE(android::base::ReadFullyAtOffset(package_fd, &buffer[0], len, offset));
+      ASSERT_EQ(content.substr(offset, len), buffer.substr(0, len));
+    }
+  });
+}
@@ -22,6 +22,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -177,6 +178,74 @@ TEST(VerifierTest, BadPackage_SignatureStartOutOfBounds) {
                                         package.size(), certs));
 }
 
+TEST(VerifierTest, MixedKeys_Progress) {
+  // A SHA-1 and a SHA-256 key, which has both digests computed concurrently.
+  std::vector<Certificate> certs;
+  ASSERT_TRUE(load_keys(from_testdata_base("testkey_v1.txt").c_str(), certs));
+  ASSERT_TRUE(load_keys(from_testdata_base("testkey_v3.txt").c_str(), certs));
+
+  MemMapping memmap;
+  ASSERT_TRUE(memmap.MapFile(from_testdata_base("otasigned_v3.zip")));
+
+  std::vector<float> progress;
+  ASSERT_EQ(VERIFY_SUCCESS, verify_file(memmap.addr, memmap.length, certs,
+                                        [&progress](float f) { progress.push_back(f); }));
+  ASSERT_GE(progress.size(), 2U);
+  ASSERT_EQ(0.0f, progress.front());
+  ASSERT_EQ(1.0f, progress.back());
+  ASSERT_TRUE(std::is_sorted(progress.begin(), progress.end()));
+}
+
+TEST(VerifierTest, ChunkedSignature_AlteredContent) {
+  std::vector<Certificate> certs;
+  ASSERT_TRUE(load_keys(from_testdata_base("testkey_v5.txt").c_str(), certs));
+
+  std::string package;
+  ASSERT_TRUE(
+      android::base::ReadFileToString(from_testdata_base("otasigned_v1_chunked_v5.zip"), &package));
+  const unsigned char* addr = reinterpret_cast<const unsigned char*>(package.data());
+  auto chunked = ChunkedSignature::Parse(addr, package.size(), certs);
+  ASSERT_NE(nullptr, chunked);
+  ASSERT_EQ(512U, chunked->chunk_size());
+  ASSERT_GT(chunked->chunk_count(), 2U);
+
+  // Alter the content of the second chunk. Only the ranges overlapping it fail to verify.
+  package[600] += 1;
+  chunked = ChunkedSignature::Parse(addr, package.size(), certs);
+  ASSERT_NE(nullptr, chunked);
+  ASSERT_TRUE(chunked->VerifyRange(0, 512));
+  ASSERT_FALSE(chunked->VerifyRange(500, 20));
+  ASSERT_TRUE(chunked->VerifyRange(1024, chunked->signed_len() - 1024));
+  ASSERT_FALSE(chunked->VerifyRange(0, chunked->signed_len() + 1));
+  ASSERT_FALSE(chunked->VerifyAll(4));
+  ASSERT_EQ(VERIFY_FAILURE, verify_file(addr, package.size(), certs));
+}
+
+TEST(VerifierTest, ChunkedSignature_AlteredTable) {
+  // The chunk table is signed by v5, and the whole-file signature by v1.
+  std::vector<Certificate> certs_v1;
+  ASSERT_TRUE(load_keys(from_testdata_base("testkey_v1.txt").c_str(), certs_v1));
+  std::vector<Certificate> certs_v5;
+  ASSERT_TRUE(load_keys(from_testdata_base("testkey_v5.txt").c_str(), certs_v5));
+
+  std::string package;
+  ASSERT_TRUE(
+      android::base::ReadFileToString(from_testdata_base("otasigned_v1_chunked_v5.zip"), &package));
+  const unsigned char* addr = reinterpret_cast<const unsigned char*>(package.data());
+
+  // Alter the first digest in the table, which starts the zip comment.
+  size_t comment_size = static_cast<unsigned char>(package[package.size() - 2]) +
+                        (static_cast<unsigned char>(package[package.size() - 1]) << 8);
+  size_t table_offset = package.size() - comment_size;
+  ASSERT_EQ("RCHUNKS1", package.substr(table_offset, 8));
+  package[table_offset + 30] += 1;
+
+  ASSERT_EQ(nullptr, ChunkedSignature::Parse(addr, package.size(), certs_v5));
+  ASSERT_EQ(VERIFY_FAILURE, verify_file(addr, package.size(), certs_v5));
+  // The comment isn't covered by the whole-file signature, which still verifies.
+  ASSERT_EQ(VERIFY_SUCCESS, verify_file(addr, package.size(), certs_v1));
+}
+
 TEST_P(VerifierSuccessTest, VerifySucceed) {
   ASSERT_EQ(verify_file(memmap.addr, memmap.length, certs, nullptr), VERIFY_SUCCESS);
 }
@@ -201,6 +270,13 @@ INSTANTIATE_TEST_CASE_P(MultiKeySuccess, VerifierSuccessTest,
       std::vector<std::string>({"otasigned_v4.zip", "v5", "v1", "v4"}),
       std::vector<std::string>({"otasigned_v5.zip", "v4", "v1", "v5"})));
 
+INSTANTIATE_TEST_CASE_P(ChunkedSuccess, VerifierSuccessTest,
+    ::testing::Values(
+      std::vector<std::string>({"otasigned_v3_chunked_v3.zip", "v3"}),
+      std::vector<std::string>({"otasigned_v1_chunked_v5.zip", "v5"}),
+      std::vector<std::string>({"otasigned_v1_chunked_v5.zip", "v1"}),
+      std::vector<std::string>({"otasigned_v1_chunked_v5.zip", "v3", "v5"})));
+
 INSTANTIATE_TEST_CASE_P(WrongKey, VerifierFailureTest,
     ::testing::Values(
       std::vector<std::string>({"otasigned_v1.zip", "v2"}),
@@ -209,6 +285,11 @@ INSTANTIATE_TEST_CASE_P(WrongKey, VerifierFailureTest,
       std::vector<std::string>({"otasigned_v4.zip", "v5"}),
       std::vector<std::string>({"otasigned_v5.zip", "v3"})));
 
+INSTANTIATE_TEST_CASE_P(ChunkedWrongKey, VerifierFailureTest,
+    ::testing::Values(
+      std::vector<std::string>({"otasigned_v1_chunked_v5.zip", "v3"}),
+      std::vector<std::string>({"otasigned_v3_chunked_v3.zip", "v4"})));
+
 INSTANTIATE_TEST_CASE_P(WrongHash, VerifierFailureTest,
     ::testing::Values(
       std::vector<std::string>({"otasigned_v1.zip", "v3"}),
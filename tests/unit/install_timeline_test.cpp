@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+#include <gtest/gtest.h>
+
+#include "otautil/install_timeline.h"
+
+TEST(InstallTimelineTest, ParseProcIo) {
+  std::string content =
+      "rchar: 4096\n"
+      "wchar: 1024\n"
+      "syscr: 12\n"
+      "syscw: 3\n"
+      "read_bytes: 8192\n"
+      "write_bytes: 512\n"
+      "cancelled_write_bytes: 0\n";
+  IoCounters counters;
+  ASSERT_TRUE(ParseProcIo(content, &counters));
+  ASSERT_EQ(4096U, counters.rchar);
+  ASSERT_EQ(1024U, counters.wchar);
+  ASSERT_EQ(8192U, counters.read_bytes);
+  ASSERT_EQ(512U, counters.write_bytes);
+
+  // Missing fields.
+  ASSERT_FALSE(ParseProcIo("rchar: 4096\nwchar: 1024\n", &counters));
+}
+
+TEST(InstallTimelineTest, ParseDiskstats) {
+  // Only the whole disks (sda and mmcblk0) are counted.
+  std::string content =
+      "   7       0 loop0 100 0 800 10 0 0 0 0 0 10 10\n"
+      "   8       0 sda 10 0 100 5 20 0 200 7 0 12 12\n"
+      "   8       1 sda1 5 0 60 2 10 0 120 3 0 5 5\n"
+      " 179       0 mmcblk0 30 2 1000 20 40 1 2000 30 0 50 50\n"
+      " 179       1 mmcblk0p1 10 0 400 5 10 0 800 10 0 15 15\n"
+      " 253       0 dm-0 50 0 3000 20 60 0 4000 30 0 50 50\n"
+      " 254       0 zram0 1 0 8 0 1 0 8 0 0 0 0\n";
+  IoCounters counters;
+  ASSERT_TRUE(ParseDiskstats(content, &counters));
+  ASSERT_EQ((100U + 1000U) * 512, counters.disk_read_bytes);
+  ASSERT_EQ((200U + 2000U) * 512, counters.disk_write_bytes);
+
+  ASSERT_FALSE(ParseDiskstats("", &counters));
+}
+
+TEST(InstallTimelineTest, AddUpdaterFunction) {
+  InstallTimeline timeline;
+  ASSERT_TRUE(timeline.AddUpdaterFunction("updater_function: block_image_update 1 5321"));
+  ASSERT_TRUE(timeline.AddUpdaterFunction("updater_function: mount 3 12"));
+  ASSERT_FALSE(timeline.AddUpdaterFunction("uncrypt_time: 12"));
+  ASSERT_FALSE(timeline.AddUpdaterFunction("updater_function: mount x 12"));
+
+  const auto& functions = timeline.updater_functions();
+  ASSERT_EQ(2U, functions.size());
+  ASSERT_EQ("block_image_update", functions[0].name);
+  ASSERT_EQ(1U, functions[0].calls);
+  ASSERT_DOUBLE_EQ(5321, functions[0].total_ms);
+  ASSERT_EQ("mount", functions[1].name);
+  ASSERT_EQ(3U, functions[1].calls);
+}
+
+TEST(InstallTimelineTest, Phases) {
+  InstallTimeline timeline;
+  {
+    InstallTimeline::ScopedPhase phase(&timeline, "map_package");
+  }
+  // A null timeline records nothing.
+  {
+    InstallTimeline::ScopedPhase phase(nullptr, "verify_package");
+  }
+  IoCounters io;
+  io.disk_read_bytes = 4096;
+  io.disk_write_bytes = 512;
+  timeline.AddPhase({ "updater", 1.0, 1500.4, io });
+
+  ASSERT_EQ(2U, timeline.phases().size());
+  ASSERT_EQ("map_package", timeline.phases()[0].name);
+  ASSERT_GE(timeline.phases()[0].duration_ms, 0);
+
+  std::vector<std::string> lines = timeline.ToLogLines();
+  ASSERT_EQ(6U, lines.size());
+  ASSERT_EQ("timeline_updater_ms: 1500", lines[3]);
+  ASSERT_EQ("timeline_updater_disk_read_bytes: 4096", lines[4]);
+  ASSERT_EQ("timeline_updater_disk_write_bytes: 512", lines[5]);
+
+  timeline.AddUpdaterFunction("updater_function: mount 3 12");
+  TemporaryFile temp_file;
+  ASSERT_TRUE(timeline.WriteToFile(temp_file.path));
+  std::string json;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file.path, &json));
+  ASSERT_NE(std::string::npos, json.find("\"name\": \"updater\""));
+  ASSERT_NE(std::string::npos, json.find("\"disk_read_bytes\": 4096"));
+  ASSERT_NE(std::string::npos,
+            json.find("{\"name\": \"mount\", \"calls\": 3, \"total_ms\": 12.000}"));
+}
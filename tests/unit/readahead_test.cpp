@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+#include <gtest/gtest.h>
+
+#include "otautil/SysUtil.h"
+#include "otautil/readahead.h"
+
+using namespace std::chrono_literals;
+
+static constexpr size_t MiB = 1024 * 1024;
+
+// Waits until the readahead thread has gone through |bytes| bytes.
+static PackageReadahead::Stats WaitForBytes(const PackageReadahead& readahead, size_t bytes) {
+  PackageReadahead::Stats stats;
+  for (int i = 0; i < 1000; i++) {
+    stats = readahead.GetStats();
+    if (stats.sequential_bytes + stats.ranged_bytes + stats.resident_bytes >= bytes) {
+      break;
+    }
+    std::this_thread::sleep_for(10ms);
+  }
+  return stats;
+}
+
+TEST(ReadaheadTest, FollowCursorAndRanges) {
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(std::string(8 * MiB, 'x'), temp_file.path));
+  MemMapping mapping;
+  ASSERT_TRUE(mapping.MapFile(temp_file.path));
+
+  // With a zero window, the thread can't get ahead of the cursor.
+  PackageReadahead readahead(mapping.addr, mapping.length, 0);
+  readahead.Start();
+  readahead.SetCursor(2 * MiB);
+  PackageReadahead::Stats stats = WaitForBytes(readahead, 2 * MiB);
+  ASSERT_EQ(0U, stats.ranged_bytes);
+  ASSERT_EQ(2 * MiB, stats.sequential_bytes + stats.resident_bytes);
+  std::this_thread::sleep_for(50ms);
+  stats = readahead.GetStats();
+  ASSERT_EQ(2 * MiB, stats.sequential_bytes + stats.resident_bytes);
+  ASSERT_GE(stats.throttled, 1U);
+
+  // The ranges are followed until the budget runs out. Ranges beyond the end are ignored.
+  readahead.FollowRanges({ { 4 * MiB, 3 * MiB / 2 }, { 0, 4096 }, { 16 * MiB, MiB } }, MiB + 1);
+  WaitForBytes(readahead, 2 * MiB + MiB + MiB / 2);
+  readahead.Stop();
+  stats = readahead.GetStats();
+  ASSERT_EQ(2 * MiB + MiB + MiB / 2,
+            stats.sequential_bytes + stats.ranged_bytes + stats.resident_bytes);
+}
+
+TEST(ReadaheadTest, StopEarly) {
+  TemporaryFile temp_file;
+  ASSERT_TRUE(android::base::WriteStringToFile(std::string(MiB, 'x'), temp_file.path));
+  MemMapping mapping;
+  ASSERT_TRUE(mapping.MapFile(temp_file.path));
+
+  // Stopping (or destroying) the object joins the thread, whatever phase it's in.
+  PackageReadahead readahead(mapping.addr, mapping.length, 0);
+  readahead.Start();
+  readahead.Stop();
+  readahead.Stop();
+}
@@ -79,10 +79,18 @@ TEST(SysUtilTest, MapFileBlockMap) {
   ASSERT_EQ(file_size, mapping.length);
   ASSERT_EQ(1U, mapping.ranges());
 
-  // Multiple ranges.
+  // Multiple ranges that are physically contiguous get merged into one.
   block_map_content = std::string(package.path) + "\n40960 4096\n3\n0 3\n3 5\n5 10\n";
   ASSERT_TRUE(android::base::WriteStringToFile(block_map_content, block_map_file.path));
 
+  ASSERT_TRUE(mapping.MapFile(filename));
+  ASSERT_EQ(file_size, mapping.length);
+  ASSERT_EQ(1U, mapping.ranges());
+
+  // Multiple discontiguous ranges.
+  block_map_content = std::string(package.path) + "\n40960 4096\n3\n0 3\n5 10\n3 5\n";
+  ASSERT_TRUE(android::base::WriteStringToFile(block_map_content, block_map_file.path));
+
   ASSERT_TRUE(mapping.MapFile(filename));
   ASSERT_EQ(file_size, mapping.length);
   ASSERT_EQ(3U, mapping.ranges());
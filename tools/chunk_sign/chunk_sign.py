@@ -0,0 +1,234 @@
+#!/usr/bin/env python
+# Copyright (C) 2018 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""
+Adds a signed chunk table to (or verifies the chunk table of) an OTA package
+that already carries a whole-file signature, e.g. one produced by
+'signapk.jar -w'. The table holds the SHA-256 digests of the fixed-size
+chunks of the signed range of the package, which lets recovery verify the
+chunks in parallel or on demand. See ChunkedSignature in verifier.h for the
+format.
+
+The table goes at the start of the zip comment, ahead of the whole-file
+signature. The comment isn't covered by the whole-file signature, so the
+package still verifies on recovery images that don't know about the table.
+
+Usage:
+  chunk_sign.py sign [--chunk-size N] key.pk8 input.zip output.zip
+  chunk_sign.py verify cert.x509.pem package.zip
+
+Signing uses the openssl command line tool. RSA and EC keys are supported.
+"""
+
+from __future__ import print_function
+
+import argparse
+import hashlib
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+MAGIC = b"RCHUNKS1"
+HEADER_FORMAT = "<8sIIQ"
+HEADER_SIZE = struct.calcsize(HEADER_FORMAT)
+EOCD_MAGIC = b"PK\x05\x06"
+EOCD_HEADER_SIZE = 22
+FOOTER_SIZE = 6
+MAX_COMMENT_SIZE = 65535
+DEFAULT_CHUNK_SIZE = 1024 * 1024
+
+
+class PackageError(Exception):
+  pass
+
+
+class Package(object):
+  """The signature layout of a package, as described by its footer."""
+
+  def __init__(self, data):
+    if len(data) < FOOTER_SIZE:
+      raise PackageError("Not big enough to contain the footer")
+    signature_start, marker, comment_size = struct.unpack(
+        "<HHH", data[-FOOTER_SIZE:])
+    if marker != 0xffff:
+      raise PackageError("No whole-file signature footer; sign the package "
+                         "with 'signapk.jar -w' first")
+    if signature_start > comment_size or signature_start <= FOOTER_SIZE:
+      raise PackageError("Invalid signature start %d" % (signature_start,))
+    eocd_size = comment_size + EOCD_HEADER_SIZE
+    if len(data) < eocd_size:
+      raise PackageError("Not big enough to contain the EOCD")
+    self.eocd = len(data) - eocd_size
+    if data[self.eocd:self.eocd + 4] != EOCD_MAGIC:
+      raise PackageError("Comment size doesn't match the EOCD marker")
+
+    self.data = data
+    self.signed_len = self.eocd + EOCD_HEADER_SIZE - 2
+    comment = data[self.eocd + EOCD_HEADER_SIZE:]
+    # The legacy part of the comment: the whole-file signature and the footer.
+    self.legacy_comment = comment[len(comment) - signature_start:]
+    self.table = comment[:len(comment) - signature_start]
+
+  def ParseTable(self):
+    """Returns (chunk_size, digests, signed_data, signature) of the table."""
+    if self.table[:len(MAGIC)] != MAGIC or len(self.table) < HEADER_SIZE:
+      raise PackageError("No chunk table")
+    _, chunk_size, chunk_count, signed_len = struct.unpack(
+        HEADER_FORMAT, self.table[:HEADER_SIZE])
+    if (chunk_size == 0 or signed_len != self.signed_len or
+        chunk_count != (signed_len + chunk_size - 1) // chunk_size):
+      raise PackageError("Invalid chunk table header")
+    digests_end = HEADER_SIZE + chunk_count * 32
+    if len(self.table) < digests_end + 4:
+      raise PackageError("Truncated chunk table")
+    signature_size, = struct.unpack("<I", self.table[digests_end:digests_end + 4])
+    signature = self.table[digests_end + 4:digests_end + 4 + signature_size]
+    if len(signature) != signature_size:
+      raise PackageError("Truncated chunk table signature")
+    digests = [self.table[HEADER_SIZE + i * 32:HEADER_SIZE + (i + 1) * 32]
+               for i in range(chunk_count)]
+    return chunk_size, digests, self.table[:digests_end], signature
+
+  def ChunkDigests(self, chunk_size):
+    return [hashlib.sha256(self.data[offset:min(offset + chunk_size,
+                                                self.signed_len)]).digest()
+            for offset in range(0, self.signed_len, chunk_size)]
+
+
+def RunOpenssl(args, stdin=None):
+  p = subprocess.Popen(["openssl"] + args, stdin=subprocess.PIPE,
+                       stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+  out, err = p.communicate(stdin)
+  if p.returncode != 0:
+    raise PackageError("openssl %s failed: %s" % (args[0], err.decode()))
+  return out
+
+
+def Sign(key_file, signed_data):
+  with open(key_file, "rb") as f:
+    pk8 = f.read()
+  pem = RunOpenssl(["pkcs8", "-inform", "DER", "-nocrypt"], pk8)
+  with tempfile.NamedTemporaryFile(suffix=".pem") as key:
+    key.write(pem)
+    key.flush()
+    return RunOpenssl(["dgst", "-sha256", "-sign", key.name], signed_data)
+
+
+def VerifySignature(cert_file, signed_data, signature):
+  pubkey = RunOpenssl(["x509", "-pubkey", "-noout", "-in", cert_file])
+  with tempfile.NamedTemporaryFile(suffix=".pem") as key, \
+      tempfile.NamedTemporaryFile(suffix=".sig") as sig:
+    key.write(pubkey)
+    key.flush()
+    sig.write(signature)
+    sig.flush()
+    try:
+      RunOpenssl(["dgst", "-sha256", "-verify", key.name, "-signature",
+                  sig.name], signed_data)
+    except PackageError:
+      return False
+  return True
+
+
+def SignPackage(args):
+  with open(args.input, "rb") as f:
+    package = Package(f.read())
+  data = package.data
+
+  # Grow the chunks until the table fits in the comment along with the
+  # whole-file signature. The 1 KiB accounts for the table signature.
+  chunk_size = args.chunk_size
+  while (HEADER_SIZE + 32 * ((package.signed_len + chunk_size - 1) // chunk_size)
+         + 4 + 1024 + len(package.legacy_comment) > MAX_COMMENT_SIZE):
+    chunk_size *= 2
+  if chunk_size != args.chunk_size:
+    print("Using a chunk size of %d to fit the comment" % (chunk_size,))
+
+  digests = package.ChunkDigests(chunk_size)
+  signed_data = struct.pack(HEADER_FORMAT, MAGIC, chunk_size, len(digests),
+                            package.signed_len) + b"".join(digests)
+  signature = Sign(args.key, signed_data)
+  table = signed_data + struct.pack("<I", len(signature)) + signature
+
+  comment = table + package.legacy_comment
+  # The footer ends with the comment size.
+  comment = comment[:-2] + struct.pack("<H", len(comment))
+  # libziparchive looks for the last EOCD marker, so one in the comment would
+  # make the package unusable (and recovery rejects it).
+  if EOCD_MAGIC in data[package.eocd + 4:package.eocd + EOCD_HEADER_SIZE - 2] + \
+      struct.pack("<H", len(comment)) + comment:
+    raise PackageError("The chunk table contains an EOCD marker; try another "
+                       "chunk size")
+
+  with open(args.output, "wb") as f:
+    f.write(data[:package.eocd + EOCD_HEADER_SIZE - 2])
+    f.write(struct.pack("<H", len(comment)))
+    f.write(comment)
+  print("Added a chunk table of %d chunks of %d bytes" % (len(digests),
+                                                          chunk_size))
+
+
+def VerifyPackage(args):
+  with open(args.package, "rb") as f:
+    package = Package(f.read())
+  chunk_size, digests, signed_data, signature = package.ParseTable()
+  if not VerifySignature(args.cert, signed_data, signature):
+    raise PackageError("The chunk table isn't signed by " + args.cert)
+
+  bad_chunks = [i for i, (expected, actual) in
+                enumerate(zip(digests, package.ChunkDigests(chunk_size)))
+                if expected != actual]
+  for i in bad_chunks:
+    print("Chunk %d (offset %d) doesn't match the table" % (i, i * chunk_size))
+  if bad_chunks:
+    raise PackageError("%d of %d chunks don't match" % (len(bad_chunks),
+                                                          len(digests)))
+  print("Verified %d chunks of %d bytes" % (len(digests), chunk_size))
+
+
+def main(argv):
+  parser = argparse.ArgumentParser(description=__doc__,
+                                   formatter_class=argparse.RawDescriptionHelpFormatter)
+  subparsers = parser.add_subparsers(dest="command")
+  subparsers.required = True
+
+  sign = subparsers.add_parser("sign", help="Add a signed chunk table")
+  sign.add_argument("--chunk-size", type=int, default=DEFAULT_CHUNK_SIZE,
+                    help="The chunk size in bytes (default: %(default)s)")
+  sign.add_argument("key", help="The private key, in PKCS#8 DER format")
+  sign.add_argument("input")
+  sign.add_argument("output")
+  sign.set_defaults(func=SignPackage)
+
+  verify = subparsers.add_parser("verify", help="Verify the chunk table")
+  verify.add_argument("cert", help="The X.509 certificate in PEM format")
+  verify.add_argument("package")
+  verify.set_defaults(func=VerifyPackage)
+
+  args = parser.parse_args(argv)
+  if getattr(args, "chunk_size", 1) <= 0:
+    parser.error("--chunk-size must be positive")
+  try:
+    args.func(args)
+  except (PackageError, IOError) as e:
+    print("%s: %s" % (os.path.basename(sys.argv[0]), e), file=sys.stderr)
+    return 1
+  return 0
+
+
+if __name__ == "__main__":
+  sys.exit(main(sys.argv[1:]))
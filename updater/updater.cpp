@@ -16,6 +16,7 @@
 
 #include "updater/updater.h"
 
+#include <ctype.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -169,9 +170,20 @@ int main(int argc, char** argv) {
   }
   ota_io_init(za, state.is_retry);
 
+  state.profile_functions = true;
   std::string result;
   bool status = Evaluate(&state, root, &result);
 
+  // Report the time spent in each function, which recovery adds to the install timeline. The
+  // operators (e.g. ";" and "&&") only add up their operands, so skip them.
+  for (const auto& entry : state.function_profile) {
+    const std::string& name = entry.first;
+    if (!name.empty() && (isalpha(name[0]) || name[0] == '_')) {
+      fprintf(cmd_pipe, "log updater_function: %s %zu %.0f\n", name.c_str(), entry.second.calls,
+              entry.second.total_ms);
+    }
+  }
+
   if (have_eio_error) {
     fprintf(cmd_pipe, "retry_update\n");
   }
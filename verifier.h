@@ -17,6 +17,10 @@
 #ifndef _RECOVERY_VERIFIER_H
 #define _RECOVERY_VERIFIER_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
 #include <functional>
 #include <memory>
 #include <vector>
@@ -70,6 +74,60 @@ int verify_file(const unsigned char* addr, size_t length, const std::vector<Cert
 
 bool load_keys(const char* filename, std::vector<Certificate>& certs);
 
+/*
+ * An optional signature scheme on top of the whole-file signature: a signed table of the SHA-256
+ * digests of the fixed-size chunks of the package, stored in the zip comment. Once the table's
+ * signature is verified, the chunks can be verified independently, either in parallel or lazily
+ * as each region of the package gets read. A package carrying the table still has the legacy
+ * whole-file signature, so it's accepted by recovery images that don't know about the table.
+ */
+class ChunkedSignature {
+ public:
+  // Parses the chunk table of the package, and verifies its signature against |keys|. Returns
+  // nullptr if the package doesn't carry a chunk table or it isn't signed by any of the keys.
+  static std::unique_ptr<ChunkedSignature> Parse(const unsigned char* addr, size_t length,
+                                                 const std::vector<Certificate>& keys);
+
+  size_t chunk_size() const {
+    return chunk_size_;
+  }
+  size_t chunk_count() const {
+    return chunk_count_;
+  }
+  // The length of the package prefix covered by the table (and the whole-file signature).
+  size_t signed_len() const {
+    return signed_len_;
+  }
+
+  // Verifies the given chunk against the table. The result is cached. Thread-safe.
+  bool VerifyChunk(size_t index);
+
+  // Verifies all the chunks that overlap [offset, offset + len), which must be within the signed
+  // length. Thread-safe.
+  bool VerifyRange(size_t offset, size_t len);
+
+  // Verifies all the chunks on up to |threads| threads (including the calling one), posting the
+  // progress to |set_progress| if given. Stops at the first mismatching chunk.
+  bool VerifyAll(size_t threads, const std::function<void(float)>& set_progress = nullptr);
+
+ private:
+  enum ChunkState : uint8_t {
+    kUnverified,
+    kGood,
+    kBad,
+  };
+
+  ChunkedSignature(const unsigned char* addr, size_t signed_len, size_t chunk_size,
+                   std::vector<uint8_t>&& digests);
+
+  const unsigned char* addr_;
+  size_t signed_len_;
+  size_t chunk_size_;
+  size_t chunk_count_;
+  std::vector<uint8_t> digests_;
+  std::unique_ptr<std::atomic<uint8_t>[]> states_;
+};
+
 #define VERIFY_SUCCESS        0
 #define VERIFY_FAILURE        1
 